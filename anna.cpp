@@ -15,6 +15,7 @@
 #include <vector>
 #include <deque>
 #include <list>
+#include <map>
 #include <regex>
 #include <unistd.h>
 #include <errno.h>
@@ -23,6 +24,10 @@
 #include "brain.h"
 #include "lscs.h"
 #include "netclient.h"
+#include "rqpmatch.h"
+#include "coproc.h"
+#include "batch.h"
+#include "flatjson.h"
 
 #define CLI_VERSION "0.9.0"
 
@@ -44,9 +49,8 @@ using namespace std;
 struct anna_requester {
     string prefix, suffix;
     string command;
-    int fsm, lpos;
-    //bool is_regex;
-    //regex bex, eex;
+    bool persistent = false;
+    shared_ptr<AnnaCoprocess> proc;
 };
 
 const char* argstrings[] = {
@@ -56,11 +60,19 @@ const char* argstrings[] = {
     "[-p prompt_file]",
     "[-f forced_token]",
     "[-c cache_file]",
+    "[-X] (reload cached prompt on context overflow flag)",
     "[-n n_tokens]",
     "[-e temperature]",
     "[-u user_input_prefix]",
     "[-x context_length]",
     "[-r request_prefix request_suffix request_command]",
+    "[-C request_prefix request_suffix persistent_plugin_command]",
+    "[-w request_timeout_ms]",
+    "[-l request_output_limit]",
+    "[-a] (asynchronous requests flag)",
+    "[-B batch_jsonl_file]",
+    "[-O batch_output_file]",
+    "[-j number_of_parallel_sequences]",
     "[-v] (verbose flag)",
     "[-T terminator_string]",
     "[-P] (pipeline flag)",
@@ -72,17 +84,21 @@ const char* argstrings[] = {
     "[-V vision_projector]",
     "[-i image_file]",
     "[-g group_attn_n:group_attn_w]",
+    "[-W sliding_window_chunk (0 = auto)]",
     "[-R server_URL]",
+    "[-A] (fused attention flag)",
     NULL
 };
 
 AnnaBrain* brain = nullptr;
-bool g_once = false, g_quit = false, g_pipemode = false;
-int g_first = 0;
-string g_inbuf, g_tokenf, g_scache, g_terminator, g_vclip, g_raw_output, g_server;
+bool g_quit = false, g_pipemode = false, g_rqp_async = false, g_cache_reload = false;
+int g_first = 0, g_rqp_timeout = ANNA_COPROC_TIMEOUT_MS, g_batch_par = 4;
+size_t g_rqp_maxout = ANNA_COPROC_MAX_OUTPUT;
+string g_inbuf, g_tokenf, g_scache, g_terminator, g_vclip, g_raw_output, g_server, g_batch_in, g_batch_out;
 vector<string> g_uprefix;
 deque<string> g_sprompts;
 vector<anna_requester> g_requesters;
+AnnaRQPMatcher g_rqp_matcher;
 bool g_last_username = false;
 
 void usage(const char* sname)
@@ -113,7 +129,7 @@ int set_params(AnnaConfig& cfg, int argc, char* argv[])
     gpt_params* p = &cfg.params;
     llama_sampling_params* sp = &p->sparams;
 
-    while ((opt = getopt(argc,argv,"m:s:t:p:f:c:n:e:u:x:r:vT:PSNG:F:M:V:i:g:R:")) != -1) {
+    while ((opt = getopt(argc,argv,"m:s:t:p:f:c:Xn:e:u:x:r:C:w:l:aB:O:j:vT:PSNG:F:M:V:i:g:W:R:A")) != -1) {
         switch (opt) {
         case 'm':
             strncpy(p->model,optarg,sizeof(p->model)-1);
@@ -136,6 +152,9 @@ int set_params(AnnaConfig& cfg, int argc, char* argv[])
         case 'c':
             g_scache = optarg;
             break;
+        case 'X':
+            g_cache_reload = true;
+            break;
         case 'n':
             p->n_predict = atoi(optarg);
             break;
@@ -149,17 +168,40 @@ int set_params(AnnaConfig& cfg, int argc, char* argv[])
             p->n_ctx = atoi(optarg);
             break;
         case 'r':
+        case 'C':
             {
+                if (optind + 1 >= argc) {
+                    usage(argv[0]);
+                    return -1;
+                }
                 anna_requester ar;
-                ar.fsm = 0;
-                ar.lpos = 0;
                 ar.prefix = argv[optind-1];
                 ar.suffix = argv[optind++];
                 ar.command = argv[optind++];
+                ar.persistent = (opt == 'C');
                 g_requesters.push_back(ar);
-                DBG("Requester added: ['%s' / '%s'] -> '%s'\n",ar.prefix.c_str(),ar.suffix.c_str(),ar.command.c_str());
+                g_rqp_matcher.addRequester(ar.prefix,ar.suffix);
+                DBG("%s requester added: ['%s' / '%s'] -> '%s'\n",ar.persistent? "Persistent":"One-shot",ar.prefix.c_str(),ar.suffix.c_str(),ar.command.c_str());
             }
             break;
+        case 'w':
+            g_rqp_timeout = atoi(optarg);
+            break;
+        case 'l':
+            g_rqp_maxout = atoll(optarg);
+            break;
+        case 'a':
+            g_rqp_async = true;
+            break;
+        case 'B':
+            g_batch_in = optarg;
+            break;
+        case 'O':
+            g_batch_out = optarg;
+            break;
+        case 'j':
+            g_batch_par = atoi(optarg);
+            break;
         case 'v':
             cfg.verbose_level++;
             break;
@@ -194,9 +236,16 @@ int set_params(AnnaConfig& cfg, int argc, char* argv[])
         case 'g':
             sscanf(optarg,"%d:%d",&p->grp_attn_n,&p->grp_attn_w);
             break;
+        case 'W':
+            cfg.ctx_policy = ANNA_CTX_WINDOW;
+            cfg.ctx_chunk = atoi(optarg);
+            break;
         case 'R':
             g_server = optarg;
             break;
+        case 'A':
+            p->flash_attn = true;
+            break;
         default:
             usage(argv[0]);
             return -1;
@@ -209,6 +258,12 @@ int set_params(AnnaConfig& cfg, int argc, char* argv[])
 
     p->n_threads_batch = p->n_threads;
 
+    // now, when all the limits are known, the requesters can be started
+    for (auto &i : g_requesters) {
+        i.proc = make_shared<AnnaCoprocess>(i.persistent? i.command : "",i.persistent);
+        i.proc->setLimits(g_rqp_timeout,g_rqp_maxout);
+    }
+
     return 0;
 }
 
@@ -262,22 +317,6 @@ string get_input(bool* skip_next, bool* force_prefix)
     return s;
 }
 
-string run_request(string cmd)
-{
-    FILE* proc = popen(cmd.c_str(),"r");
-    if (!proc) {
-        ERR("Unable to execute process '%s'\n",cmd.c_str());
-        return string();
-    }
-
-    int c;
-    string res;
-    while ((c = fgetc(proc)) != EOF) res += c;
-
-    pclose(proc);
-    return res;
-}
-
 void default_config(AnnaConfig& cfg)
 {
     cfg.convert_eos_to_nl = true;
@@ -317,73 +356,78 @@ list<string> complete_rqp(const string& in, anna_requester& st)
     return res;
 }
 
-/* Back-ported from AnnaGraphica */
-list<string> detect_rqp(const string& in, anna_requester& st)
+void inject_rqp(anna_requester& rq, const string& out)
 {
-    list<string> res;
-    int i = -1, l = 0;
-    switch (st.fsm) {
-    case 0:
-        //if (st.is_regex) {
-            //st.bex = QRegExp(start);
-            //st.eex = QRegExp(stop);
-            //if (st.bex.isValid()) {
-                //i = st.bex.indexIn(in,st.lpos);
-                //l = st.bex.matchedLength();
-            //}
-        //} else {
-            i = in.find(st.prefix,st.lpos);
-            l = st.prefix.length();
-        //}
-        if (i >= 0) {
-            st.fsm++;
-            st.lpos = i + l;
+    DBG("Output: '%s'\n",out.c_str());
+    if (out.empty()) {
+        string err = rq.proc->getError();
+        if (!err.empty()) ERR("Requester '%s' failed: %s\n",rq.command.c_str(),err.c_str());
+        return;
+    }
+    brain->setInput(out);
+    while (brain->Processing(true) == ANNA_PROCESSING) ;
+}
+
+void check_rqps(const string& fresh)
+{
+    for (auto &m : g_rqp_matcher.feed(fresh)) {
+        anna_requester & rq = g_requesters.at(m.id);
+        if (rq.persistent) {
+            // persistent plugins receive the body itself, no command line is involved
+            DBG("RQP payload: '%s'\n",m.body.c_str());
+            rq.proc->Request(m.body);
+
+        } else {
+            auto lst = complete_rqp(m.body,rq);
+            if (lst.empty()) continue;
+
+            string cmd;
+            for (auto &j : lst) {
+                if (cmd.empty()) cmd = j;
+                else cmd += " \"" + j + "\"";
+            }
+            DBG("RQP compiled: '%s'\n",cmd.c_str());
+            rq.proc->Request(cmd);
         }
-        break;
-
-    case 1:
-        //if (st.is_regex && st.bex.isValid()) {
-            //i = st.eex.indexIn(in,st.lpos);
-            //l = st.eex.matchedLength();
-        //} else {
-            i = in.find(st.suffix,st.lpos);
-            l = st.suffix.length();
-        //}
-        if (i >= 0) {
-            res = complete_rqp(in.substr(st.lpos,i-st.lpos),st);
-            st.fsm = 0;
-            st.lpos = i + l;
+
+        if (!g_rqp_async) {
+            string out;
+            if (rq.proc->Wait(out)) inject_rqp(rq,out);
         }
-        break;
     }
-
-    return res;
 }
 
-void check_rqps(string buf)
+// injects the results of asynchronous requests; returns true if anything is still in flight
+bool poll_rqps(bool wait)
 {
+    bool busy = false;
+    string out;
     for (auto &i : g_requesters) {
-        auto lst = detect_rqp(buf,i);
-        if (lst.empty()) continue;
-
-        string cmd;
-        for (auto &j : lst) {
-            if (cmd.empty()) cmd = j;
-            else cmd += " \"" + j + "\"";
+        if (wait) {
+            while (i.proc->Wait(out)) inject_rqp(i,out);
+        } else {
+            // busy state must be checked first, otherwise a result might slip in unnoticed
+            busy = i.proc->isBusy() || busy;
+            while (i.proc->getResult(out)) inject_rqp(i,out);
         }
-        DBG("RQP compiled: '%s'\n",cmd.c_str());
-        string out = run_request(cmd);
-        DBG("Output: '%s'\n",out.c_str());
-        brain->setInput(out);
-        while (brain->Processing(true) == ANNA_PROCESSING) ;
     }
+    return busy;
+}
+
+// checks whether (head + tail) ends with str, without actually concatenating them
+bool ends_with_split(const string& head, const string& tail, const string& str)
+{
+    if (tail.length() >= str.length()) return tail.ends_with(str);
+    size_t rem = str.length() - tail.length();
+    if (head.length() < rem) return false;
+    return !head.compare(head.length()-rem,rem,str,0,rem) && !str.compare(rem,string::npos,tail);
 }
 
 /* Back-ported from AnnaGraphica */
 bool generate(bool skip, bool force)
 {
     AnnaState s = ANNA_NOT_INITIALIZED;
-    string str,convo;
+    string str,convo,fresh;
 
     if (force) brain->setPrefix(g_tokenf);
     g_last_username = false;
@@ -405,6 +449,7 @@ bool generate(bool skip, bool force)
             printf("%s",str.c_str());
             fflush(stdout);
             convo += str;
+            fresh = str;
             for (auto &i : g_uprefix) {
                 if (convo.ends_with(i)) {
                     g_last_username = true;
@@ -428,17 +473,27 @@ bool generate(bool skip, bool force)
             return false;
         }
 
-        string atm = g_raw_output + convo;
-
         // check for terminate condition
-        if (!g_terminator.empty() && atm.ends_with(g_terminator)) {
+        if (!g_terminator.empty() && ends_with_split(g_raw_output,convo,g_terminator)) {
             DBG("Terminator found, exiting...\n");
             g_quit = true;
             break;
         }
 
         // now we can check the RQPs, execute stuff and inject things into LLM, all in this one convenient call
-        check_rqps(atm);
+        // (only the newly generated text is fed into the matcher)
+        if (!fresh.empty()) {
+            check_rqps(fresh);
+            fresh.clear();
+        }
+
+        // pick up whatever the asynchronous requests have produced so far;
+        // the turn can't end while some of them are still running, so the model gets to see all the results
+        if (g_rqp_async && poll_rqps(false) && s == ANNA_TURNOVER) {
+            DBG("Waiting for requesters to finish...\n");
+            poll_rqps(true);
+            if (!skip && !g_last_username) s = ANNA_PROCESSING;
+        }
     }
 
     g_raw_output += convo;
@@ -455,11 +510,8 @@ bool load_cache()
         tmp.resize(len);
         g_raw_output = std::move(tmp);
 
-        // and don't forget to update RQPs so they won't re-fire
-        for (auto &i : g_requesters) {
-            i.fsm = 0;
-            i.lpos = g_raw_output.length();
-        }
+        // and don't forget to reset RQPs so they won't re-fire
+        g_rqp_matcher.reset();
         printf("Success!\n");
     } else
         ERR("Unable to load state: %s\n",brain->getError().c_str());
@@ -558,8 +610,10 @@ string cli(bool& skip_sampling, bool& force_prefix, bool& no_input)
         printf("\n\n***CONTEXT***\n%s\n\n",brain->PrintContext().c_str());
 
     } else if (inp_str == "stats()\n") {
-        // TODO: extend this
+        AnnaTimings t = brain->getTimings();
         printf("n_past = %d\n",brain->getTokensUsed());
+        printf("per-token latency over the last %d tokens: mean = %.2f ms, p50 = %.2f ms, p99 = %.2f ms, max = %.2f ms\n",
+               t.n_tokens,t.mean_ms,t.p50_ms,t.p99_ms,t.max_ms);
 
     } else if (inp_str == "quit()\n") {
         g_quit = true;
@@ -572,6 +626,123 @@ string cli(bool& skip_sampling, bool& force_prefix, bool& no_input)
     return out_str;
 }
 
+bool batch_job(const string& line, int index, AnnaBatchJob& job, string& id, string& err)
+{
+    AnnaJSONRecord rec;
+    if (!rec.parse(line)) {
+        err = rec.getError();
+        return false;
+    }
+    id = rec.json("id");
+    if (!rec.isString("prompt")) {
+        err = "No prompt";
+        return false;
+    }
+
+    const llama_sampling_params & def = brain->getConfig().params.sparams;
+    job.index = index;
+    job.prompt = rec.str("prompt");
+    job.n_predict = rec.num("n_predict",-1);
+    job.sparams = def;
+    job.sparams.temp = rec.num("temp",rec.num("temperature",def.temp));
+    job.sparams.top_k = rec.num("top_k",def.top_k);
+    job.sparams.top_p = rec.num("top_p",def.top_p);
+    job.sparams.min_p = rec.num("min_p",def.min_p);
+    job.sparams.penalty_repeat = rec.num("repeat_penalty",def.penalty_repeat);
+    job.sparams.penalty_last_n = rec.num("repeat_last_n",def.penalty_last_n);
+    job.sparams.mirostat = rec.num("mirostat",def.mirostat);
+    return true;
+}
+
+int batch_mode(AnnaConfig& cfg)
+{
+    ifstream fin(g_batch_in);
+    if (!fin) {
+        ERR("Failed to open file '%s'",g_batch_in.c_str());
+        return 20;
+    }
+    FILE* fout = g_batch_out.empty()? stdout : fopen(g_batch_out.c_str(),"w");
+    if (!fout) {
+        ERR("Failed to open file '%s' for writing",g_batch_out.c_str());
+        return 21;
+    }
+
+    cfg.params.n_parallel = g_batch_par;
+    AnnaBatch* bat = new AnnaBatch(&cfg);
+    brain = bat;
+    if (bat->getState() == ANNA_ERROR) {
+        ERR("Unable to create brain: %s\n",bat->getError().c_str());
+        return 10;
+    }
+    if (!bat->setSharedPrompt(cfg.params.prompt)) {
+        ERR("Unable to process the prompt: %s\n",bat->getError().c_str());
+        return 11;
+    }
+
+    timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC,&t0);
+    int n_lines = 0, n_ok = 0, n_fail = 0;
+    long long n_prompt = 0, n_gen = 0;
+    map<int,string> ids;
+    string line;
+    bool eof = false;
+
+    while (!g_quit) {
+        // keep the queue just deep enough to refill the slots
+        while (!eof && bat->getPending() < bat->getNumSlots() * 2) {
+            if (!getline(fin,line)) {
+                eof = true;
+                break;
+            }
+            if (line.find_first_not_of(" \t\r") == string::npos) continue;
+
+            AnnaBatchJob job;
+            string id, err;
+            int idx = n_lines++;
+            if (batch_job(line,idx,job,id,err)) {
+                ids[idx] = id;
+                bat->addJob(job);
+            } else {
+                fprintf(fout,"{\"index\":%d,\"id\":%s,\"error\":%s}\n",idx,id.empty()? "null":id.c_str(),AnnaJSONRecord::escape(err).c_str());
+                n_fail++;
+            }
+        }
+
+        AnnaState s = bat->Processing();
+
+        AnnaBatchResult r;
+        while (bat->getResult(r)) {
+            string id = ids[r.index];
+            ids.erase(r.index);
+            if (r.ok) {
+                double tps = (r.t_gen > 0)? (double)r.n_gen * 1000.0 / r.t_gen : 0;
+                fprintf(fout,"{\"index\":%d,\"id\":%s,\"output\":%s,\"n_prompt\":%d,\"n_gen\":%d,"
+                        "\"t_wait_ms\":%.2f,\"t_prompt_ms\":%.2f,\"t_gen_ms\":%.2f,\"tokens_per_s\":%.2f}\n",
+                        r.index,id.c_str(),AnnaJSONRecord::escape(r.output).c_str(),r.n_prompt,r.n_gen,r.t_wait,r.t_prompt,r.t_gen,tps);
+                n_ok++;
+                n_prompt += r.n_prompt;
+                n_gen += r.n_gen;
+            } else {
+                fprintf(fout,"{\"index\":%d,\"id\":%s,\"error\":%s}\n",r.index,id.c_str(),AnnaJSONRecord::escape(r.error).c_str());
+                n_fail++;
+            }
+            fflush(fout);
+        }
+
+        if (s == ANNA_READY && eof) break;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC,&t1);
+    double dt = (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec) / 1e9;
+    fprintf(stderr,"\nBatch done: %d records (%d OK, %d failed) in %.2f s\n",n_lines,n_ok,n_fail,dt);
+    fprintf(stderr,"Prompt tokens: %lld, generated tokens: %lld\n",n_prompt,n_gen);
+    if (dt > 0) fprintf(stderr,"Throughput: %.2f tokens/s generated, %.2f tokens/s total\n",(double)n_gen/dt,(double)(n_prompt+n_gen)/dt);
+
+    if (fout != stdout) fclose(fout);
+    delete bat;
+    return n_fail? 1 : 0;
+}
+
 int main(int argc, char* argv[])
 {
     fprintf(stderr,"ANNA version " ANNA_VERSION "\n");
@@ -587,6 +758,9 @@ int main(int argc, char* argv[])
     }
     if (set_params(cfg,argc,argv)) return -1;
 
+    // offline batch processing is a completely different mode of operation
+    if (!g_batch_in.empty()) return batch_mode(cfg);
+
     // create new brain, LSCS, or brain connector
     if (g_server.empty()) {
         string fn = cfg.params.model;
@@ -600,7 +774,8 @@ int main(int argc, char* argv[])
         return 10;
     }
 
-    // process the prompt
+    // process the prompt (or load its state from the cache)
+    if (!g_scache.empty()) brain->setPromptCache(g_scache,g_cache_reload);
     brain->setInput(cfg.params.prompt);
     while (brain->Processing(true) == ANNA_PROCESSING) ;
     if (brain->getState() == ANNA_ERROR) {
@@ -621,30 +796,15 @@ int main(int argc, char* argv[])
     bool no_input = false;
 
     if (cfg.verbose_level) {
-        printf("\nSeed: %d\n",brain->getConfig().params.seed);
+        printf("\nSystem info: %s\n",llama_print_system_info());
+        printf("Seed: %d\n",brain->getConfig().params.seed);
         printf("Prompt size: %d tokens\n",brain->getTokensUsed());
         // TODO more info?
     }
 
-    // FIXME: return auto-cache functionality some day soon
-    /*bool populate_cache = !g_scache.empty();
-    if (populate_cache && load_cache(ctx,n_past,ctx_sampling->prev)) {
-        inp_emb.clear();
-        populate_cache = false;
-        llama_set_rng_seed(ctx,params.seed);
-        if (params.prompt[0] == 0) reload_on_reset = true;
-    }*/
-
     while (!g_quit) {
         DBG("loop start: skip=%d; force=%d; noin=%d\n",skip_sampling,force_prefix,no_input);
 
-        // FIXME: return auto-cache functionality some day soon
-        // The model is ready now, so we can process one-shot actions
-        /*if (!g_once) {
-            g_once = true;
-            if (populate_cache) save_cache(ctx,n_past,ctx_sampling->prev);
-        }*/
-
         size_t pre_gen = g_raw_output.length();
         if (!generate(skip_sampling,force_prefix)) {
             ERR("Error: %s\n",brain->getError().c_str());
@@ -6,7 +6,9 @@ CONFIG += c++20
 
 SOURCES += \
     ../aria.cpp \
+    ../ariaremote.cpp \
     ../lscs.cpp \
+    ../trace.cpp \
     aboutbox.cpp \
     busybox.cpp \
     helpbox.cpp \
@@ -22,10 +24,13 @@ SOURCES += \
 HEADERS += \
     ../aria.h \
     ../aria_binds.h \
+    ../ariaremote.h \
     ../lfs.h \
     ../lscs.h \
     ../md5calc.h \
     ../netclient.h \
+    ../rqpmatch.h \
+    ../trace.h \
     ../server/base64m.h \
     ../server/codec.h \
     ../vecstore.h \
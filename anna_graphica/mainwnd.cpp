@@ -3,6 +3,10 @@
 #include <chrono>
 #include <string.h>
 #include <unistd.h>
+#include <QEventLoop>
+#include <QThread>
+#include <QTextDocument>
+#include <QTextDocumentFragment>
 #include "mainwnd.h"
 #include "ui_mainwnd.h"
 #include "settingsdialog.h"
@@ -31,6 +35,14 @@ MainWnd::MainWnd(QWidget *parent)
     ui->AttachmentsList->setIconSize(QSize(AG_ICON_W,AG_ICON_H));
     ui->AINameBox->completer()->setCaseSensitivity(Qt::CaseSensitive);
     ui->UserNameBox->completer()->setCaseSensitivity(Qt::CaseSensitive);
+    ui->ChatLog->setUndoRedoEnabled(false); // it's a log, and the streamed messages would fill up the undo stack
+
+    // the tokens come from the generation thread, and are shown with a capped frame rate
+    render_timer = new QTimer(this);
+    render_timer->setInterval(AG_RENDER_PERIOD_MS);
+    connect(render_timer,&QTimer::timeout,this,&MainWnd::onRenderTimer);
+    connect(this,&MainWnd::tokenGenerated,this,&MainWnd::onTokenGenerated,Qt::QueuedConnection);
+    gen_active = false;
 
     block = 0;
     on_actionSimple_view_triggered();
@@ -41,6 +53,7 @@ MainWnd::MainWnd(QWidget *parent)
     last_username.clear();
     nowait = false;
     tokens_cnt = 0;
+    stop = false;
 
     ui->statusbar->showMessage("ANNA ver. " ANNA_VERSION " GUI ver. " AG_VERSION " NC ver. " ANNA_CLIENT_VERSION);
 }
@@ -322,9 +335,8 @@ bool MainWnd::EmbedImage(const QString& fn)
     return res;
 }
 
-QString MainWnd::CheckUsrPrefix(QString& convo)
+QString MainWnd::CheckUsrPrefix(QString& convo, const QString& usrbox)
 {
-    QString usrbox = ui->UserNameBox->currentText();
     bool multi = (!usrbox.isEmpty()) && guiconfig.multi_usr && (!guiconfig.musr_delim.isEmpty()) && usrbox.contains(guiconfig.musr_delim);
     if (!multi) {
         if (!usrbox.isEmpty() && convo.endsWith(usrbox)) {
@@ -364,24 +376,77 @@ bool MainWnd::CheckStopWords(QString &convo)
 
 void MainWnd::Generate()
 {
-    AnnaState s = ANNA_NOT_INITIALIZED;
-    string str;
-    QString convo;
+    if (!brain) return;
     stop = false;
     ++block;
 
     // make sure to update the UI state ASAP - to let user know it's working
     ui->statusbar->showMessage("Brain state: thinking...");
-    qApp->processEvents();
+    ui->ContextFull->setMaximum(config.params.n_ctx);
+
+    // the log is fully rendered only once per message, then only the new message is re-rendered
+    UpdateChatLogFrom(cur_chat);
+    QTextCursor cur(ui->ChatLog->document());
+    cur.movePosition(QTextCursor::End);
+    if (cur_chat.endsWith("\n")) cur.insertBlock();
+    gen_pos = cur.position();
+    gen_text.clear();
+    gen_dirty = false;
+
+    // with RQPs, each token must be checked (and the RQP's output injected) before the next one is generated
+    gen_sync = !rqps.empty();
+    gen_acked = false;
+    gen_user = last_username;
+    gen_active = true;
+    nowait = true; // the brain's waits would come from the generation thread, not from the GUI thread
+    render_timer->start();
+
+    // the brain is working in its own thread, while the UI is kept alive by the local event loop
+    QEventLoop loop;
+    connect(this,&MainWnd::generationFinished,&loop,&QEventLoop::quit,Qt::QueuedConnection);
+    std::thread th(&MainWnd::GenerateLoop,this,ui->SamplingCheck->isChecked(),ui->stopNL->isChecked(),ui->UserNameBox->currentText());
+    loop.exec();
+
+    // the loop might have been interrupted by the application's exit
+    {
+        lock_guard<mutex> lk(gen_mtx);
+        stop = true;
+        gen_acked = true;
+    }
+    gen_cv.notify_all();
+    th.join();
+    gen_active = false;
+    render_timer->stop();
+    last_username = gen_user;
+
+    // restore the global state and update the text widgets
+    nowait = false;
+    --block;
+    cur_chat += gen_convo + "\n";
+    if (brain) CheckRQPs("\n"); // the turnover is also a part of the raw output
+
+    QString sstr = "Brain state: " + QString::fromStdString(AnnaBrain::StateToStr(gen_state));
+    if (gen_state == ANNA_ERROR) sstr += " (" + QString::fromStdString(brain->getError()) + ")";
+    ui->statusbar->showMessage(sstr);
+    ui->ContextFull->setValue(tokens_cnt);
+    UpdateChatLogFrom(cur_chat);
+}
+
+void MainWnd::GenerateLoop(bool sampling, bool stop_nl, QString usrbox)
+{
+    AnnaState s = ANNA_NOT_INITIALIZED;
+    string str;
+    QString convo, fresh;
+    AnnaLSCS* is_lscs = dynamic_cast<AnnaLSCS*>(brain);
 
-    // main LLM generation loop - continues until brain is deleted (in processEvents()), or turnover, or error
-    while (brain && !stop) {
-        s = brain->Processing(ui->SamplingCheck->isChecked());
+    // main LLM generation loop - continues until stopped, or turnover, or error
+    while (!stop) {
+        s = brain->Processing(sampling);
         //qDebug("s = %s",AnnaBrain::StateToStr(s).c_str());
 
         switch (s) {
         case ANNA_READY:
-            if (ui->SamplingCheck->isChecked()) {
+            if (sampling) {
                 s = ANNA_TURNOVER;
                 break;
             }
@@ -389,14 +454,15 @@ void MainWnd::Generate()
 
         case ANNA_TURNOVER:
             str = brain->getOutput();
-            convo += QString::fromStdString(str);
-            if (ui->stopNL->isChecked() && str.find('\n') != string::npos) //stop at NL
+            fresh = QString::fromStdString(str);
+            convo += fresh;
+            if (stop_nl && str.find('\n') != string::npos) //stop at NL
                 s = ANNA_TURNOVER;
             else if (CheckStopWords(convo)) //stop at stop-word
                 s = ANNA_TURNOVER;
             else { //stop if user prefix was generated
-                last_username = CheckUsrPrefix(convo);
-                if (!last_username.isEmpty()) s = ANNA_TURNOVER;
+                gen_user = CheckUsrPrefix(convo,usrbox);
+                if (!gen_user.isEmpty()) s = ANNA_TURNOVER;
             }
             break;
 
@@ -404,52 +470,88 @@ void MainWnd::Generate()
             // nothing to do, waiting
             break;
 
-        case ANNA_ERROR:
-            ui->statusbar->showMessage("Error: " + QString::fromStdString(brain->getError()));
-            stop = true;
-            break;
-
         default:
-            ui->statusbar->showMessage("Wrong brain state: " + QString::fromStdString(AnnaBrain::StateToStr(s)));
+            // errors are reported by Generate()
             stop = true;
         }
-
-        // set a temporary UI state to interactively "stream" the tokens which are being generated
-        QString curout = cur_chat + convo;
-        UpdateChatLogFrom(curout);
-        ui->ContextFull->setMaximum(config.params.n_ctx);
         tokens_cnt = brain->getTokensUsed();
-        ui->ContextFull->setValue(tokens_cnt);
-        ui->statusbar->showMessage("Brain state: thinking...");
 
-        // now we can check the RQPs, execute stuff and inject things into LLM, all in this one convenient call
-        CheckRQPs(raw_output + convo);
+        // stream the token to the GUI thread
+        if (!fresh.isEmpty()) {
+            emit tokenGenerated(fresh);
+            fresh.clear();
+            if (gen_sync) {
+                unique_lock<mutex> lk(gen_mtx);
+                gen_cv.wait(lk,[this] { return gen_acked || stop; });
+                gen_acked = false;
+            }
+        }
 
         // now it's a good time to bail if turnover was detected
         if (s == ANNA_TURNOVER) {
             // however, if it's an LSCS system, we might be requested to continue
-            AnnaLSCS* is_lscs = dynamic_cast<AnnaLSCS*>(brain);
             if (is_lscs && guiconfig.use_lscs) {
-                if (guiconfig.lscs_period >= 0) usleep(1000UL * guiconfig.lscs_period); // FIXME: replace with interactive wait with timeout (might be also needed in BusyBox)
+                if (guiconfig.lscs_period >= 0) usleep(1000UL * guiconfig.lscs_period);
             } else
                 break;
         }
-        nowait = true; // this is needed after the first full loop to prevent the brain to fire a wait on every token
+    }
 
-        // make it interactive - update the UI
-        qApp->processEvents();
+    gen_convo = convo;
+    gen_state = s;
+    emit generationFinished();
+}
+
+void MainWnd::onTokenGenerated(QString fresh)
+{
+    if (!gen_active) return; // a leftover from an interrupted generation
+    gen_text += fresh;
+    gen_dirty = true;
+
+    // now we can check the RQPs, execute stuff and inject things into LLM, all in this one convenient call
+    if (gen_sync) {
+        int len = cur_chat.length();
+        CheckRQPs(fresh);
+        if (cur_chat.length() != len) {
+            // RQP's output has been added to the log, so the message continues after it
+            QTextCursor cur(ui->ChatLog->document());
+            cur.movePosition(QTextCursor::End);
+            cur.insertBlock();
+            gen_pos = cur.position();
+        }
+        {
+            lock_guard<mutex> lk(gen_mtx);
+            gen_acked = true;
+        }
+        gen_cv.notify_all();
     }
+}
 
-    // restore the global state and update the text widgets
-    nowait = false;
-    --block;
-    cur_chat += convo + "\n";
-    raw_output += convo + "\n";
+void MainWnd::onRenderTimer()
+{
+    ui->ContextFull->setValue(tokens_cnt);
+    if (!gen_dirty) return;
+    gen_dirty = false;
 
-    QString sstr = "Brain state: " + QString::fromStdString(AnnaBrain::StateToStr(s));
-    if (s == ANNA_ERROR) sstr += " (" + QString::fromStdString(brain->getError()) + ")";
-    ui->statusbar->showMessage(sstr);
-    UpdateChatLogFrom(cur_chat);
+    auto pp = ui->ChatLog->verticalScrollBar();
+    int op = pp? pp->value() : 0;
+
+    // replace the previous rendering of the current message (the log could have been replaced meanwhile)
+    QString s = gen_text;
+    FixMarkdown(s,md_fix_out_tab);
+    QTextDocument doc;
+    doc.setMarkdown(s);
+    QTextCursor cur(ui->ChatLog->document());
+    cur.movePosition(QTextCursor::End);
+    if (gen_pos < cur.position()) cur.setPosition(gen_pos,QTextCursor::KeepAnchor);
+    cur.removeSelectedText();
+    cur.insertFragment(QTextDocumentFragment(&doc));
+
+    if (ui->actionAuto_scroll->isChecked()) {
+        ui->ChatLog->moveCursor(QTextCursor::End);
+        ui->ChatLog->ensureCursorVisible();
+    } else if (pp)
+        pp->setValue(op);
 }
 
 QString MainWnd::GetSaveFileName(const AnnaFileDialogType tp)
@@ -566,7 +668,7 @@ void MainWnd::on_ModelPath_returnPressed()
     if (guiconfig.clear_log) {
         ui->ChatLog->clear();
         cur_chat.clear();
-        raw_output.clear();
+        rqp_matcher.reset();
 
     } else if (!cur_chat.isEmpty()) {
         cur_chat += "### New model loaded: " + fn + "\n\n\n\n";
@@ -795,7 +897,6 @@ void MainWnd::on_actionNew_dialog_triggered()
     }
 
     UpdateRQPs();
-    raw_output.clear();
     ui->UserInput->clear();
     last_username.clear();
     next_attach = nullptr;
@@ -827,6 +928,7 @@ void MainWnd::on_actionLoad_initial_prompt_triggered()
 
 void MainWnd::on_actionSettings_triggered()
 {
+    if (block) return; // the generation thread might be using the settings
     SettingsDialog sdlg;
     sdlg.pconfig = &config;
 
@@ -860,6 +962,7 @@ void MainWnd::on_actionClear_attachments_triggered()
 
 void MainWnd::on_actionLoad_vision_encoder_triggered()
 {
+    if (block) return; // the generation thread might be using the brain
     if (!brain) {
         QMessageBox::warning(this,"ANNA","You need to load the language model first.");
         return;
@@ -907,7 +1010,7 @@ void MainWnd::on_actionHTML_triggered()
 
 void MainWnd::on_actionSave_state_triggered()
 {
-    if (!brain) return;
+    if (block || !brain) return;
     QString fn = GetSaveFileName(ANNA_FILE_MODEL_STATE);
     if (fn.isEmpty()) return;
     string dlg = cur_chat.toStdString();
@@ -969,7 +1072,6 @@ bool MainWnd::LoadLLMState(const QString& fn)
     dlg.resize(usrlen);
     cur_chat = QString::fromStdString(dlg);
     UpdateChatLogFrom(cur_chat);
-    raw_output.clear();
     UpdateRQPs();
 
     return true;
@@ -1013,6 +1115,7 @@ void MainWnd::UpdateRQPs()
         if (i.s) delete i.s;
     }
     rqps.clear();
+    rqp_matcher.clear();
 
     for (auto & i : guiconfig.rqps) {
         if (!i.enabled) continue;
@@ -1020,15 +1123,23 @@ void MainWnd::UpdateRQPs()
         s.fsm = 0;
         s.lpos = 0;
         s.s = new QSettings(i.fn,QSettings::IniFormat);
+        RQPEditor::AddToMatcher(s,rqp_matcher);
         rqps.push_back(s);
     }
 }
 
-void MainWnd::CheckRQPs(const QString& inp)
+void MainWnd::CheckRQPs(const QString& fresh)
 {
+    auto matches = rqp_matcher.feed(fresh.toStdString());
+    if (matches.empty()) return;
+
     ++block; // lock out the UI while processing RQPs
-    for (auto & i : rqps) {
-        QString out = RQPEditor::DoRequest(i,inp,[&](QString msg, bool end) -> bool {
+    for (auto & m : matches) {
+        auto it = find_if(rqps.begin(),rqps.end(),[&m] (auto & o) { return o.mid == m.id; });
+        if (it == rqps.end()) continue;
+        auto & i = *it;
+
+        QString out = RQPEditor::DoRequest(i,m,[&](QString msg, bool end) -> bool {
             WaitingFun((end? -1:0),false,msg.toStdString(),true,true);
             qApp->processEvents();
             return !waiting_aborted;
@@ -1087,12 +1198,13 @@ void MainWnd::UpdateChatLogFrom(QString s)
 
 void MainWnd::on_actionShow_context_tokens_triggered()
 {
+    if (block) return;
     if (brain) ui->ChatLog->setPlainText(QString::fromStdString(brain->PrintContext()));
 }
 
 void MainWnd::on_actionQuick_save_triggered()
 {
-    if (!brain) return;
+    if (block || !brain) return;
     QString fn = qApp->applicationDirPath() + "/" + AG_QUICK_FILE;
     string dlg = cur_chat.toStdString();
     if (brain->SaveState(fn.toStdString(),dlg.data(),dlg.size()))
@@ -1139,13 +1251,15 @@ void MainWnd::on_actionOffline_help_triggered()
 
 void MainWnd::on_actionClear_chat_log_triggered()
 {
+    if (block) return;
     cur_chat.clear();
-    raw_output.clear();
+    rqp_matcher.reset();
     ui->ChatLog->clear();
 }
 
 void MainWnd::on_actionUse_current_input_as_prompt_triggered()
 {
+    if (block) return;
     QString in = ui->UserInput->toPlainText();
     ui->UserInput->clear();
     strncpy(config.params.prompt,in.toStdString().c_str(),sizeof(config.params.prompt)-1);
@@ -1153,11 +1267,13 @@ void MainWnd::on_actionUse_current_input_as_prompt_triggered()
 
 void MainWnd::on_actionReset_prompt_to_default_triggered()
 {
+    if (block) return;
     strcpy(config.params.prompt,AG_DEFAULT_PROMPT);
 }
 
 bool MainWnd::WaitingFun(int prog, bool wait, const string& text, bool abortable, bool force)
 {
+    if (QThread::currentThread() != thread()) return false; // the UI can't be touched from other threads
     if (nowait && !force) return false; // is waiting temporarily prohibited?
     if (!busybox_lock.try_lock()) return false; // this might signal to other threads that waiting is already happening
     ++block; // block the UI
@@ -1214,6 +1330,7 @@ void MainWnd::on_actionStop_triggered()
 
 void MainWnd::on_actionContinue_triggered()
 {
+    if (block) return;
     ForceAIName("");
     ui->SamplingCheck->setChecked(false);
     Generate();
@@ -1253,7 +1370,7 @@ void MainWnd::on_actionLSCS_editor_triggered()
 
 void MainWnd::on_actionShow_tokens_with_IDs_triggered()
 {
-    if (!brain) return;
+    if (block || !brain) return;
     auto vec = brain->getContext();
     auto log = brain->getContextLogits(); // only needed for debugging (hopefully)
     QString str;
@@ -1268,6 +1385,7 @@ void MainWnd::on_actionShow_tokens_with_IDs_triggered()
 
 void MainWnd::on_actionLogit_bias_editor_triggered()
 {
+    if (block) return;
     LogitBiasDialog dlg(this);
     dlg.brain = brain;
     dlg.exec();
@@ -1275,7 +1393,7 @@ void MainWnd::on_actionLogit_bias_editor_triggered()
 
 void MainWnd::on_actionShow_active_biases_triggered()
 {
-    if (!brain) return;
+    if (block || !brain) return;
     auto bs = brain->getLogitBiases();
     QString out = "token; operation; value\n";
     for (auto &&i : bs)
@@ -1285,6 +1403,7 @@ void MainWnd::on_actionShow_active_biases_triggered()
 
 void MainWnd::on_actionDialog_as_prompt_triggered()
 {
+    if (block) return;
     QString fn = GetOpenFileName(ANNA_FILE_DLG_MD);
     if (fn.isEmpty()) return;
     QString txt;
@@ -1301,6 +1420,7 @@ void MainWnd::on_actionDialog_as_prompt_triggered()
 
 void MainWnd::on_actionDialog_as_log_triggered()
 {
+    if (block) return;
     QString fn = GetOpenFileName(ANNA_FILE_DLG_MD);
     if (fn.isEmpty()) return;
     QString txt;
@@ -1313,12 +1433,13 @@ void MainWnd::on_actionDialog_as_log_triggered()
 
 void MainWnd::on_actionClear_prompt_triggered()
 {
+    if (block) return;
     memset(config.params.prompt,0,sizeof(config.params.prompt));
 }
 
 void MainWnd::on_actionClear_IO_vectors_triggered()
 {
-    if (!brain) return;
+    if (block || !brain) return;
     brain->Reset(ANNA_RESET_IOVEC|ANNA_RESET_SAMPLING);
     ui->statusbar->showMessage("IO vectors and sampling state reset");
 }
@@ -12,15 +12,17 @@
 #include <QSettings>
 #include <QCompleter>
 #include <QScrollBar>
+#include <QTimer>
 #include <mutex>
 #include <atomic>
+#include <condition_variable>
 #include "rqpeditor.h"
 #include "busybox.h"
 #include "brain.h"
 #include "netclient.h"
 #include "lscs.h"
 
-#define AG_VERSION "0.13.12"
+#define AG_VERSION "0.14.0"
 
 #define AG_MAXTEXT 10*1024*1024
 #define AG_ICON_W 48
@@ -34,6 +36,7 @@
 #define AG_SERVER_WAIT_MS 50
 #define AG_SERVER_WAIT_CYCLES 20
 #define AG_STRPROCESS_WAIT 50ms
+#define AG_RENDER_PERIOD_MS 40
 
 struct AnnaAttachment {
     QString fn;
@@ -93,7 +96,16 @@ protected:
     void closeEvent(QCloseEvent* event) override;
     bool eventFilter(QObject* obj, QEvent* event) override;
 
+signals:
+    // emitted by the generation thread
+    void tokenGenerated(QString fresh);
+    void generationFinished();
+
 private slots:
+    void onTokenGenerated(QString fresh);
+
+    void onRenderTimer();
+
     void on_actionSimple_view_triggered();
 
     void on_actionAdvanced_view_triggered();
@@ -192,19 +204,34 @@ private:
     AnnaBrain* brain;
 
     int mode;
-    QString cur_chat, raw_output;
+    QString cur_chat;
     std::list<AnnaAttachment> attachs;
     AnnaAttachment* next_attach;
     QString last_username;
-    bool stop;
+    std::atomic_bool stop;
     std::atomic_int block;
     QString filedlg_cache[ANNA_NUM_FILETYPES];
     std::vector<AnnaRQPState> rqps;
+    AnnaRQPMatcher rqp_matcher;
     std::mutex busybox_lock;
     bool nowait;
-    int tokens_cnt;
+    std::atomic_int tokens_cnt;
     bool waiting_aborted;
 
+    // state of the generation thread
+    QTimer* render_timer;
+    bool gen_active;
+    QString gen_text;                   // the message being generated, as displayed
+    int gen_pos;                        // where the message starts in the chat log
+    bool gen_dirty;
+    bool gen_sync;                      // the thread waits for each token to be checked by the RQPs
+    bool gen_acked;
+    std::mutex gen_mtx;
+    std::condition_variable gen_cv;
+    QString gen_convo;                  // results, valid after the thread is joined
+    QString gen_user;
+    AnnaState gen_state;
+
     void DefaultConfig();
     void LoadSettings();
     void SaveSettings();
@@ -218,12 +245,13 @@ private:
     void FixMarkdown(QString& s, const char** tab);
     void UpdateChatLogFrom(QString s);
     void UpdateRQPs();
-    void CheckRQPs(const QString& inp);
+    void CheckRQPs(const QString& fresh);
     void ForceAIName(const QString& nm);
     void ProcessInput(std::string str);
     bool EmbedImage(const QString& fn);
     void Generate();
-    QString CheckUsrPrefix(QString& convo);
+    void GenerateLoop(bool sampling, bool stop_nl, QString usrbox);
+    QString CheckUsrPrefix(QString& convo, const QString& usrbox);
     bool CheckStopWords(QString &convo);
 };
 
@@ -100,7 +100,7 @@ QStringList RQPEditor::DetectRQP(const QString &in, AnnaRQPState &st)
             st.lpos = i + l;
             if (stop.isEmpty()) {
                 st.fsm = 0;
-                res = CompleteRQP("",st);
+                res = CompleteRQP("",st,st.bex.capturedTexts(),QStringList());
             }
         }
         break;
@@ -114,7 +114,7 @@ QStringList RQPEditor::DetectRQP(const QString &in, AnnaRQPState &st)
             l = stop.length();
         }
         if (i >= 0) {
-            res = CompleteRQP(in.mid(st.lpos,i-st.lpos),st);
+            res = CompleteRQP(in.mid(st.lpos,i-st.lpos),st,st.bex.capturedTexts(),st.eex.capturedTexts());
             st.fsm = 0;
             st.lpos = i + l;
         }
@@ -124,7 +124,7 @@ QStringList RQPEditor::DetectRQP(const QString &in, AnnaRQPState &st)
     return res;
 }
 
-QStringList RQPEditor::CompleteRQP(const QString& in, AnnaRQPState& st)
+QStringList RQPEditor::CompleteRQP(const QString& in, AnnaRQPState& st, const QStringList& bcaps, const QStringList& ecaps)
 {
     bool regex = st.s->value("regex",false).toBool();
     bool split = st.s->value("split_args",false).toBool();
@@ -147,10 +147,10 @@ QStringList RQPEditor::CompleteRQP(const QString& in, AnnaRQPState& st)
 
         // replace captures if needed
         if (regex) {
-            for (int i = 1; i <= st.bex.captureCount(); i++)
-                replacer(*it,QString::asprintf("b%d",i),st.bex.cap(i));
-            for (int i = 1; i <= st.eex.captureCount(); i++)
-                replacer(*it,QString::asprintf("e%d",i),st.eex.cap(i));
+            for (int i = 1; i < bcaps.size(); i++)
+                replacer(*it,QString::asprintf("b%d",i),bcaps.at(i));
+            for (int i = 1; i < ecaps.size(); i++)
+                replacer(*it,QString::asprintf("e%d",i),ecaps.at(i));
         }
     }
 
@@ -170,6 +170,7 @@ void RQPEditor::rescan()
     AnnaRQPState s;
     s.fsm = 0;
     s.lpos = 0;
+    s.mid = -1;
     s.s = sets;
 
     int pstate = 0;
@@ -248,6 +249,44 @@ QString RQPEditor::DoRequest(AnnaRQPState &rqp, const QString& inp, AnnaRQPWaite
     QStringList r = DetectRQP(inp,rqp);
     if (r.isEmpty()) return "";
 
+    return RunRequest(rqp,r,waiter,filter);
+}
+
+QString RQPEditor::DoRequest(AnnaRQPState& rqp, const AnnaRQPMatch& match, AnnaRQPWaiter waiter, AnnaRQPFilter filter)
+{
+    if (!rqp.s || match.id != rqp.mid) return "";
+
+    // the detection has already been done by the matcher, we only need to extract arguments
+    QStringList bcaps, ecaps;
+    for (auto &i : match.bcaps) bcaps.push_back(QString::fromStdString(i));
+    for (auto &i : match.ecaps) ecaps.push_back(QString::fromStdString(i));
+
+    rqp.s->endGroup();
+    rqp.s->beginGroup("MAIN");
+    QStringList r = CompleteRQP(QString::fromStdString(match.body),rqp,bcaps,ecaps);
+    if (r.isEmpty()) return "";
+
+    return RunRequest(rqp,r,waiter,filter);
+}
+
+int RQPEditor::AddToMatcher(AnnaRQPState& rqp, AnnaRQPMatcher& matcher)
+{
+    rqp.mid = -1;
+    if (!rqp.s) return -1;
+
+    rqp.s->endGroup();
+    rqp.s->beginGroup("MAIN");
+
+    QString start = rqp.s->value("start_tag").toString();
+    QString stop = rqp.s->value("stop_tag").toString();
+    if (start.isEmpty()) return -1;
+
+    rqp.mid = matcher.addRequester(start.toStdString(),stop.toStdString(),rqp.s->value("regex",false).toBool());
+    return rqp.mid;
+}
+
+QString RQPEditor::RunRequest(AnnaRQPState& rqp, QStringList& r, AnnaRQPWaiter waiter, AnnaRQPFilter filter)
+{
     // get the command
     rqp.s->endGroup();
     rqp.s->beginGroup("MAIN");
@@ -307,6 +346,7 @@ void RQPEditor::on_pushButton_2_clicked()
     AnnaRQPState s;
     s.fsm = 0;
     s.lpos = 0;
+    s.mid = -1;
     s.s = sets;
 
     for (int i = 0; i < AG_ARGPARSE_FAILSAFE; i++) {
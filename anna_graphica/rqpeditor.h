@@ -6,6 +6,7 @@
 #include <QDialog>
 #include <QSettings>
 #include <QProcess>
+#include "rqpmatch.h"
 
 #define AG_PROCESS_WAIT_US 10000UL
 #define AG_ARGPARSE_FAILSAFE 100
@@ -22,6 +23,7 @@ struct AnnaRQPState {
     QSettings* s;
     int fsm, lpos;
     QRegExp bex, eex;
+    int mid; // ID in the streaming matcher
 };
 
 namespace Ui {
@@ -38,6 +40,8 @@ public:
 
     static QStringList DetectRQP(const QString& in, AnnaRQPState& st);
     static QString DoRequest(AnnaRQPState& rqp, const QString& inp, AnnaRQPWaiter waiter, AnnaRQPFilter filter);
+    static QString DoRequest(AnnaRQPState& rqp, const AnnaRQPMatch& match, AnnaRQPWaiter waiter, AnnaRQPFilter filter);
+    static int AddToMatcher(AnnaRQPState& rqp, AnnaRQPMatcher& matcher);
 
     QString filename;
 
@@ -66,7 +70,8 @@ private:
     static std::list<QString> splitter(const QString& str);
     static void replacer(QString& str, const QString& tag, const QString& in);
 
-    static QStringList CompleteRQP(const QString& in, AnnaRQPState& st);
+    static QStringList CompleteRQP(const QString& in, AnnaRQPState& st, const QStringList& bcaps, const QStringList& ecaps);
+    static QString RunRequest(AnnaRQPState& rqp, QStringList& args, AnnaRQPWaiter waiter, AnnaRQPFilter filter);
 };
 
 #endif // RQPEDITOR_H
@@ -104,6 +104,8 @@ void SettingsDialog::SaveSettings(AnnaConfig* cfg, QSettings* sets)
     sets->setValue("eos_to_nl",cfg->convert_eos_to_nl);
     sets->setValue("nl_to_turnover",cfg->nl_to_turnover);
     sets->setValue("no_pad_prefix",cfg->no_pad_in_prefix);
+    sets->setValue("ctx_policy",cfg->ctx_policy);
+    sets->setValue("ctx_chunk",cfg->ctx_chunk);
 
     gpt_params* p = &(cfg->params);
     sets->setValue("seed",p->seed);
@@ -242,6 +244,8 @@ void SettingsDialog::LoadSettings(AnnaConfig* cfg, QSettings* sets)
     cfg->convert_eos_to_nl = sets->value("eos_to_nl",cfg->convert_eos_to_nl).toBool();
     cfg->nl_to_turnover = sets->value("nl_to_turnover",cfg->nl_to_turnover).toBool();
     cfg->no_pad_in_prefix = sets->value("no_pad_prefix",cfg->no_pad_in_prefix).toBool();
+    cfg->ctx_policy = sets->value("ctx_policy",cfg->ctx_policy).toInt();
+    cfg->ctx_chunk = sets->value("ctx_chunk",cfg->ctx_chunk).toInt();
 
     gpt_params* p = &(cfg->params);
     p->seed = sets->value("seed",p->seed).toUInt();
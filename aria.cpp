@@ -1,9 +1,14 @@
 /* This code uses parts of the SGUI library
  * (C) Dmitry 'MatrixS_Master' Solovyev, 2016-2025 */
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "brain.h"
 #include "netclient.h"
 #include "aria.h"
+#include "ariaremote.h"
+#include "trace.h"
 #include "libfme.h"
 
 #define ERR(X,...) fprintf(stderr, "[ARIA] ERROR: " X "\n", __VA_ARGS__)
@@ -14,31 +19,167 @@
 #define DBG(...)
 #endif
 
-#define ARIA_BIND_GETVM (lua_isthread(luavm,1))? lua_tothread(luavm,1) : luavm
+#define ARIA_BIND_GETVM (caller? caller : luavm)
 #define ARIA_BIND_STACK_EXTRAS 1
 #define ARIA_BIND_CHECK_NUM_ARGS(N,V,X) if (lua_gettop(V) - ARIA_BIND_STACK_EXTRAS < X) { \
-    return luaL_error(luavm, #N ": %d arguments expected, got %d", X, (lua_gettop(V) - ARIA_BIND_STACK_EXTRAS)); \
+    return luaL_error(V, #N ": %d arguments expected, got %d", X, (lua_gettop(V) - ARIA_BIND_STACK_EXTRAS)); \
     }
 #define ARIA_BIND_HEADER(N,X) lua_State* R = ARIA_BIND_GETVM; \
     ARIA_BIND_CHECK_NUM_ARGS(N,R,X);
+// the brain can't be touched (e.g. from idle()) while it's working on an asynchronous call
+#define ARIA_BIND_BRAIN_HEADER(N,X) ARIA_BIND_HEADER(N,X); \
+    if (async_busy) return luaL_error(R, N ": brain is busy");
 
 using namespace std;
 
+static const char* aria_callbacks[ARIA_NUM_CALLBACKS] = { "processing", "inpin", "outpin", "idle" };
+
 #define ARIA_BINDS_FUNCTIONS
 #include "aria_binds.h"
 #undef ARIA_BINDS_FUNCTIONS
 
+static const char* aria_buf_types[ARIA_BUF_NUMTYPES] = { "bytes", "floats", "tokens" };
+static const size_t aria_buf_elsize[ARIA_BUF_NUMTYPES] = { 1, sizeof(float), sizeof(llama_token) };
+
+size_t AriaBuffer::size() const
+{
+    switch (type) {
+    case ARIA_BUF_FLOATS: return floats.size();
+    case ARIA_BUF_TOKENS: return tokens.size();
+    default: return bytes.size();
+    }
+}
+
+string AriaBuffer::describe() const
+{
+    return AnnaBrain::myformat("<%s x %zu>",aria_buf_types[type],size());
+}
+
+// In Lua, a buffer is a userdata holding a shared pointer, so the elements are read directly from the shared storage
+static AriaBufferPtr& aria_checkbuffer(lua_State* L, int idx)
+{
+    return *(AriaBufferPtr*)luaL_checkudata(L,idx,ARIA_BUFFER_META);
+}
+
+static void aria_pushbuffer(lua_State* L, const AriaBufferPtr& buf)
+{
+    new (lua_newuserdatauv(L,sizeof(AriaBufferPtr),0)) AriaBufferPtr(buf);
+    luaL_setmetatable(L,ARIA_BUFFER_META);
+}
+
+static void aria_pushelement(lua_State* L, const AriaBuffer& b, size_t i)
+{
+    switch (b.type) {
+    case ARIA_BUF_FLOATS: lua_pushnumber(L,b.floats[i]); break;
+    case ARIA_BUF_TOKENS: lua_pushinteger(L,b.tokens[i]); break;
+    default: lua_pushinteger(L,(unsigned char)b.bytes[i]);
+    }
+}
+
+static int aria_buf_gc(lua_State* L)
+{
+    AriaBufferPtr* p = (AriaBufferPtr*)luaL_testudata(L,1,ARIA_BUFFER_META);
+    if (p) p->~AriaBufferPtr();
+    return 0;
+}
+
+static int aria_buf_len(lua_State* L)
+{
+    lua_pushinteger(L,aria_checkbuffer(L,1)->size());
+    return 1;
+}
+
+static int aria_buf_tostring(lua_State* L)
+{
+    lua_pushstring(L,aria_checkbuffer(L,1)->describe().c_str());
+    return 1;
+}
+
+static int aria_buf_index(lua_State* L)
+{
+    const AriaBuffer& b = *aria_checkbuffer(L,1);
+    if (lua_type(L,2) == LUA_TNUMBER) {
+        // 1-based, as usual in Lua
+        lua_Integer i = lua_tointeger(L,2);
+        if (i < 1 || i > (lua_Integer)b.size()) lua_pushnil(L);
+        else aria_pushelement(L,b,i-1);
+    } else {
+        lua_pushvalue(L,2);
+        lua_gettable(L,lua_upvalueindex(1));
+    }
+    return 1;
+}
+
+static int aria_buf_type(lua_State* L)
+{
+    lua_pushstring(L,aria_buf_types[aria_checkbuffer(L,1)->type]);
+    return 1;
+}
+
+static int aria_buf_raw(lua_State* L)
+{
+    const AriaBuffer& b = *aria_checkbuffer(L,1);
+    switch (b.type) {
+    case ARIA_BUF_FLOATS: lua_pushlstring(L,(const char*)b.floats.data(),b.floats.size()*sizeof(float)); break;
+    case ARIA_BUF_TOKENS: lua_pushlstring(L,(const char*)b.tokens.data(),b.tokens.size()*sizeof(llama_token)); break;
+    default: lua_pushlstring(L,b.bytes.data(),b.bytes.size());
+    }
+    return 1;
+}
+
+static int aria_buf_totable(lua_State* L)
+{
+    const AriaBuffer& b = *aria_checkbuffer(L,1);
+    lua_createtable(L,b.size(),0);
+    for (size_t i = 0; i < b.size(); i++) {
+        aria_pushelement(L,b,i);
+        lua_rawseti(L,-2,i+1);
+    }
+    return 1;
+}
+
+static const luaL_Reg aria_buf_methods[] = {
+    {"type", aria_buf_type},
+    {"raw", aria_buf_raw},
+    {"totable", aria_buf_totable},
+    {NULL, NULL}
+};
+
+static void aria_buf_register(lua_State* L)
+{
+    luaL_newmetatable(L,ARIA_BUFFER_META);
+    luaL_newlib(L,aria_buf_methods);
+    lua_pushcclosure(L,aria_buf_index,1);
+    lua_setfield(L,-2,"__index");
+    lua_pushcfunction(L,aria_buf_gc);
+    lua_setfield(L,-2,"__gc");
+    lua_pushcfunction(L,aria_buf_len);
+    lua_setfield(L,-2,"__len");
+    lua_pushcfunction(L,aria_buf_tostring);
+    lua_setfield(L,-2,"__tostring");
+    lua_pop(L,1);
+}
+
 Aria::Aria(string scriptfile, string name)
 {
     scriptfn = scriptfile;
     mname = name;
     thr_state = ARIA_THR_NOT_RUNNING;
+    async_busy = false;
+    worker = std::thread([this] { WorkerLoop(); });
     Reload();
 }
 
+Aria::Aria()
+{
+    thr_state = ARIA_THR_NOT_RUNNING;
+    async_busy = false;
+}
+
 Aria::~Aria()
 {
     Close();
+    StopWorker();
 }
 
 void Aria::Close()
@@ -46,6 +187,9 @@ void Aria::Close()
     StopProcessing();
     if (luavm) lua_close(luavm);
     if (brain) delete brain;
+    luavm = nullptr;
+    brain = nullptr;
+    for (int i = 0; i < ARIA_NUM_CALLBACKS; i++) cb_refs[i] = LUA_REFNIL;
 }
 
 bool Aria::Reload()
@@ -138,29 +282,56 @@ void Aria::setInPin(int pin, string str)
     if (pin < 0 || pin >= pins) return;
     // call by name (if exists), otherwise call by number
     if (pin < (int)name_ins.size())
-        LuaCall("inpin","ss",name_ins.at(pin).c_str(),str.c_str());
+        LuaCall(ARIA_CB_INPIN,"ss",name_ins.at(pin).c_str(),str.c_str());
+    else
+        LuaCall(ARIA_CB_INPIN,"is",pin,str.c_str());
+}
+
+void Aria::setInPin(int pin, const AriaPinData& data)
+{
+    if (!data.buf) {
+        setInPin(pin,data.str);
+        return;
+    }
+    if (pin < 0 || pin >= pins) return;
+
+    if (pin < (int)name_ins.size())
+        LuaCall(ARIA_CB_INPIN,"sb",name_ins.at(pin).c_str(),&data.buf);
     else
-        LuaCall("inpin","is",pin,str.c_str());
+        LuaCall(ARIA_CB_INPIN,"ib",pin,&data.buf);
 }
 
 string Aria::getOutPin(int pin)
 {
-    if (pin < 0 || pin >= pouts) return "";
+    AriaPinData out = getOutPinData(pin);
+    return out.buf? out.buf->describe() : out.str;
+}
+
+AriaPinData Aria::getOutPinData(int pin)
+{
+    AriaPinData out;
+    if (pin < 0 || pin >= pouts) return out;
 
     if (pin < (int)name_outs.size()) {
-        if (!LuaCall("outpin","s",name_outs.at(pin).c_str())) return "";
+        if (!LuaCall(ARIA_CB_OUTPIN,"s",name_outs.at(pin).c_str())) return out;
     } else {
-        if (!LuaCall("outpin","i",pin)) return "";
+        if (!LuaCall(ARIA_CB_OUTPIN,"i",pin)) return out;
     }
 
-    string out = LuaGetString();
-    if (!out.empty()) last_outputs[pin] = out;
+    AriaBufferPtr* p = (AriaBufferPtr*)luaL_testudata(luavm,-1,ARIA_BUFFER_META);
+    if (p) out.buf = *p;
+    else out.str = LuaGetString();
+
+    lock_guard<mutex> lk(out_mtx);
+    if (out.buf) last_outputs[pin] = out.buf->describe();
+    else if (!out.str.empty()) last_outputs[pin] = out.str;
     return out;
 }
 
 string Aria::getLastOutPin(int pin)
 {
-    if (pin < 0 || pin >= pouts) return "";
+    lock_guard<mutex> lk(out_mtx);
+    if (pin < 0 || pin >= (int)last_outputs.size()) return "";
     return last_outputs[pin];
 }
 
@@ -170,20 +341,20 @@ AriaState Aria::Processing()
 
     switch (state) {
     case ARIA_READY:
-        if (process_thr) StopProcessing();
+        // hand the call over to the worker thread
         state = ARIA_RUNNING;
-        thr_state = ARIA_THR_NOT_RUNNING;
-        process_thr = new std::thread([&] {
-            thr_state = ARIA_THR_RUNNING;
-            if (!LuaCall("processing",nullptr)) state = ARIA_ERROR;
-            thr_state = ARIA_THR_STOPPED;
-        });
+        {
+            lock_guard<mutex> lk(thr_mtx);
+            thr_state = ARIA_THR_NOT_RUNNING;
+            thr_job = true;
+        }
+        thr_cv.notify_all();
         break;
 
     case ARIA_RUNNING:
         if (thr_state == ARIA_THR_STOPPED) {
-            state = ARIA_READY;
-            StopProcessing();
+            state = thr_ok? ARIA_READY : ARIA_ERROR;
+            thr_state = ARIA_THR_NOT_RUNNING;
         }
         break;
 
@@ -198,32 +369,151 @@ bool Aria::StartVM()
 {
     //create a VM
     luavm = luaL_newstate();
+    for (int i = 0; i < ARIA_NUM_CALLBACKS; i++) cb_refs[i] = LUA_REFNIL;
     luaL_openlibs(luavm);
 
     //assign global variables
     lua_pushlightuserdata(luavm,this);
     lua_setglobal(luavm,"thisptr");
+    aria_buf_register(luavm);
 
     //assign functions
     #define ARIA_BINDS_NAMES
     #include "aria_binds.h"
     #undef ARIA_BINDS_NAMES
 
+    //remember what's been defined before the script, so the snapshots won't include it
+    sys_globals.clear();
+    lua_pushglobaltable(luavm);
+    lua_pushnil(luavm);
+    while (lua_next(luavm,-2)) {
+        if (lua_type(luavm,-2) == LUA_TSTRING) sys_globals.insert(lua_tostring(luavm,-2));
+        lua_pop(luavm,1);
+    }
+    lua_pop(luavm,1);
+
     //load the script file
-    int r = luaL_loadfilex(luavm,scriptfn.c_str(),NULL);
-    if (r != LUA_OK) {
+    if (!LoadScript()) return false;
+
+    //run init chunk
+    if (lua_pcall(luavm,0,0,0) != LUA_OK) {
         ErrorVM();
         return false;
     }
+    ResolveCallbacks();
+    return true;
+}
 
-    //run init chunk
-    if (lua_pcall(luavm,0,0,0) != LUA_OK) {
+static string aria_cache_dir()
+{
+    const char* env = getenv(ARIA_CACHE_ENV);
+    if (env) return env; // empty string turns the cache off
+    env = getenv("HOME");
+    return env? string(env) + ARIA_CACHE_DIR : string();
+}
+
+static bool aria_mkdirs(const string& dir)
+{
+    for (size_t i = 1; i <= dir.size(); i++) {
+        if (i < dir.size() && dir[i] != ARIA_PATH_DELIM) continue;
+        if (mkdir(dir.substr(0,i).c_str(),0700) && errno != EEXIST) return false;
+    }
+    return true;
+}
+
+static uint64_t aria_fnv1a(const void* data, size_t len, uint64_t h = 0xcbf29ce484222325ULL)
+{
+    const uint8_t* p = (const uint8_t*)data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static int aria_dump_writer(lua_State*, const void* p, size_t sz, void* ud)
+{
+    ((string*)ud)->append((const char*)p,sz);
+    return 0;
+}
+
+bool Aria::LoadScript()
+{
+    // compiled chunks are kept in the cache, keyed by the script's path, modification time and contents
+    string src, chunk = "@" + scriptfn;
+    struct stat st;
+    FILE* f = fopen(scriptfn.c_str(),"rb");
+    if (!f || fstat(fileno(f),&st)) {
+        if (f) fclose(f);
+        merror = "Lua Error: cannot open " + scriptfn;
+        state = ARIA_ERROR;
+        return false;
+    }
+    src.resize(st.st_size);
+    size_t n = fread(&src[0],1,src.size(),f);
+    fclose(f);
+    src.resize(n);
+
+    // that's what luaL_loadfilex() does: skip the first line if it's a comment (keeping the line numbers)
+    if (!src.empty() && src[0] == '#') src.erase(0,src.find('\n'));
+
+    string dir = (src.empty() || src[0] == LUA_SIGNATURE[0])? string() : aria_cache_dir();
+    if (dir.empty()) {
+        if (luaL_loadbufferx(luavm,src.data(),src.size(),chunk.c_str(),NULL) == LUA_OK) return true;
         ErrorVM();
         return false;
     }
+
+    int64_t mt = (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    uint64_t h = aria_fnv1a(scriptfn.data(),scriptfn.size());
+    h = aria_fnv1a(&mt,sizeof(mt),h);
+    h = aria_fnv1a(src.data(),src.size(),h);
+    string cfn = AnnaBrain::myformat("%s%c%016llx.luac",dir.c_str(),ARIA_PATH_DELIM,(unsigned long long)h);
+
+    // the header of a binary chunk is checked by Lua, so a chunk from another Lua version is just recompiled
+    string bin;
+    f = fopen(cfn.c_str(),"rb");
+    if (f) {
+        char buf[4096];
+        while ((n = fread(buf,1,sizeof(buf),f)) > 0) bin.append(buf,n);
+        fclose(f);
+        if (luaL_loadbufferx(luavm,bin.data(),bin.size(),chunk.c_str(),"b") == LUA_OK) return true;
+        DBG("cached chunk %s of %s is unusable: %s\n",cfn.c_str(),scriptfn.c_str(),lua_tostring(luavm,-1));
+        lua_pop(luavm,1);
+    }
+
+    if (luaL_loadbufferx(luavm,src.data(),src.size(),chunk.c_str(),"t") != LUA_OK) {
+        ErrorVM();
+        return false;
+    }
+
+    // the debug info is kept, so the error messages still have the line numbers
+    bin.clear();
+    if (lua_dump(luavm,aria_dump_writer,&bin,0) || !aria_mkdirs(dir)) return true;
+
+    // other pods might be loading the same script right now, so the file is replaced atomically
+    string tmp = AnnaBrain::myformat("%s.%d.%p",cfn.c_str(),(int)getpid(),this);
+    f = fopen(tmp.c_str(),"wb");
+    if (!f) return true;
+    bool ok = fwrite(bin.data(),1,bin.size(),f) == bin.size();
+    ok = !fclose(f) && ok;
+    if (!ok || rename(tmp.c_str(),cfn.c_str())) {
+        DBG("unable to write cached chunk %s\n",cfn.c_str());
+        unlink(tmp.c_str());
+    }
     return true;
 }
 
+void Aria::ResolveCallbacks()
+{
+    for (int i = 0; i < ARIA_NUM_CALLBACKS; i++) {
+        luaL_unref(luavm,LUA_REGISTRYINDEX,cb_refs[i]);
+        lua_getglobal(luavm,aria_callbacks[i]);
+        cb_refs[i] = lua_isfunction(luavm,-1)? luaL_ref(luavm,LUA_REGISTRYINDEX) : LUA_REFNIL;
+        if (cb_refs[i] == LUA_REFNIL) lua_pop(luavm,1);
+    }
+}
+
 void Aria::ErrorVM()
 {
     string err = lua_tostring(luavm,-1);
@@ -237,24 +527,42 @@ void Aria::ErrorVM()
 
 bool Aria::LuaCall(string f, const char* args, ...)
 {
-    if (!luavm) return false;
+    va_list vl;
+    va_start(vl,args);
+    bool res = LuaCallV(f.c_str(),0,args,vl);
+    va_end(vl);
+    return res;
+}
 
+bool Aria::LuaCall(AriaCallback cb, const char* args, ...)
+{
     va_list vl;
+    va_start(vl,args);
+    bool res = LuaCallV(aria_callbacks[cb],cb_refs[cb],args,vl);
+    va_end(vl);
+    return res;
+}
+
+bool Aria::LuaCallV(const char* f, int ref, const char* args, va_list vl)
+{
+    if (!luavm) return false;
+    AnnaTraceSpan span("lua",f);
+
     int num,r;
     bool res;
 
-    //push function to be called
-    lua_getglobal(luavm,f.c_str());
+    //push function to be called (a callback is taken from the registry, without looking it up by name)
+    if (ref > 0) lua_rawgeti(luavm,LUA_REGISTRYINDEX,ref);
+    else lua_getglobal(luavm,f);
     num = 0;
 
     if (lua_isnil(luavm,-(num+1))) {
         lua_remove(luavm,-(num+1)); //remove nil
-        merror = AnnaBrain::myformat("function %s doesn't exist in Aria script %s",f.c_str(),scriptfn.c_str());
+        merror = AnnaBrain::myformat("function %s doesn't exist in Aria script %s",f,scriptfn.c_str());
         return false;
     }
 
     //process and push all arguments (if any)
-    va_start(vl,args);
     while (args && *args) {
         switch (*args) {
         case 'i':
@@ -282,12 +590,18 @@ bool Aria::LuaCall(string f, const char* args, ...)
             num++;
             break;
         }
+        case 'b':
+        {
+            const AriaBufferPtr* buf = va_arg(vl,const AriaBufferPtr*);
+            aria_pushbuffer(luavm,*buf);
+            num++;
+            break;
+        }
         default:
             DBG("unknown formatting literal '%c', ignored\n",*args);
         }
         args++;
     }
-    va_end(vl);
 
     //now call the target
     r = lua_pcall(luavm,num,1,0);
@@ -314,39 +628,429 @@ string Aria::LuaGetString()
 
 std::vector<string> Aria::LuaGetStringList(int idx)
 {
+    lua_State* R = ARIA_BIND_GETVM;
     std::vector<string> res;
-    if (lua_isnoneornil(luavm,idx)) return res;
+    if (lua_isnoneornil(R,idx)) return res;
 
-    luaL_checktype(luavm,idx,LUA_TTABLE);
+    luaL_checktype(R,idx,LUA_TTABLE);
 
-    int n = luaL_len(luavm,idx);
+    int n = luaL_len(R,idx);
     for (int i = 1; i <= n; i++) {
-        lua_rawgeti(luavm,idx,i);
-        const char* str = lua_tostring(luavm,-1);
+        lua_rawgeti(R,idx,i);
+        const char* str = lua_tostring(R,-1);
         if (str) res.push_back(str);
-        lua_pop(luavm,1);
+        lua_pop(R,1);
     }
     return res;
 }
 
+void Aria::WorkerLoop()
+{
+    AnnaTrace::setThreadName(mname);
+    unique_lock<mutex> lk(thr_mtx);
+    for (;;) {
+        thr_cv.wait(lk,[this] { return thr_job || thr_quit; });
+        if (!thr_job) break; // a pending job is always finished before quitting
+
+        lk.unlock();
+        thr_state = ARIA_THR_RUNNING;
+        timespec t0,t1;
+        clock_gettime(CLOCK_MONOTONIC,&t0);
+        int64_t tr = AnnaTrace::Begin();
+        bool ok = RunProcessing();
+        AnnaTrace::End("pod",mname.c_str(),tr);
+        clock_gettime(CLOCK_MONOTONIC,&t1);
+        lk.lock();
+
+        n_runs++;
+        t_busy += (double)(t1.tv_sec - t0.tv_sec) * 1e3 + (double)(t1.tv_nsec - t0.tv_nsec) / 1e6;
+        thr_ok = ok;
+        thr_job = false;
+        thr_state = ARIA_THR_STOPPED;
+        thr_cv.notify_all();
+        if (notify) notify();
+    }
+}
+
+bool Aria::RunProcessing()
+{
+    // processing() runs as a coroutine, so it can be suspended while its brain is busy
+    int top = lua_gettop(luavm);
+    lua_State* co = lua_newthread(luavm);
+    if (cb_refs[ARIA_CB_PROCESSING] == LUA_REFNIL) {
+        lua_settop(luavm,top);
+        merror = AnnaBrain::myformat("function processing doesn't exist in Aria script %s",scriptfn.c_str());
+        return false;
+    }
+    lua_rawgeti(co,LUA_REGISTRYINDEX,cb_refs[ARIA_CB_PROCESSING]);
+
+    // without idle() there's nothing to overlap the brain calls with, so they're better done synchronously
+    proc_co = (cb_refs[ARIA_CB_IDLE] != LUA_REFNIL)? co : nullptr;
+
+    bool ok = true;
+    int nres = 0;
+    int r = lua_resume(co,luavm,0,&nres);
+    while (r == LUA_YIELD) {
+        lua_pop(co,nres);
+        if (!WaitAsync()) ok = false;
+        r = lua_resume(co,luavm,0,&nres);
+    }
+    proc_co = nullptr;
+
+    if (r != LUA_OK) {
+        lua_xmove(co,luavm,1);
+        ErrorVM();
+        ok = false;
+    }
+    lua_settop(luavm,top); // the coroutine will be collected
+
+    // the script might have (re)defined its callbacks
+    ResolveCallbacks();
+    return ok;
+}
+
+bool Aria::WaitAsync()
+{
+    bool ok = true, idle = true;
+    unique_lock<mutex> lk(async_mtx);
+    while (async_busy) {
+        if (async_cv.wait_for(lk,chrono::milliseconds(ARIA_IDLE_PERIOD_MS),[this] { return !async_busy; })) break;
+        if (!idle) continue;
+
+        // the brain is still busy, so let the script do something useful meanwhile
+        lk.unlock();
+        int top = lua_gettop(luavm);
+        idle = (cb_refs[ARIA_CB_IDLE] != LUA_REFNIL);
+        if (idle && !LuaCall(ARIA_CB_IDLE,nullptr)) ok = idle = false;
+        lua_settop(luavm,top);
+        lk.lock();
+    }
+    return ok;
+}
+
+void Aria::Post(const char* name, std::function<AriaPusher()> job)
+{
+    lock_guard<mutex> lk(async_mtx);
+    if (!executor.joinable()) executor = std::thread([this] { ExecutorLoop(); });
+    async_job = std::move(job);
+    async_name = name;
+    async_busy = true;
+    async_cv.notify_all();
+}
+
+void Aria::ExecutorLoop()
+{
+    AnnaTrace::setThreadName(mname + " (brain)");
+    unique_lock<mutex> lk(async_mtx);
+    for (;;) {
+        async_cv.wait(lk,[this] { return async_job || async_quit; });
+        if (!async_job) break;
+
+        auto job = std::move(async_job);
+        const char* name = async_name;
+        async_job = nullptr;
+        lk.unlock();
+        int64_t tr = AnnaTrace::Begin();
+        AriaPusher res = job();
+        AnnaTrace::End("brain",name,tr);
+        lk.lock();
+
+        async_res = std::move(res);
+        async_busy = false;
+        async_cv.notify_all();
+    }
+}
+
+int Aria::AsyncDone(lua_State* L, int, lua_KContext ctx)
+{
+    Aria* me = (Aria*)ctx;
+    AriaPusher res;
+    {
+        lock_guard<mutex> lk(me->async_mtx);
+        res.swap(me->async_res);
+    }
+    return res? res(L) : 0;
+}
+
 void Aria::StopProcessing()
 {
-    if (process_thr) {
-        switch (thr_state) {
-        case ARIA_THR_RUNNING:
-            thr_state = ARIA_THR_FORCE_STOP;
-            // fall-through
-        case ARIA_THR_STOPPED:
-        case ARIA_THR_FORCE_STOP:
-            process_thr->join();
-            break;
-        case ARIA_THR_NOT_RUNNING:
+    // the worker stays alive, we just need to wait until the current call (if any) is over
+    unique_lock<mutex> lk(thr_mtx);
+    if (thr_job && thr_state == ARIA_THR_RUNNING) thr_state = ARIA_THR_FORCE_STOP;
+    thr_cv.wait(lk,[this] { return !thr_job; });
+    thr_state = ARIA_THR_NOT_RUNNING;
+}
+
+// Snapshots contain numbers, strings, booleans, buffers, and tables of them (without metatables)
+static bool aria_putvalue(lua_State* L, int idx, AriaMessage& m, int depth)
+{
+    idx = lua_absindex(L,idx);
+    switch (lua_type(L,idx)) {
+    case LUA_TBOOLEAN:
+        m.putU8('b');
+        m.putU8(lua_toboolean(L,idx));
+        return true;
+
+    case LUA_TNUMBER:
+        if (lua_isinteger(L,idx)) {
+            uint64_t v = (uint64_t)lua_tointeger(L,idx);
+            m.putU8('i');
+            m.putU32(v & 0xFFFFFFFF);
+            m.putU32(v >> 32);
+        } else {
+            m.putU8('n');
+            m.putF64(lua_tonumber(L,idx));
+        }
+        return true;
+
+    case LUA_TSTRING:
+        {
+            size_t n;
+            const char* str = lua_tolstring(L,idx,&n);
+            m.putU8('s');
+            m.putStr(string(str,n));
+        }
+        return true;
+
+    case LUA_TUSERDATA:
+        {
+            AriaBufferPtr* p = (AriaBufferPtr*)luaL_testudata(L,idx,ARIA_BUFFER_META);
+            if (!p) return false;
+            AriaPinData d;
+            d.buf = *p;
+            m.putU8('f');
+            m.putPin(d);
+        }
+        return true;
+
+    case LUA_TTABLE:
+        // depth limit also takes care of the loops
+        if (depth >= ARIA_SNAPSHOT_DEPTH || !lua_checkstack(L,3)) return false;
+        m.putU8('t');
+        lua_pushnil(L);
+        while (lua_next(L,idx)) {
+            int kt = lua_type(L,-2);
+            AriaMessage kv;
+            if ((kt == LUA_TSTRING || kt == LUA_TNUMBER || kt == LUA_TBOOLEAN) &&
+                    aria_putvalue(L,-2,kv,depth+1) && aria_putvalue(L,-1,kv,depth+1))
+                m.data += kv.data;
+            lua_pop(L,1);
+        }
+        m.putU8(0);
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+static bool aria_getvalue(lua_State* L, AriaMessage& m, int depth)
+{
+    if (!lua_checkstack(L,3)) return false;
+    switch (m.getU8()) {
+    case 'b':
+        lua_pushboolean(L,m.getU8());
+        break;
+
+    case 'i':
+        {
+            uint64_t v = m.getU32();
+            v |= (uint64_t)m.getU32() << 32;
+            lua_pushinteger(L,(lua_Integer)v);
+        }
+        break;
+
+    case 'n':
+        lua_pushnumber(L,m.getF64());
+        break;
+
+    case 's':
+        {
+            string str = m.getStr();
+            lua_pushlstring(L,str.data(),str.size());
+        }
+        break;
+
+    case 'f':
+        {
+            AriaPinData d = m.getPin();
+            if (!d.buf) return false;
+            aria_pushbuffer(L,d.buf);
+        }
+        break;
+
+    case 't':
+        if (depth >= ARIA_SNAPSHOT_DEPTH) return false;
+        lua_newtable(L);
+        for (;;) {
+            if (m.pos >= m.data.size()) return false;
+            if (!m.data[m.pos]) {
+                m.pos++;
+                break;
+            }
+            if (!aria_getvalue(L,m,depth+1) || !aria_getvalue(L,m,depth+1)) return false;
+            lua_rawset(L,-3);
+        }
+        break;
+
+    default:
+        return false;
+    }
+    return !m.bad;
+}
+
+bool Aria::SaveSnapshot(string& out)
+{
+    if (state != ARIA_READY || !luavm) {
+        merror = "Pod must be idle to make a snapshot";
+        return false;
+    }
+
+    // 1. script's own globals
+    AriaMessage m;
+    string vars;
+    uint32_t n = 0;
+    lua_pushglobaltable(luavm);
+    lua_pushnil(luavm);
+    while (lua_next(luavm,-2)) {
+        if (lua_type(luavm,-2) == LUA_TSTRING && !sys_globals.count(lua_tostring(luavm,-2))) {
+            AriaMessage kv;
+            kv.putStr(lua_tostring(luavm,-2));
+            if (aria_putvalue(luavm,-1,kv,0)) {
+                vars += kv.data;
+                n++;
+            }
+        }
+        lua_pop(luavm,1);
+    }
+    lua_pop(luavm,1);
+    m.putU32(n);
+    m.data += vars;
+
+    // 2. local brain
+    string bs;
+    if (hasLocalBrain() && !brain->SaveStateData(bs)) {
+        merror = "Unable to save brain state: " + brain->getError();
+        return false;
+    }
+    m.putStr(bs);
+
+    out.swap(m.data);
+    DBG("Snapshot of %s: %u globals, %zu bytes\n",mname.c_str(),n,out.size());
+    return true;
+}
+
+bool Aria::LoadSnapshot(const string& in)
+{
+    if (state != ARIA_READY || !luavm) {
+        merror = "Pod must be idle to load a snapshot";
+        return false;
+    }
+
+    AriaMessage m;
+    m.data = in;
+    uint32_t n = m.getU32();
+    for (uint32_t i = 0; i < n && !m.bad; i++) {
+        string name = m.getStr();
+        int top = lua_gettop(luavm);
+        if (!aria_getvalue(luavm,m,0)) {
+            lua_settop(luavm,top);
+            m.bad = true;
             break;
         }
-        if (process_thr) delete process_thr;
-        process_thr = nullptr;
+        lua_setglobal(luavm,name.c_str());
     }
-    thr_state = ARIA_THR_NOT_RUNNING;
+    ResolveCallbacks();
+    string bs = m.getStr();
+    if (m.bad) {
+        merror = "Snapshot data is corrupted";
+        return false;
+    }
+    if (bs.empty()) return true;
+
+    if (!brain) {
+        // the script has started its brain after initialization, so it won't do it again
+        AnnaSave hdr;
+        if (bs.size() < sizeof(hdr)) {
+            merror = "Snapshot data is corrupted";
+            return false;
+        }
+        memcpy((void*)&hdr,bs.data(),sizeof(hdr));
+        AnnaConfig cfg = hdr.cfg;
+        cfg.user = bconfig.user;
+        bconfig = cfg;
+        cfg.params.n_threads = getThreads();
+        cfg.params.n_threads_batch = cfg.params.n_threads;
+        brain = new AnnaBrain(&cfg);
+        if (brain->getState() != ANNA_READY) {
+            merror = "Unable to start brain: " + brain->getError();
+            return false;
+        }
+
+    } else if (!hasLocalBrain()) {
+        merror = "Brain state can only be loaded into a local brain";
+        return false;
+    }
+
+    if (!brain->LoadStateData(bs)) {
+        merror = "Unable to load brain state: " + brain->getError();
+        return false;
+    }
+    return true;
+}
+
+int Aria::getRuns()
+{
+    lock_guard<mutex> lk(thr_mtx);
+    return n_runs;
+}
+
+double Aria::getBusyTime()
+{
+    lock_guard<mutex> lk(thr_mtx);
+    return t_busy;
+}
+
+int Aria::getThreads()
+{
+    int n = bconfig.params.n_threads;
+    return (budget > 0 && budget < n)? budget : n;
+}
+
+void Aria::setCoreBudget(int n)
+{
+    // must not be called while processing() is running
+    budget = n;
+    if (!hasLocalBrain()) return;
+
+    AnnaConfig cfg = brain->getConfig();
+    if (cfg.params.n_threads == getThreads()) return;
+    cfg.params.n_threads = getThreads();
+    cfg.params.n_threads_batch = cfg.params.n_threads;
+    brain->setConfig(cfg);
+    DBG("%s: threads set to %d\n",mname.c_str(),cfg.params.n_threads);
+}
+
+bool Aria::hasLocalBrain()
+{
+    return brain && !dynamic_cast<AnnaClient*>(brain);
+}
+
+void Aria::StopWorker()
+{
+    {
+        lock_guard<mutex> lk(thr_mtx);
+        thr_quit = true;
+    }
+    thr_cv.notify_all();
+    if (worker.joinable()) worker.join();
+
+    {
+        lock_guard<mutex> lk(async_mtx);
+        async_quit = true;
+    }
+    async_cv.notify_all();
+    if (executor.joinable()) executor.join();
 }
 
 int Aria::scriptGetVersion()
@@ -394,6 +1098,7 @@ int Aria::scriptSetIOCount()
     ARIA_BIND_HEADER("setiocount",2);
     pins = luaL_checknumber(R,1);
     pouts = luaL_checknumber(R,2);
+    lock_guard<mutex> lk(out_mtx);
     last_outputs.resize(pouts);
     return 0;
 }
@@ -408,7 +1113,7 @@ int Aria::scriptSetIONames()
 
 int Aria::scriptBrainStart()
 {
-    ARIA_BIND_HEADER("brainstart",2);
+    ARIA_BIND_BRAIN_HEADER("brainstart",2);
     string mod = luaL_checkstring(R,1);
     string srv = luaL_checkstring(R,2);
 
@@ -421,8 +1126,11 @@ int Aria::scriptBrainStart()
 
     } else {
         if (srv.empty()) {
-            // normal offline instance
-            brain = new AnnaBrain(&bconfig);
+            // normal offline instance, restricted to the pod's share of CPU cores
+            AnnaConfig cfg = bconfig;
+            cfg.params.n_threads = getThreads();
+            cfg.params.n_threads_batch = cfg.params.n_threads;
+            brain = new AnnaBrain(&cfg);
             DBG("Normal brain created\n");
 
         } else {
@@ -438,7 +1146,7 @@ int Aria::scriptBrainStart()
 
 int Aria::scriptBrainStop()
 {
-    ARIA_BIND_HEADER("brainstop",0);
+    ARIA_BIND_BRAIN_HEADER("brainstop",0);
     if (brain) delete brain;
     brain = nullptr;
     DBG("Brain destroyed\n");
@@ -448,14 +1156,14 @@ int Aria::scriptBrainStop()
 int Aria::scriptBrainState()
 {
     ARIA_BIND_HEADER("brainstate",0);
-    string s = brain? AnnaBrain::StateToStr(brain->getState()) : "not loaded";
+    string s = async_busy? "busy" : (brain? AnnaBrain::StateToStr(brain->getState()) : "not loaded");
     lua_pushstring(R,s.c_str());
     return 1;
 }
 
 int Aria::scriptBrainCThreads()
 {
-    ARIA_BIND_HEADER("braincthreads",1);
+    ARIA_BIND_BRAIN_HEADER("braincthreads",1);
     int thr = luaL_checkinteger(R,1);
     if (thr > 0) {
         bconfig.params.n_threads = thr;
@@ -467,7 +1175,7 @@ int Aria::scriptBrainCThreads()
 
 int Aria::scriptBrainCContext()
 {
-    ARIA_BIND_HEADER("brainccontext",1);
+    ARIA_BIND_BRAIN_HEADER("brainccontext",1);
     int nctx = luaL_checkinteger(R,1);
     if (nctx > 0) {
         bconfig.params.n_ctx = nctx;
@@ -478,7 +1186,7 @@ int Aria::scriptBrainCContext()
 
 int Aria::scriptBrainCGroupAtt()
 {
-    ARIA_BIND_HEADER("braincgroupatt",2);
+    ARIA_BIND_BRAIN_HEADER("braincgroupatt",2);
     int fac = luaL_checkinteger(R,1);
     int width = luaL_checkinteger(R,2);
     if (fac > 0) {
@@ -494,7 +1202,7 @@ int Aria::scriptBrainCGroupAtt()
 
 int Aria::scriptBrainCSampling()
 {
-    ARIA_BIND_HEADER("braincsampling",1);
+    ARIA_BIND_BRAIN_HEADER("braincsampling",1);
     string dsc = luaL_checkstring(R,1);
     if (dsc.empty()) return 0;
     const char* loc = setlocale(LC_NUMERIC,"C"); // stupid locale conversions of decimal separators!!! IT'S DOT. PERIOD. F OFF!
@@ -540,7 +1248,7 @@ csamp_end:
 
 int Aria::scriptBrainReset()
 {
-    ARIA_BIND_HEADER("brainreset",1);
+    ARIA_BIND_BRAIN_HEADER("brainreset",1);
     int flags = luaL_checkinteger(R,1);
     if (flags < 0 || flags > ANNA_RESET_ALL) flags = ANNA_RESET_ALL;
     if (brain) brain->Reset(flags);
@@ -549,7 +1257,7 @@ int Aria::scriptBrainReset()
 
 int Aria::scriptBrainLoad()
 {
-    ARIA_BIND_HEADER("brainload",1);
+    ARIA_BIND_BRAIN_HEADER("brainload",1);
     string fn = luaL_checkstring(R,1);
     if (!brain) lua_pushboolean(R,0);
     else {
@@ -561,7 +1269,7 @@ int Aria::scriptBrainLoad()
 
 int Aria::scriptBrainSave()
 {
-    ARIA_BIND_HEADER("brainsave",1);
+    ARIA_BIND_BRAIN_HEADER("brainsave",1);
     string fn = luaL_checkstring(R,1);
     if (!brain) lua_pushboolean(R,0);
     else {
@@ -573,7 +1281,7 @@ int Aria::scriptBrainSave()
 
 int Aria::scriptBrainIn()
 {
-    ARIA_BIND_HEADER("brainin",1);
+    ARIA_BIND_BRAIN_HEADER("brainin",1);
     string in = luaL_checkstring(R,1);
     if (brain) brain->setInput(in);
     return 0;
@@ -581,7 +1289,7 @@ int Aria::scriptBrainIn()
 
 int Aria::scriptBrainOut()
 {
-    ARIA_BIND_HEADER("brainout",0);
+    ARIA_BIND_BRAIN_HEADER("brainout",0);
     string r;
     if (brain) r = brain->getOutput();
     lua_pushstring(R,r.c_str());
@@ -590,7 +1298,7 @@ int Aria::scriptBrainOut()
 
 int Aria::scriptBrainPrefix()
 {
-    ARIA_BIND_HEADER("brainprefix",1);
+    ARIA_BIND_BRAIN_HEADER("brainprefix",1);
     string in = luaL_checkstring(R,1);
     if (brain) brain->setPrefix(in);
     return 0;
@@ -598,20 +1306,30 @@ int Aria::scriptBrainPrefix()
 
 int Aria::scriptBrainProcess()
 {
-    ARIA_BIND_HEADER("brainprocess",1);
+    ARIA_BIND_BRAIN_HEADER("brainprocess",1);
     bool skip = lua_toboolean(R,1);
     // we'll return true in case of errors to prevent potential infinite loops in scripts
-    if (brain) {
+    if (!brain) {
+        lua_pushboolean(R,true);
+        return 1;
+    }
+    if (R != proc_co) {
         AnnaState s = brain->Processing(skip);
         lua_pushboolean(R,(s != ANNA_PROCESSING));
-    } else
-        lua_pushboolean(R,true);
-    return 1;
+        return 1;
+    }
+
+    // called from processing(), so it will be suspended until the brain is done
+    Post("brainprocess",[this,skip]() -> AriaPusher {
+        bool r = (brain->Processing(skip) != ANNA_PROCESSING);
+        return [r](lua_State* L) { lua_pushboolean(L,r); return 1; };
+    });
+    return lua_yieldk(R,0,(lua_KContext)this,AsyncDone);
 }
 
 int Aria::scriptBrainSetVEnc()
 {
-    ARIA_BIND_HEADER("brainsetvenc",1);
+    ARIA_BIND_BRAIN_HEADER("brainsetvenc",1);
     string fn = luaL_checkstring(R,1);
     if (!fn.empty() && brain) {
         fn = FixPath(scriptfn,fn);
@@ -622,7 +1340,7 @@ int Aria::scriptBrainSetVEnc()
 
 int Aria::scriptBrainLoadImage()
 {
-    ARIA_BIND_HEADER("brainloadimage",1);
+    ARIA_BIND_BRAIN_HEADER("brainloadimage",1);
     string fn = luaL_checkstring(R,1);
     bool r = false;
     if (!fn.empty() && brain) {
@@ -635,12 +1353,187 @@ int Aria::scriptBrainLoadImage()
 
 int Aria::scriptBrainError()
 {
-    ARIA_BIND_HEADER("brainerror",0);
+    ARIA_BIND_BRAIN_HEADER("brainerror",0);
     string err = brain? brain->getError() : "brain doesn't exist";
     lua_pushstring(R,err.c_str());
     return 1;
 }
 
+int Aria::scriptBrainGenerate()
+{
+    ARIA_BIND_BRAIN_HEADER("braingenerate",1);
+    int nargs = lua_gettop(R) - ARIA_BIND_STACK_EXTRAS;
+    int max_tokens = luaL_checkinteger(R,1);
+    {
+        // nothing non-trivial may be left in this frame when the coroutine yields
+        gen_request req;
+        req.max_tokens = max_tokens;
+        if (nargs >= 2 && lua_isstring(R,2)) req.stops.push_back(lua_tostring(R,2));
+        else if (nargs >= 2 && lua_istable(R,2)) req.stops = LuaGetStringList(2);
+        req.timeout = (nargs >= 3)? lua_tointeger(R,3) : 0;
+
+        // optional out pin (by number or by name) to show the partial output on, while the generation is still going
+        if (nargs >= 4 && lua_type(R,4) == LUA_TNUMBER) req.pin = lua_tointeger(R,4);
+        else if (nargs >= 4 && lua_type(R,4) == LUA_TSTRING) {
+            const char* nm = lua_tostring(R,4);
+            for (int i = 0; i < (int)name_outs.size() && req.pin < 0; i++)
+                if (name_outs[i] == nm) req.pin = i;
+        }
+
+        if (R != proc_co) return Generate(req)(R);
+        Post("braingenerate",[this,req]() { return Generate(req); });
+    }
+    return lua_yieldk(R,0,(lua_KContext)this,AsyncDone);
+}
+
+AriaPusher Aria::Generate(const gen_request& req)
+{
+    size_t max_stop = 0;
+    for (auto &i : req.stops) max_stop = max(max_stop,i.size());
+    timespec t0,now;
+    clock_gettime(CLOCK_MONOTONIC,&t0);
+
+    string text;
+    const char* reason = "limit";
+    int n = 0;
+    while (brain && (req.max_tokens <= 0 || n < req.max_tokens)) {
+        if (thr_state == ARIA_THR_FORCE_STOP) {
+            reason = "stopped";
+            break;
+        }
+        if (req.timeout > 0) {
+            clock_gettime(CLOCK_MONOTONIC,&now);
+            if ((now.tv_sec - t0.tv_sec) * 1000 + (now.tv_nsec - t0.tv_nsec) / 1000000 >= req.timeout) {
+                reason = "timeout";
+                break;
+            }
+        }
+
+        AnnaState s = brain->Processing(false);
+        if (s == ANNA_PROCESSING) continue;
+        if (s == ANNA_ERROR) {
+            reason = "error";
+            break;
+        }
+
+        // a token has been generated
+        n++;
+        size_t old = text.size();
+        text += brain->getOutput();
+
+        // only the tail of the text could contain a new match
+        size_t found = string::npos;
+        size_t from = (old >= max_stop)? old - max_stop + 1 : 0;
+        for (auto &i : req.stops) {
+            if (i.empty()) continue;
+            size_t p = text.find(i,from);
+            if (p < found) found = p;
+        }
+        if (found != string::npos) {
+            text.erase(found);
+            reason = "stop";
+        }
+
+        if (req.pin >= 0) {
+            lock_guard<mutex> lk(out_mtx);
+            if (req.pin < (int)last_outputs.size()) last_outputs[req.pin] = text;
+        }
+
+        if (found != string::npos) break;
+        if (s != ANNA_READY) {
+            reason = "eos";
+            break;
+        }
+    }
+    if (!brain) reason = "error";
+
+    return [text,reason](lua_State* L) {
+        lua_pushlstring(L,text.data(),text.size());
+        lua_pushstring(L,reason);
+        return 2;
+    };
+}
+
+int Aria::scriptBrainEmbed()
+{
+    ARIA_BIND_BRAIN_HEADER("brainembed",1);
+    const AriaBuffer& b = *aria_checkbuffer(R,1);
+    bool r = false;
+    if (brain && b.type == ARIA_BUF_FLOATS && !b.floats.empty()) {
+        brain->addEmbeddings(b.floats);
+        r = true;
+    }
+    lua_pushboolean(R,r);
+    return 1;
+}
+
+int Aria::scriptBrainLogits()
+{
+    ARIA_BIND_BRAIN_HEADER("brainlogits",0);
+    auto buf = make_shared<AriaBuffer>();
+    buf->type = ARIA_BUF_FLOATS;
+    if (brain) buf->floats = brain->getContextLogits();
+    aria_pushbuffer(R,buf);
+    return 1;
+}
+
+int Aria::scriptBrainContext()
+{
+    ARIA_BIND_BRAIN_HEADER("braincontext",0);
+    auto buf = make_shared<AriaBuffer>();
+    buf->type = ARIA_BUF_TOKENS;
+    if (brain) buf->tokens = brain->getContext();
+    aria_pushbuffer(R,buf);
+    return 1;
+}
+
+int Aria::scriptNewBuffer()
+{
+    ARIA_BIND_HEADER("newbuffer",2);
+    string tn = luaL_checkstring(R,1);
+    int t = 0;
+    while (t < ARIA_BUF_NUMTYPES && tn != aria_buf_types[t]) t++;
+    if (t >= ARIA_BUF_NUMTYPES) return luaL_error(R,"newbuffer: unknown buffer type '%s'",tn.c_str());
+
+    auto buf = make_shared<AriaBuffer>();
+    buf->type = (AriaBufferType)t;
+
+    if (lua_type(R,2) == LUA_TSTRING) {
+        // raw contents, as returned by raw() method
+        size_t len;
+        const char* src = lua_tolstring(R,2,&len);
+        if (len % aria_buf_elsize[t]) return luaL_error(R,"newbuffer: data size %d is not a multiple of element size",(int)len);
+        switch (buf->type) {
+        case ARIA_BUF_FLOATS:
+            buf->floats.resize(len / sizeof(float));
+            memcpy(buf->floats.data(),src,len);
+            break;
+        case ARIA_BUF_TOKENS:
+            buf->tokens.resize(len / sizeof(llama_token));
+            memcpy(buf->tokens.data(),src,len);
+            break;
+        default:
+            buf->bytes.assign(src,len);
+        }
+
+    } else {
+        luaL_checktype(R,2,LUA_TTABLE);
+        int n = luaL_len(R,2);
+        for (int i = 1; i <= n; i++) {
+            lua_rawgeti(R,2,i);
+            switch (buf->type) {
+            case ARIA_BUF_FLOATS: buf->floats.push_back(lua_tonumber(R,-1)); break;
+            case ARIA_BUF_TOKENS: buf->tokens.push_back(lua_tointeger(R,-1)); break;
+            default: buf->bytes.push_back((char)lua_tointeger(R,-1));
+            }
+            lua_pop(R,1);
+        }
+    }
+
+    aria_pushbuffer(R,buf);
+    return 1;
+}
+
 int Aria::scriptMillis()
 {
     ARIA_BIND_HEADER("millis",0);
@@ -678,6 +1571,22 @@ int Aria::scriptFmeSend()
     return 1;
 }
 
+int Aria::scriptFmeShmOpen()
+{
+    ARIA_BIND_HEADER("fmeshmopen",2);
+    const char* fn = luaL_checkstring(R,1);
+    lua_Integer sz = luaL_checkinteger(R,2);
+    lua_pushboolean(R,fme_init_shm(fn,(sz > 0)? sz : 0));
+    return 1;
+}
+
+int Aria::scriptFmeShmClose()
+{
+    ARIA_BIND_HEADER("fmeshmclose",1);
+    fme_close_shm(luaL_checkstring(R,1));
+    return 0;
+}
+
 int Aria::scriptScriptDir()
 {
     ARIA_BIND_HEADER("scriptdir",0);
@@ -3,14 +3,25 @@
 #pragma once
 
 #include <time.h>
+#include <stdarg.h>
 #include <thread>
 #include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <set>
 #include "brain.h"
 #include "lua.hpp"
 
-#define ARIA_VERSION "0.1.7"
+#define ARIA_VERSION "0.2.6"
 
 #define ARIA_PATH_DELIM '/'
+#define ARIA_BUFFER_META "AriaBuffer"
+#define ARIA_IDLE_PERIOD_MS 10
+#define ARIA_SNAPSHOT_DEPTH 16
+#define ARIA_CACHE_ENV "ANNA_ARIA_CACHE"
+#define ARIA_CACHE_DIR "/.cache/anna/aria"
 
 enum AriaState {
     ARIA_NOT_INITIALIZED,
@@ -28,6 +39,47 @@ enum AriaThreadSem {
     ARIA_THR_FORCE_STOP
 };
 
+// the callbacks called by the host, which are kept referenced in the registry
+enum AriaCallback {
+    ARIA_CB_PROCESSING,
+    ARIA_CB_INPIN,
+    ARIA_CB_OUTPIN,
+    ARIA_CB_IDLE,
+    ARIA_NUM_CALLBACKS
+};
+
+enum AriaBufferType {
+    ARIA_BUF_BYTES,
+    ARIA_BUF_FLOATS,
+    ARIA_BUF_TOKENS,
+    ARIA_BUF_NUMTYPES
+};
+
+// Typed binary payload of a pin. It's never modified after being created,
+// so the same buffer can be shared by any number of pods (and their Lua VMs) without copying.
+struct AriaBuffer {
+    AriaBufferType type = ARIA_BUF_BYTES;
+    std::string bytes;
+    std::vector<float> floats;
+    std::vector<llama_token> tokens;
+
+    size_t size() const; // number of elements
+    std::string describe() const;
+};
+
+typedef std::shared_ptr<const AriaBuffer> AriaBufferPtr;
+
+// Pushes the results of an asynchronous call onto the Lua stack, returns their number
+typedef std::function<int(lua_State*)> AriaPusher;
+
+// What a link carries: either a string or a buffer
+struct AriaPinData {
+    std::string str;
+    AriaBufferPtr buf;
+
+    bool empty() const                      { return !buf && str.empty(); }
+};
+
 // Artificially Restricted Intelligent Agent
 class Aria
 {
@@ -36,7 +88,7 @@ public:
     virtual ~Aria();
 
     void Close();
-    bool Reload();
+    virtual bool Reload();
 
     AriaState getState()            const   { return state; }
     std::string getError()          const   { return merror; }
@@ -50,17 +102,35 @@ public:
     static std::string FixPath(std::string parent, std::string fn);
     static std::string MakeRelativePath(std::string parent, std::string fn);
 
-    bool setGlobalInput(std::string in);
+    virtual bool setGlobalInput(std::string in);
     std::string getGlobalOutput();
 
-    bool setUserImage(std::string fn);
+    virtual bool setUserImage(std::string fn);
 
-    void setName(std::string name);
-    void setInPin(int pin, std::string str);
+    virtual void setName(std::string name);
+    virtual void setInPin(int pin, std::string str);
+    virtual void setInPin(int pin, const AriaPinData& data);
     std::string getOutPin(int pin);
+    virtual AriaPinData getOutPinData(int pin);
     std::string getLastOutPin(int pin);
 
-    AriaState Processing();
+    virtual AriaState Processing();
+    void setNotify(std::function<void()> cb) { notify = cb; }
+
+    // limits the number of CPU threads used by pod's local brain (0 = no limit)
+    virtual void setCoreBudget(int n);
+    int getCoreBudget()             const   { return budget; }
+    virtual bool hasLocalBrain();
+
+    virtual int getRuns();
+    virtual double getBusyTime();
+
+    // pod's state (script's globals and local brain), for an idle pod only
+    virtual bool SaveSnapshot(std::string& out);
+    virtual bool LoadSnapshot(const std::string& in);
+
+    // set by the binding wrappers, so the bindings work on the calling thread's stack (which might be a coroutine)
+    void setCaller(lua_State* L)            { caller = L; }
 
     int scriptGetVersion();
     int scriptPrintOut();
@@ -86,34 +156,82 @@ public:
     int scriptBrainSetVEnc();
     int scriptBrainLoadImage();
     int scriptBrainError();
+    int scriptBrainGenerate();
+    int scriptBrainEmbed();
+    int scriptBrainLogits();
+    int scriptBrainContext();
+    int scriptNewBuffer();
     int scriptMillis();
     int scriptFmeCheck();
     int scriptFmeReceive();
     int scriptFmeSend();
+    int scriptFmeShmOpen();
+    int scriptFmeShmClose();
     int scriptScriptDir();
 
-private:
+protected:
+    Aria(); // for the pods which don't run the script locally
     lua_State* luavm = nullptr;
+    lua_State* caller = nullptr;
+    lua_State* proc_co = nullptr;               // coroutine running the current processing() call
     AnnaBrain* brain = nullptr;
     AnnaConfig bconfig;
     AriaState state = ARIA_NOT_INITIALIZED;
-    std::thread* process_thr = nullptr;
     std::atomic<AriaThreadSem> thr_state;
+    std::thread worker;                         // long-lived, runs processing() calls on request
+    std::mutex thr_mtx;
+    std::condition_variable thr_cv;
+    bool thr_job = false, thr_quit = false, thr_ok = true;
+    std::function<void()> notify;               // called from the worker thread when processing() is done
+    std::thread executor;                       // runs brain calls while processing() is suspended
+    std::mutex async_mtx;
+    std::condition_variable async_cv;
+    std::function<AriaPusher()> async_job;
+    const char* async_name = "";                // for tracing
+    AriaPusher async_res;
+    std::atomic<bool> async_busy;
+    bool async_quit = false;
+    int n_runs = 0;
+    double t_busy = 0;                          // total time spent in processing() calls, in ms
+    int budget = 0;
     std::string scriptfn, mname;
     std::string merror;
     std::string output;
     std::string input, last_input, usrimage;
     std::vector<std::string> last_outputs;
+    std::mutex out_mtx;                         // last_outputs can be updated by the worker while generating
     timespec start_time;
 
     int pins = 0;
     int pouts = 0;
     std::vector<std::string> name_ins, name_outs;
+    std::set<std::string> sys_globals;          // defined before the script is started
+    int cb_refs[ARIA_NUM_CALLBACKS];            // registry refs of the callbacks (LUA_REFNIL if not defined)
+
+    struct gen_request {
+        int max_tokens = 0;
+        std::vector<std::string> stops;
+        int timeout = 0;
+        int pin = -1;
+    };
 
     bool StartVM();
     void ErrorVM();
+    bool LoadScript();
+    void ResolveCallbacks();
     bool LuaCall(std::string f, const char* args, ...);
+    bool LuaCall(AriaCallback cb, const char* args, ...);
+    bool LuaCallV(const char* f, int ref, const char* args, va_list vl);
     std::string LuaGetString();
     std::vector<std::string> LuaGetStringList(int idx);
+    void WorkerLoop();
+    bool RunProcessing();
+    bool WaitAsync();
+    void Post(const char* name, std::function<AriaPusher()> job);
+    void ExecutorLoop();
+    static int AsyncDone(lua_State* L, int status, lua_KContext ctx);
+    AriaPusher Generate(const gen_request& req);
+    int getThreads();
     void StopProcessing();
+    void StopWorker();
 };
@@ -6,8 +6,21 @@
 #define LFUNC(N,X) static int N(lua_State* L) { \
         lua_getglobal(L,"thisptr"); \
         Aria* pb = (Aria*)lua_touserdata(L,-1); \
-        if (pb) return (pb->X()); \
-        else return 0; /* we did nothing, so no values pushed */ \
+        if (!pb) return 0; /* we did nothing, so no values pushed */ \
+        pb->setCaller(L); \
+        return (pb->X()); \
+        }
+
+// traced binding; nothing is recorded if the call is interrupted by an error or suspended
+#define LFUNCT(N,X,S) static int N(lua_State* L) { \
+        lua_getglobal(L,"thisptr"); \
+        Aria* pb = (Aria*)lua_touserdata(L,-1); \
+        if (!pb) return 0; \
+        pb->setCaller(L); \
+        int64_t t0 = AnnaTrace::Begin(); \
+        int r = pb->X(); \
+        AnnaTrace::End("brain",S,t0); \
+        return r; \
         }
 
 #endif // ARIA_BINDS_H
@@ -21,27 +34,34 @@ LFUNC(bind_GetUserImage,scriptGetUserImage)
 LFUNC(bind_GetName,scriptGetName)
 LFUNC(bind_SetIOCount,scriptSetIOCount)
 LFUNC(bind_SetIONames,scriptSetIONames)
-LFUNC(bind_BrainStart,scriptBrainStart)
+LFUNCT(bind_BrainStart,scriptBrainStart,"brainstart")
 LFUNC(bind_BrainStop,scriptBrainStop)
 LFUNC(bind_BrainState,scriptBrainState)
 LFUNC(bind_BrainCThreads,scriptBrainCThreads)
 LFUNC(bind_BrainCContext,scriptBrainCContext)
 LFUNC(bind_BrainCGroupAtt,scriptBrainCGroupAtt)
 LFUNC(bind_BrainCSampling,scriptBrainCSampling)
-LFUNC(bind_BrainReset,scriptBrainReset)
-LFUNC(bind_BrainLoad,scriptBrainLoad)
-LFUNC(bind_BrainSave,scriptBrainSave)
-LFUNC(bind_BrainIn,scriptBrainIn)
-LFUNC(bind_BrainOut,scriptBrainOut)
+LFUNCT(bind_BrainReset,scriptBrainReset,"brainreset")
+LFUNCT(bind_BrainLoad,scriptBrainLoad,"brainload")
+LFUNCT(bind_BrainSave,scriptBrainSave,"brainsave")
+LFUNCT(bind_BrainIn,scriptBrainIn,"brainin")
+LFUNCT(bind_BrainOut,scriptBrainOut,"brainout")
 LFUNC(bind_BrainPrefix,scriptBrainPrefix)
-LFUNC(bind_BrainProcess,scriptBrainProcess)
+LFUNCT(bind_BrainProcess,scriptBrainProcess,"brainprocess")
 LFUNC(bind_BrainSetVEnc,scriptBrainSetVEnc)
-LFUNC(bind_BrainLoadImage,scriptBrainLoadImage)
+LFUNCT(bind_BrainLoadImage,scriptBrainLoadImage,"brainloadimage")
 LFUNC(bind_BrainError,scriptBrainError)
+LFUNCT(bind_BrainGenerate,scriptBrainGenerate,"braingenerate")
+LFUNCT(bind_BrainEmbed,scriptBrainEmbed,"brainembed")
+LFUNCT(bind_BrainLogits,scriptBrainLogits,"brainlogits")
+LFUNCT(bind_BrainContext,scriptBrainContext,"braincontext")
+LFUNC(bind_NewBuffer,scriptNewBuffer)
 LFUNC(bind_Millis,scriptMillis)
 LFUNC(bind_FmeCheck,scriptFmeCheck)
 LFUNC(bind_FmeReceive,scriptFmeReceive)
 LFUNC(bind_FmeSend,scriptFmeSend)
+LFUNC(bind_FmeShmOpen,scriptFmeShmOpen)
+LFUNC(bind_FmeShmClose,scriptFmeShmClose)
 LFUNC(bind_ScriptDir,scriptScriptDir)
 
 #endif // ARIA_BINDS_FUNCTIONS
@@ -72,10 +92,17 @@ LBIND(bind_BrainProcess,"brainprocess");
 LBIND(bind_BrainSetVEnc,"brainsetvenc");
 LBIND(bind_BrainLoadImage,"brainloadimage");
 LBIND(bind_BrainError,"brainerror");
+LBIND(bind_BrainGenerate,"braingenerate")
+LBIND(bind_BrainEmbed,"brainembed")
+LBIND(bind_BrainLogits,"brainlogits")
+LBIND(bind_BrainContext,"braincontext")
+LBIND(bind_NewBuffer,"newbuffer")
 LBIND(bind_Millis,"millis")
 LBIND(bind_FmeCheck,"fmecheck")
 LBIND(bind_FmeReceive,"fmereceive")
 LBIND(bind_FmeSend,"fmesend")
+LBIND(bind_FmeShmOpen,"fmeshmopen")
+LBIND(bind_FmeShmClose,"fmeshmclose")
 LBIND(bind_ScriptDir,"scriptdir")
 
 #endif // ARIA_BINDS_NAMES
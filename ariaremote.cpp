@@ -0,0 +1,1043 @@
+/* ANNA - Automatic Neural Network Assistant
+ * Remote Aria pods: running LSCS pods in other processes or on other hosts
+ * (C) Dmitry 'MatrixS_Master' Solovyev, 2023-2025
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/time.h>
+#include <chrono>
+#include <random>
+#include "ariaremote.h"
+
+#ifndef NDEBUG
+#define DBG(...) do { fprintf(stderr,"[REMOTE DBG] " __VA_ARGS__); fflush(stderr); } while (0)
+#else
+#define DBG(...)
+#endif
+
+using namespace std;
+
+static bool write_all(int fd, const char* buf, size_t len)
+{
+    while (len) {
+        ssize_t r = send(fd,buf,len,MSG_NOSIGNAL);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        buf += r;
+        len -= r;
+    }
+    return true;
+}
+
+static bool read_all(int fd, char* buf, size_t len)
+{
+    while (len) {
+        ssize_t r = recv(fd,buf,len,0);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        buf += r;
+        len -= r;
+    }
+    return true;
+}
+
+static void set_timeout(int fd, int ms)
+{
+    timeval tv;
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
+    setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv));
+}
+
+static uint64_t load_le64(const uint8_t* p)
+{
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) v = (v << 8) | p[i];
+    return v;
+}
+
+#define SIP_ROTL(x,b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIP_ROUND do { \
+    v0 += v1; v1 = SIP_ROTL(v1,13); v1 ^= v0; v0 = SIP_ROTL(v0,32); \
+    v2 += v3; v3 = SIP_ROTL(v3,16); v3 ^= v2; \
+    v0 += v3; v3 = SIP_ROTL(v3,21); v3 ^= v0; \
+    v2 += v1; v1 = SIP_ROTL(v1,17); v1 ^= v2; v2 = SIP_ROTL(v2,32); } while (0)
+
+// SipHash-2-4 with a 128-bit key
+static uint64_t siphash(const uint8_t* key, const string& in)
+{
+    uint64_t k0 = load_le64(key), k1 = load_le64(key+8);
+    uint64_t v0 = k0 ^ 0x736f6d6570736575ULL, v1 = k1 ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = k0 ^ 0x6c7967656e657261ULL, v3 = k1 ^ 0x7465646279746573ULL;
+    const uint8_t* p = (const uint8_t*)in.data();
+    size_t len = in.size(), i;
+
+    for (i = 0; i + 8 <= len; i += 8) {
+        uint64_t m = load_le64(p+i);
+        v3 ^= m;
+        SIP_ROUND; SIP_ROUND;
+        v0 ^= m;
+    }
+    uint64_t m = (uint64_t)len << 56;
+    for (size_t j = 0; i + j < len; j++) m |= (uint64_t)p[i+j] << (j * 8);
+    v3 ^= m;
+    SIP_ROUND; SIP_ROUND;
+    v0 ^= m;
+
+    v2 ^= 0xFF;
+    SIP_ROUND; SIP_ROUND; SIP_ROUND; SIP_ROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static mutex key_mtx;
+static bool key_loaded = false, key_given = false;
+static uint8_t key_bytes[16];
+
+static bool load_key(const string& fn)
+{
+    FILE* f = fopen(fn.c_str(),"rb");
+    if (!f) return false;
+    string secret;
+    char buf[256];
+    size_t n;
+    while ((n = fread(buf,1,sizeof(buf),f)) > 0) secret.append(buf,n);
+    fclose(f);
+    while (!secret.empty() && isspace((unsigned char)secret.back())) secret.pop_back();
+    if (secret.empty()) return false;
+
+    // any secret goes, but it's only as good as its entropy
+    const uint8_t zero[16] = {0};
+    uint64_t k[2] = { siphash(zero,"0"+secret), siphash(zero,"1"+secret) };
+    for (int i = 0; i < 16; i++) key_bytes[i] = (k[i/8] >> ((i % 8) * 8)) & 0xFF;
+    key_given = true;
+    return true;
+}
+
+bool AriaMessage::setKeyFile(string fn)
+{
+    lock_guard<mutex> lk(key_mtx);
+    key_loaded = true;
+    key_given = false;
+    memset(key_bytes,0,sizeof(key_bytes));
+    return load_key(fn);
+}
+
+bool AriaMessage::hasKey()
+{
+    lock_guard<mutex> lk(key_mtx);
+    if (!key_loaded) {
+        key_loaded = true;
+        const char* env = getenv(ARIA_REMOTE_KEY_ENV);
+        if (env && *env && !load_key(env)) fprintf(stderr,"Unable to read the shared secret from %s\n",env);
+    }
+    return key_given;
+}
+
+uint64_t AriaMessage::Proof(char side, const string& host_nonce, const string& client_nonce)
+{
+    hasKey(); // make sure it's loaded; without a secret, the all-zeros key is used
+    lock_guard<mutex> lk(key_mtx);
+    return siphash(key_bytes,side + host_nonce + client_nonce);
+}
+
+string AriaMessage::Nonce()
+{
+    random_device rd;
+    string r;
+    while (r.size() < ARIA_REMOTE_NONCE) r += (char)(rd() & 0xFF);
+    return r;
+}
+
+void AriaMessage::putU32(uint32_t v)
+{
+    for (int i = 0; i < 4; i++) data += (char)((v >> (i * 8)) & 0xFF);
+}
+
+void AriaMessage::putU64(uint64_t v)
+{
+    putU32(v & 0xFFFFFFFF);
+    putU32(v >> 32);
+}
+
+void AriaMessage::putF64(double v)
+{
+    uint64_t u;
+    memcpy(&u,&v,sizeof(u));
+    putU64(u);
+}
+
+void AriaMessage::putStr(const string& s)
+{
+    putU32(s.size());
+    data += s;
+}
+
+void AriaMessage::putPin(const AriaPinData& d)
+{
+    if (!d.buf) {
+        putU8(0);
+        putStr(d.str);
+        return;
+    }
+
+    putU8(d.buf->type + 1);
+    switch (d.buf->type) {
+    case ARIA_BUF_BYTES:
+        putStr(d.buf->bytes);
+        break;
+    case ARIA_BUF_FLOATS:
+        putU32(d.buf->floats.size());
+        for (float f : d.buf->floats) {
+            uint32_t u;
+            memcpy(&u,&f,sizeof(u));
+            putU32(u);
+        }
+        break;
+    case ARIA_BUF_TOKENS:
+        putU32(d.buf->tokens.size());
+        for (llama_token t : d.buf->tokens) putU32(t);
+        break;
+    default:
+        break;
+    }
+}
+
+bool AriaMessage::take(void* dst, size_t n)
+{
+    if (bad || pos + n > data.size()) {
+        bad = true;
+        return false;
+    }
+    memcpy(dst,data.data()+pos,n);
+    pos += n;
+    return true;
+}
+
+uint8_t AriaMessage::getU8()
+{
+    uint8_t v = 0;
+    take(&v,1);
+    return v;
+}
+
+uint32_t AriaMessage::getU32()
+{
+    uint8_t b[4] = {0};
+    take(b,4);
+    return (uint32_t)b[0] | ((uint32_t)b[1] << 8) | ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+uint64_t AriaMessage::getU64()
+{
+    uint64_t u = getU32();
+    u |= (uint64_t)getU32() << 32;
+    return u;
+}
+
+double AriaMessage::getF64()
+{
+    uint64_t u = getU64();
+    double v;
+    memcpy(&v,&u,sizeof(v));
+    return v;
+}
+
+string AriaMessage::getStr()
+{
+    uint32_t n = getU32();
+    if (bad || pos + n > data.size()) {
+        bad = true;
+        return "";
+    }
+    string s = data.substr(pos,n);
+    pos += n;
+    return s;
+}
+
+AriaPinData AriaMessage::getPin()
+{
+    AriaPinData d;
+    uint8_t t = getU8();
+    if (!t) {
+        d.str = getStr();
+        return d;
+    }
+
+    auto buf = make_shared<AriaBuffer>();
+    buf->type = (AriaBufferType)(t - 1);
+    switch (buf->type) {
+    case ARIA_BUF_BYTES:
+        buf->bytes = getStr();
+        break;
+    case ARIA_BUF_FLOATS:
+        {
+            uint32_t n = getU32();
+            if (bad || n > (data.size() - pos) / 4) break;
+            buf->floats.resize(n);
+            for (auto &f : buf->floats) {
+                uint32_t u = getU32();
+                memcpy(&f,&u,sizeof(f));
+            }
+        }
+        break;
+    case ARIA_BUF_TOKENS:
+        {
+            uint32_t n = getU32();
+            if (bad || n > (data.size() - pos) / 4) break;
+            buf->tokens.resize(n);
+            for (auto &i : buf->tokens) i = (llama_token)getU32();
+        }
+        break;
+    default:
+        bad = true;
+    }
+    if (!bad) d.buf = buf;
+    return d;
+}
+
+bool AriaMessage::Send(int fd, const AriaMessage& msg)
+{
+    if (msg.data.size() >= ARIA_REMOTE_MAX_MSG) return false;
+    AriaMessage hdr;
+    hdr.putU32(msg.data.size() + 1);
+    hdr.putU8(msg.type);
+    hdr.data += msg.data;
+    return write_all(fd,hdr.data.data(),hdr.data.size());
+}
+
+bool AriaMessage::Receive(int fd, AriaMessage& msg, uint32_t maxlen)
+{
+    uint8_t b[4];
+    if (!read_all(fd,(char*)b,4)) return false;
+    uint32_t len = (uint32_t)b[0] | ((uint32_t)b[1] << 8) | ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+    if (!len || len > maxlen) return false;
+
+    msg.data.resize(len);
+    if (!read_all(fd,&msg.data[0],len)) return false;
+    msg.type = msg.data[0];
+    msg.data.erase(0,1);
+    msg.pos = 0;
+    msg.bad = false;
+    return true;
+}
+
+AriaMessage AriaMessage::Chunk(uint8_t type, const string& data, size_t pos)
+{
+    AriaMessage msg(type);
+    msg.putU8(pos + ARIA_REMOTE_CHUNK >= data.size());
+    msg.putStr(data.substr(pos,ARIA_REMOTE_CHUNK));
+    return msg;
+}
+
+AriaRemote::AriaRemote(string host, string scriptfile, string remotefile, string name, int budget) : Aria()
+{
+    hostname = host;
+    scriptfn = scriptfile;
+    remotefn = remotefile;
+    mname = name;
+    this->budget = budget;
+    Reload();
+}
+
+AriaRemote::~AriaRemote()
+{
+    Disconnect();
+}
+
+bool AriaRemote::Connect()
+{
+    auto pos = hostname.rfind(':');
+    if (pos == string::npos || pos == 0) {
+        Fail(AnnaBrain::myformat("Wrong remote host address '%s', must be host:port",hostname.c_str()));
+        return false;
+    }
+    string addr = hostname.substr(0,pos);
+    string port = hostname.substr(pos+1);
+
+    addrinfo hints, *res = nullptr;
+    memset(&hints,0,sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int r = getaddrinfo(addr.c_str(),port.c_str(),&hints,&res);
+    if (r) {
+        Fail(AnnaBrain::myformat("Unable to resolve %s: %s",hostname.c_str(),gai_strerror(r)));
+        return false;
+    }
+
+    for (addrinfo* i = res; i; i = i->ai_next) {
+        sock = socket(i->ai_family,i->ai_socktype,i->ai_protocol);
+        if (sock < 0) continue;
+        if (!connect(sock,i->ai_addr,i->ai_addrlen)) break;
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(res);
+    if (sock < 0) {
+        Fail(AnnaBrain::myformat("Unable to connect to %s: %s",hostname.c_str(),strerror(errno)));
+        return false;
+    }
+
+    // the messages are small and latency matters more than throughput
+    int one = 1;
+    setsockopt(sock,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+    if (!Authenticate()) {
+        close(sock);
+        sock = -1;
+        return false;
+    }
+
+    lost = false;
+    done = false;
+    replies.clear();
+    reader = thread([this] { ReaderLoop(); });
+    DBG("Connected to %s\n",hostname.c_str());
+    return true;
+}
+
+bool AriaRemote::Authenticate()
+{
+    set_timeout(sock,ARIA_REMOTE_TIMEOUT_MS);
+    AriaMessage hello, auth(ARM_AUTH), rep;
+    if (!AriaMessage::Receive(sock,hello,ARIA_REMOTE_MAX_AUTH)) {
+        Fail(AnnaBrain::myformat("No greeting from %s",hostname.c_str()));
+        return false;
+    }
+    uint32_t ver = hello.getU32();
+    string hnonce = hello.getStr();
+    if (hello.type != ARM_HELLO || hello.bad || ver != ARIA_REMOTE_VERSION || hnonce.size() != ARIA_REMOTE_NONCE) {
+        Fail(AnnaBrain::myformat("Protocol version mismatch with %s: %u (%d expected)",hostname.c_str(),ver,ARIA_REMOTE_VERSION));
+        return false;
+    }
+
+    string cnonce = AriaMessage::Nonce();
+    auth.putStr(cnonce);
+    auth.putU64(AriaMessage::Proof('C',hnonce,cnonce));
+    if (!AriaMessage::Send(sock,auth) || !AriaMessage::Receive(sock,rep,ARIA_REMOTE_MAX_AUTH)) {
+        Fail(AnnaBrain::myformat("Unable to authenticate at %s",hostname.c_str()));
+        return false;
+    }
+    if (rep.type == ARM_FAIL) {
+        Fail(AnnaBrain::myformat("%s: %s",hostname.c_str(),rep.getStr().c_str()));
+        return false;
+    }
+    uint64_t proof = rep.getU64();
+    if (rep.type != ARM_OK || rep.bad || proof != AriaMessage::Proof('H',hnonce,cnonce)) {
+        Fail(AnnaBrain::myformat("%s doesn't know the shared secret",hostname.c_str()));
+        return false;
+    }
+
+    set_timeout(sock,0);
+    return true;
+}
+
+void AriaRemote::Disconnect()
+{
+    if (sock >= 0) shutdown(sock,SHUT_RDWR);
+    if (reader.joinable()) reader.join();
+    if (sock >= 0) close(sock);
+    sock = -1;
+}
+
+void AriaRemote::ReaderLoop()
+{
+    for (;;) {
+        AriaMessage msg;
+        if (!AriaMessage::Receive(sock,msg)) break;
+
+        bool fin = (msg.type == ARM_DONE);
+        {
+            lock_guard<mutex> lk(rmtx);
+            if (fin) {
+                done_msg = std::move(msg);
+                done = true;
+            } else
+                replies.push_back(std::move(msg));
+        }
+        rcv.notify_all();
+        if (fin && notify) notify();
+    }
+
+    DBG("Connection to %s closed\n",hostname.c_str());
+    {
+        lock_guard<mutex> lk(rmtx);
+        lost = true;
+    }
+    rcv.notify_all();
+    if (notify) notify();
+}
+
+void AriaRemote::Fail(string err)
+{
+    merror = err;
+    state = ARIA_ERROR;
+}
+
+bool AriaRemote::Send(const AriaMessage& msg)
+{
+    if (sock < 0 || !AriaMessage::Send(sock,msg)) {
+        Fail(AnnaBrain::myformat("Unable to send data to %s",hostname.c_str()));
+        return false;
+    }
+    return true;
+}
+
+bool AriaRemote::Request(const AriaMessage& msg, AriaMessage& reply, int timeout_ms)
+{
+    return Send(msg) && Wait(reply,timeout_ms);
+}
+
+bool AriaRemote::Wait(AriaMessage& reply, int timeout_ms)
+{
+    unique_lock<mutex> lk(rmtx);
+    auto ready = [this] { return !replies.empty() || lost; };
+    if (timeout_ms > 0) {
+        if (!rcv.wait_for(lk,chrono::milliseconds(timeout_ms),ready)) {
+            Fail(AnnaBrain::myformat("Timeout waiting for %s",hostname.c_str()));
+            return false;
+        }
+    } else
+        rcv.wait(lk,ready);
+
+    if (replies.empty()) {
+        Fail(AnnaBrain::myformat("Connection to %s lost",hostname.c_str()));
+        return false;
+    }
+    reply = std::move(replies.front());
+    replies.pop_front();
+    return true;
+}
+
+bool AriaRemote::Reload()
+{
+    Disconnect();
+    pins = pouts = 0;
+    name_ins.clear();
+    name_outs.clear();
+    state = ARIA_NOT_INITIALIZED;
+    if (!Connect()) return false;
+
+    AriaMessage msg(ARM_OPEN), rep;
+    msg.putU32(ARIA_REMOTE_VERSION);
+    msg.putStr(mname);
+    msg.putStr(remotefn);
+    msg.putU32(budget);
+    // the remote pod might need to load a model, so there's no timeout here
+    if (!Request(msg,rep,0)) return false;
+
+    if (rep.type == ARM_FAIL) {
+        Fail(AnnaBrain::myformat("%s: %s",hostname.c_str(),rep.getStr().c_str()));
+        return false;
+    }
+    pins = rep.getU32();
+    pouts = rep.getU32();
+    for (uint32_t i = 0, n = rep.getU32(); i < n && !rep.bad; i++) name_ins.push_back(rep.getStr());
+    for (uint32_t i = 0, n = rep.getU32(); i < n && !rep.bad; i++) name_outs.push_back(rep.getStr());
+    if (rep.type != ARM_OK || rep.bad) {
+        Fail(AnnaBrain::myformat("Wrong reply from %s",hostname.c_str()));
+        return false;
+    }
+
+    {
+        lock_guard<mutex> lk(out_mtx);
+        last_outputs.assign(pouts,"");
+    }
+    state = ARIA_READY;
+    return true;
+}
+
+bool AriaRemote::setGlobalInput(string in)
+{
+    AriaMessage msg(ARM_INPUT);
+    msg.putStr(in);
+    input = in;
+    return Send(msg);
+}
+
+bool AriaRemote::setUserImage(string fn)
+{
+    AriaMessage msg(ARM_IMAGE);
+    msg.putStr(fn);
+    usrimage = fn;
+    return Send(msg);
+}
+
+void AriaRemote::setName(string name)
+{
+    if (name.empty()) return;
+    AriaMessage msg(ARM_NAME);
+    msg.putStr(name);
+    mname = name;
+    Send(msg);
+}
+
+void AriaRemote::setInPin(int pin, string str)
+{
+    AriaPinData d;
+    d.str = str;
+    setInPin(pin,d);
+}
+
+void AriaRemote::setInPin(int pin, const AriaPinData& data)
+{
+    if (pin < 0 || pin >= pins) return;
+    AriaMessage msg(ARM_INPIN);
+    msg.putU32(pin);
+    msg.putPin(data);
+    Send(msg);
+}
+
+AriaPinData AriaRemote::getOutPinData(int pin)
+{
+    AriaPinData out;
+    if (pin < 0 || pin >= pouts || state == ARIA_ERROR) return out;
+
+    AriaMessage msg(ARM_OUTPIN), rep;
+    msg.putU32(pin);
+    if (!Request(msg,rep,ARIA_REMOTE_TIMEOUT_MS)) return out;
+    out = rep.getPin();
+    if (rep.type != ARM_PINDATA || rep.bad) {
+        Fail(AnnaBrain::myformat("Wrong reply from %s",hostname.c_str()));
+        return AriaPinData();
+    }
+
+    lock_guard<mutex> lk(out_mtx);
+    if (out.buf) last_outputs[pin] = out.buf->describe();
+    else if (!out.str.empty()) last_outputs[pin] = out.str;
+    return out;
+}
+
+AriaState AriaRemote::Processing()
+{
+    switch (state) {
+    case ARIA_READY:
+        {
+            lock_guard<mutex> lk(rmtx);
+            done = false;
+        }
+        if (Send(AriaMessage(ARM_PROCESS))) state = ARIA_RUNNING;
+        break;
+
+    case ARIA_RUNNING:
+        {
+            lock_guard<mutex> lk(rmtx);
+            if (done) {
+                done = false;
+                bool ok = done_msg.getU8();
+                string err = done_msg.getStr();
+                output += done_msg.getStr();
+                runs = done_msg.getU32();
+                busy = done_msg.getF64();
+                if (done_msg.bad) Fail(AnnaBrain::myformat("Wrong reply from %s",hostname.c_str()));
+                else if (!ok) Fail(err);
+                else state = ARIA_READY;
+
+            } else if (lost)
+                Fail(AnnaBrain::myformat("Connection to %s lost",hostname.c_str()));
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    return state;
+}
+
+void AriaRemote::setCoreBudget(int n)
+{
+    budget = n;
+    AriaMessage msg(ARM_BUDGET);
+    msg.putU32(n);
+    Send(msg);
+}
+
+int AriaRemote::getRuns()
+{
+    lock_guard<mutex> lk(rmtx);
+    return runs;
+}
+
+double AriaRemote::getBusyTime()
+{
+    lock_guard<mutex> lk(rmtx);
+    return busy;
+}
+
+bool AriaRemote::SaveSnapshot(string& out)
+{
+    if (state != ARIA_READY) {
+        merror = "Pod must be idle to make a snapshot";
+        return false;
+    }
+
+    AriaMessage rep;
+    if (!Request(AriaMessage(ARM_SAVE),rep,0)) return false;
+    out.clear();
+    for (;;) {
+        if (rep.type == ARM_FAIL) {
+            merror = rep.getStr();
+            return false;
+        }
+        bool last = rep.getU8();
+        out += rep.getStr();
+        if (rep.type != ARM_SNAPSHOT || rep.bad) return false;
+        if (last) return true;
+        if (!Wait(rep,ARIA_REMOTE_TIMEOUT_MS)) return false;
+    }
+}
+
+bool AriaRemote::LoadSnapshot(const string& in)
+{
+    if (state != ARIA_READY) {
+        merror = "Pod must be idle to load a snapshot";
+        return false;
+    }
+
+    // the pod answers after the last chunk only
+    size_t pos = 0;
+    for (; pos + ARIA_REMOTE_CHUNK < in.size(); pos += ARIA_REMOTE_CHUNK)
+        if (!Send(AriaMessage::Chunk(ARM_LOAD,in,pos))) return false;
+    AriaMessage rep;
+    if (!Request(AriaMessage::Chunk(ARM_LOAD,in,pos),rep,0)) return false;
+    if (rep.type == ARM_FAIL) merror = rep.getStr();
+    return (rep.type == ARM_OK);
+}
+
+AriaHost::~AriaHost()
+{
+    Reap(true);
+    if (lsock >= 0) close(lsock);
+}
+
+static bool is_loopback(const sockaddr* sa)
+{
+    if (sa->sa_family == AF_INET) return (ntohl(((const sockaddr_in*)sa)->sin_addr.s_addr) >> 24) == 127;
+    if (sa->sa_family == AF_INET6) return IN6_IS_ADDR_LOOPBACK(&((const sockaddr_in6*)sa)->sin6_addr);
+    return false;
+}
+
+bool AriaHost::Listen(int port, string addr)
+{
+    if (addr.empty()) addr = "127.0.0.1";
+    string sport = to_string(port);
+    addrinfo hints, *res = nullptr;
+    memset(&hints,0,sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    int r = getaddrinfo(addr.c_str(),sport.c_str(),&hints,&res);
+    if (r) {
+        merror = AnnaBrain::myformat("Unable to resolve %s: %s",addr.c_str(),gai_strerror(r));
+        return false;
+    }
+
+    // anyone who can connect can run our scripts, so only the local clients are trusted without the secret
+    if (!is_loopback(res->ai_addr) && !AriaMessage::hasKey()) {
+        merror = AnnaBrain::myformat("Refusing to serve on %s without a shared secret",addr.c_str());
+        freeaddrinfo(res);
+        return false;
+    }
+
+    lsock = socket(res->ai_family,res->ai_socktype,res->ai_protocol);
+    if (lsock < 0) {
+        merror = AnnaBrain::myformat("Unable to create socket: %s",strerror(errno));
+        freeaddrinfo(res);
+        return false;
+    }
+
+    int one = 1;
+    setsockopt(lsock,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+
+    if (bind(lsock,res->ai_addr,res->ai_addrlen) || listen(lsock,16)) {
+        merror = AnnaBrain::myformat("Unable to listen on %s:%d: %s",addr.c_str(),port,strerror(errno));
+        close(lsock);
+        lsock = -1;
+    }
+    freeaddrinfo(res);
+    return lsock >= 0;
+}
+
+void AriaHost::Poll(int timeout_ms)
+{
+    Reap(false);
+    if (lsock < 0) return;
+
+    pollfd pfd = {lsock,POLLIN,0};
+    if (poll(&pfd,1,timeout_ms) <= 0 || !(pfd.revents & POLLIN)) return;
+
+    int fd = accept(lsock,nullptr,nullptr);
+    if (fd < 0) return;
+    int one = 1;
+    setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+
+    conn* c = new conn;
+    c->fd = fd;
+    if (pipe(c->wake)) {
+        merror = AnnaBrain::myformat("Unable to create pipe: %s",strerror(errno));
+        close(fd);
+        delete c;
+        return;
+    }
+    for (int i : c->wake) fcntl(i,F_SETFL,fcntl(i,F_GETFL) | O_NONBLOCK);
+
+    lock_guard<mutex> lk(mtx);
+    conns.push_back(c);
+    c->thr = thread([this,c] { Serve(c); });
+    DBG("New client, %zu connections\n",conns.size());
+}
+
+int AriaHost::getNumClients()
+{
+    lock_guard<mutex> lk(mtx);
+    int n = 0;
+    for (auto i : conns) n += !i->finished;
+    return n;
+}
+
+void AriaHost::Reap(bool all)
+{
+    list<conn*> dead;
+    {
+        lock_guard<mutex> lk(mtx);
+        for (auto it = conns.begin(); it != conns.end();) {
+            if (all && !(*it)->finished) shutdown((*it)->fd,SHUT_RDWR);
+            if (all || (*it)->finished) {
+                dead.push_back(*it);
+                it = conns.erase(it);
+            } else
+                ++it;
+        }
+    }
+    for (auto i : dead) {
+        if (i->thr.joinable()) i->thr.join();
+        delete i;
+    }
+}
+
+static bool send_done(int fd, Aria* pod, AriaState st)
+{
+    AriaMessage msg(ARM_DONE);
+    msg.putU8(st == ARIA_READY);
+    msg.putStr(pod? pod->getError() : "Pod is not opened");
+    msg.putStr(pod? pod->getGlobalOutput() : "");
+    msg.putU32(pod? pod->getRuns() : 0);
+    msg.putF64(pod? pod->getBusyTime() : 0);
+    return AriaMessage::Send(fd,msg);
+}
+
+bool AriaHost::Greet(int fd)
+{
+    // the client has limited time and space to prove it knows the secret, before we accept anything else
+    set_timeout(fd,ARIA_REMOTE_TIMEOUT_MS);
+    string hnonce = AriaMessage::Nonce();
+    AriaMessage hello(ARM_HELLO), auth, rep(ARM_FAIL);
+    hello.putU32(ARIA_REMOTE_VERSION);
+    hello.putStr(hnonce);
+    if (!AriaMessage::Send(fd,hello) || !AriaMessage::Receive(fd,auth,ARIA_REMOTE_MAX_AUTH)) return false;
+
+    string cnonce = auth.getStr();
+    uint64_t proof = auth.getU64();
+    if (auth.type != ARM_AUTH || auth.bad || cnonce.size() != ARIA_REMOTE_NONCE || proof != AriaMessage::Proof('C',hnonce,cnonce)) {
+        DBG("Client failed to authenticate\n");
+        rep.putStr("Authentication failed");
+        AriaMessage::Send(fd,rep);
+        return false;
+    }
+
+    rep.type = ARM_OK;
+    rep.putU64(AriaMessage::Proof('H',hnonce,cnonce));
+    set_timeout(fd,0);
+    return AriaMessage::Send(fd,rep);
+}
+
+string AriaHost::ScriptPath(const string& fn)
+{
+    // no absolute paths and no way out of the scripts directory
+    if (fn.empty() || fn[0] == '/' || fn[0] == '\\' || fn.find(':') != string::npos) return "";
+    for (size_t p = 0;;) {
+        size_t e = fn.find_first_of("/\\",p);
+        if (fn.compare(p,e-p,"..") == 0) return "";
+        if (e == string::npos) break;
+        p = e + 1;
+    }
+    return scriptdir + ARIA_PATH_DELIM + fn;
+}
+
+void AriaHost::Serve(conn* c)
+{
+    Aria* pod = nullptr;
+    bool running = false;
+    bool authed = Greet(c->fd);
+    string snapshot;
+    pollfd fds[2] = {{c->fd,POLLIN,0},{c->wake[0],POLLIN,0}};
+
+    while (authed) {
+        if (poll(fds,2,-1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        // the pod's notification can't do anything by itself, because it's called with the pod's worker lock held
+        if (fds[1].revents & POLLIN) {
+            char tmp[64];
+            while (read(c->wake[0],tmp,sizeof(tmp)) > 0) ;
+            if (running) {
+                AriaState st = pod->Processing();
+                if (st != ARIA_RUNNING) {
+                    running = false;
+                    if (!send_done(c->fd,pod,st)) break;
+                }
+            }
+        }
+        if (!(fds[0].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+        AriaMessage msg;
+        if (!AriaMessage::Receive(c->fd,msg)) break;
+
+        switch (msg.type) {
+        case ARM_OPEN:
+            {
+                uint32_t ver = msg.getU32();
+                string name = msg.getStr();
+                string fn = msg.getStr();
+                int n = msg.getU32();
+                AriaMessage rep(ARM_FAIL);
+                if (ver != ARIA_REMOTE_VERSION || msg.bad) {
+                    rep.putStr(AnnaBrain::myformat("Protocol version mismatch: %u (%d expected)",ver,ARIA_REMOTE_VERSION));
+                    AriaMessage::Send(c->fd,rep);
+                    break;
+                }
+
+                string path = ScriptPath(fn);
+                if (path.empty()) {
+                    rep.putStr(AnnaBrain::myformat("Script '%s' is not in the worker's scripts directory",fn.c_str()));
+                    AriaMessage::Send(c->fd,rep);
+                    break;
+                }
+
+                if (pod) delete pod;
+                running = false;
+                DBG("Opening pod %s (%s)\n",name.c_str(),path.c_str());
+                pod = new Aria(path,name);
+                if (pod->getState() != ARIA_READY) {
+                    rep.putStr(pod->getError());
+                    delete pod;
+                    pod = nullptr;
+                    AriaMessage::Send(c->fd,rep);
+                    break;
+                }
+
+                int wfd = c->wake[1];
+                pod->setNotify([wfd] { char b = 1; ssize_t r = write(wfd,&b,1); (void)r; });
+                pod->setCoreBudget(n);
+
+                rep.type = ARM_OK;
+                rep.putU32(pod->getNumInPins());
+                rep.putU32(pod->getNumOutPins());
+                for (int j = 0; j < 2; j++) {
+                    int cnt = 0;
+                    while (!pod->getPinName(!j,cnt).empty()) cnt++;
+                    rep.putU32(cnt);
+                    for (int i = 0; i < cnt; i++) rep.putStr(pod->getPinName(!j,i));
+                }
+                if (!AriaMessage::Send(c->fd,rep)) goto out;
+            }
+            break;
+
+        case ARM_OUTPIN:
+            {
+                AriaMessage rep(ARM_PINDATA);
+                int pin = msg.getU32();
+                rep.putPin((pod && !running)? pod->getOutPinData(pin) : AriaPinData());
+                if (!AriaMessage::Send(c->fd,rep)) goto out;
+            }
+            break;
+
+        case ARM_PROCESS:
+            {
+                AriaState st = (pod && !running)? pod->Processing() : ARIA_ERROR;
+                if (st == ARIA_RUNNING) running = true;
+                else if (!send_done(c->fd,pod,st)) goto out;
+            }
+            break;
+
+        case ARM_SAVE:
+            {
+                AriaMessage rep(ARM_FAIL);
+                string data;
+                if (!pod || running)
+                    rep.putStr("Pod must be idle");
+                else if (pod->SaveSnapshot(data)) {
+                    for (size_t pos = 0;; pos += ARIA_REMOTE_CHUNK) {
+                        rep = AriaMessage::Chunk(ARM_SNAPSHOT,data,pos);
+                        if (pos + ARIA_REMOTE_CHUNK >= data.size()) break;
+                        if (!AriaMessage::Send(c->fd,rep)) goto out;
+                    }
+                } else
+                    rep.putStr(pod->getError());
+                if (!AriaMessage::Send(c->fd,rep)) goto out;
+            }
+            break;
+
+        case ARM_LOAD:
+            {
+                bool last = msg.getU8();
+                snapshot += msg.getStr();
+                if (msg.bad) goto out;
+                if (!last) break;
+
+                AriaMessage rep(ARM_FAIL);
+                if (!pod || running)
+                    rep.putStr("Pod must be idle");
+                else if (pod->LoadSnapshot(snapshot))
+                    rep.type = ARM_OK;
+                else
+                    rep.putStr(pod->getError());
+                snapshot.clear();
+                if (!AriaMessage::Send(c->fd,rep)) goto out;
+            }
+            break;
+
+        default:
+            // the rest of the requests are applicable to an idle pod only
+            if (!pod || running) break;
+            switch (msg.type) {
+            case ARM_INPUT: pod->setGlobalInput(msg.getStr()); break;
+            case ARM_IMAGE: pod->setUserImage(msg.getStr()); break;
+            case ARM_NAME: pod->setName(msg.getStr()); break;
+            case ARM_BUDGET: pod->setCoreBudget(msg.getU32()); break;
+            case ARM_INPIN:
+                {
+                    int pin = msg.getU32();
+                    AriaPinData d = msg.getPin();
+                    if (!msg.bad) pod->setInPin(pin,d);
+                }
+                break;
+            default:
+                DBG("Unknown message type %d\n",msg.type);
+            }
+        }
+    }
+
+out:
+    DBG("Client disconnected\n");
+    if (pod) delete pod;
+
+    lock_guard<mutex> lk(mtx);
+    close(c->fd);
+    close(c->wake[0]);
+    close(c->wake[1]);
+    c->finished = true;
+}
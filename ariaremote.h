@@ -0,0 +1,182 @@
+/* ANNA - Automatic Neural Network Assistant
+ * Remote Aria pods: running LSCS pods in other processes or on other hosts
+ * (C) Dmitry 'MatrixS_Master' Solovyev, 2023-2025
+ * */
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <list>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "aria.h"
+
+#define ARIA_REMOTE_VERSION 3
+#define ARIA_REMOTE_MAX_MSG (16U * 1024U * 1024U)
+#define ARIA_REMOTE_MAX_AUTH 64             // limit for the messages before the peer is authenticated
+#define ARIA_REMOTE_CHUNK (4U * 1024U * 1024U) // snapshots are sent in chunks of this size
+#define ARIA_REMOTE_NONCE 16
+#define ARIA_REMOTE_TIMEOUT_MS 30000
+#define ARIA_REMOTE_KEY_ENV "ANNA_ARIA_KEY" // shared secret file, if not set explicitly
+
+/*
+ * Wire format: every message is a little-endian uint32 length (of everything that follows),
+ * a message type byte, and the payload. Integers are little-endian, strings are length-prefixed,
+ * pin data is a type byte (0 = string, otherwise AriaBufferType + 1) followed by the elements.
+ * Only OPEN, OUTPIN, SAVE and LOAD requests are answered, everything else is one-way. DONE is sent by the host
+ * when processing() is finished, and the client doesn't send anything while the pod is running.
+ * The host starts with HELLO, and nothing else is accepted until the client proves it knows the shared secret
+ * with AUTH; the host then proves the same in its OK. The proofs are SipHash-2-4 of both nonces, keyed by the secret.
+ * Snapshots are split into chunks, each one starting with the "last chunk" flag.
+ * */
+enum AriaRemoteMsg {
+    ARM_OPEN = 1,           // version, name, script path, core budget -> OK (pin counts and names) or FAIL
+    ARM_INPUT,              // global input
+    ARM_IMAGE,              // user image file
+    ARM_NAME,               // new pod name
+    ARM_INPIN,              // pin number, pin data
+    ARM_OUTPIN,             // pin number -> PINDATA
+    ARM_PROCESS,            // start processing() -> DONE
+    ARM_BUDGET,             // core budget
+    ARM_OK,
+    ARM_FAIL,               // error message
+    ARM_PINDATA,
+    ARM_DONE,               // success flag, error message, global output, runs, busy time
+    ARM_SAVE,               // -> SNAPSHOT or FAIL
+    ARM_LOAD,               // snapshot data -> OK or FAIL
+    ARM_SNAPSHOT,           // snapshot data
+    ARM_HELLO,              // version, host nonce
+    ARM_AUTH,               // client nonce, client proof -> OK (host proof) or FAIL
+};
+
+// Message (de)serialization and peer authentication
+class AriaMessage
+{
+public:
+    uint8_t type = 0;
+    std::string data;
+    size_t pos = 0;
+    bool bad = false;
+
+    AriaMessage(uint8_t t = 0) : type(t) {}
+
+    void putU8(uint8_t v)               { data += (char)v; }
+    void putU32(uint32_t v);
+    void putU64(uint64_t v);
+    void putF64(double v);
+    void putStr(const std::string& s);
+    void putPin(const AriaPinData& d);
+
+    uint8_t getU8();
+    uint32_t getU32();
+    uint64_t getU64();
+    double getF64();
+    std::string getStr();
+    AriaPinData getPin();
+
+    static bool Send(int fd, const AriaMessage& msg);
+    static bool Receive(int fd, AriaMessage& msg, uint32_t maxlen = ARIA_REMOTE_MAX_MSG);
+    static AriaMessage Chunk(uint8_t type, const std::string& data, size_t pos);
+
+    // the shared secret is read from the file named by ARIA_REMOTE_KEY_ENV, unless it's set here
+    static bool setKeyFile(std::string fn);
+    static bool hasKey();
+    static uint64_t Proof(char side, const std::string& host_nonce, const std::string& client_nonce);
+    static std::string Nonce();
+
+private:
+    bool take(void* dst, size_t n);
+};
+
+// Client side: a pod which lives in a remote LISA worker (see AriaHost)
+class AriaRemote : public Aria
+{
+public:
+    // remotefile is the script's path relative to the worker's scripts directory
+    AriaRemote(std::string host, std::string scriptfile, std::string remotefile, std::string name, int budget = 0);
+    virtual ~AriaRemote();
+
+    bool Reload() override;
+
+    bool setGlobalInput(std::string in) override;
+    bool setUserImage(std::string fn) override;
+
+    void setName(std::string name) override;
+    void setInPin(int pin, std::string str) override;
+    void setInPin(int pin, const AriaPinData& data) override;
+    AriaPinData getOutPinData(int pin) override;
+
+    AriaState Processing() override;
+
+    void setCoreBudget(int n) override;
+    bool hasLocalBrain() override           { return false; } // doesn't take a share of our cores
+
+    int getRuns() override;
+    double getBusyTime() override;
+
+    bool SaveSnapshot(std::string& out) override;
+    bool LoadSnapshot(const std::string& in) override;
+
+    std::string getHost()           const   { return hostname; }
+
+private:
+    std::string hostname, remotefn;
+    int sock = -1;
+    std::thread reader;
+    std::mutex rmtx;
+    std::condition_variable rcv;
+    std::list<AriaMessage> replies;
+    bool lost = false;                      // connection is gone
+    bool done = false;                      // DONE has been received
+    AriaMessage done_msg;
+    int runs = 0;
+    double busy = 0;
+
+    bool Connect();
+    bool Authenticate();
+    void Disconnect();
+    void ReaderLoop();
+    bool Send(const AriaMessage& msg);
+    bool Request(const AriaMessage& msg, AriaMessage& reply, int timeout_ms); // timeout_ms = 0 waits forever
+    bool Wait(AriaMessage& reply, int timeout_ms);
+    void Fail(std::string err);
+};
+
+// Worker side: serves pods for AriaRemote clients, one pod per connection
+class AriaHost
+{
+public:
+    AriaHost() = default;
+    virtual ~AriaHost();
+
+    // binds to the loopback interface unless addr is given; other addresses require the shared secret
+    bool Listen(int port, std::string addr = "");
+    void setScriptDir(std::string dir)      { scriptdir = dir; }
+    // waits for new connections (up to timeout_ms) and starts serving them
+    void Poll(int timeout_ms);
+
+    std::string getError()          const   { return merror; }
+    int getNumClients();
+
+private:
+    struct conn {
+        int fd = -1;
+        int wake[2] = {-1,-1};              // the pod's completion notification pipe
+        std::thread thr;
+        bool finished = false;
+    };
+
+    int lsock = -1;
+    std::string merror;
+    std::string scriptdir = ".";
+    std::mutex mtx;
+    std::list<conn*> conns;
+
+    bool Greet(int fd);
+    std::string ScriptPath(const std::string& fn);
+    void Serve(conn* c);
+    void Reap(bool all);
+};
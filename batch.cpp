@@ -0,0 +1,257 @@
+/* ANNA - Automatic Neural Network Assistant
+ * Batch (offline) inference over multiple independent sequences
+ * (C) Dmitry 'MatrixS_Master' Solovyev, 2023-2025
+ * */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "batch.h"
+
+#ifndef NDEBUG
+#define DBG(...) do { fprintf(stderr,"[BATCH DBG] " __VA_ARGS__); fflush(stderr); } while (0)
+#else
+#define DBG(...)
+#endif
+
+using namespace std;
+
+AnnaBatch::AnnaBatch(AnnaConfig* cfg) : AnnaBrain(cfg)
+{
+    memset((void*)&batch,0,sizeof(batch));
+    if (state != ANNA_READY) return;
+
+    int n = config.params.n_parallel;
+    if (n < 1) n = 1;
+    slot_ctx = llama_n_ctx(ctx) / n;
+    if (slot_ctx < 2) {
+        internal_error = myformat("Context is too small for %d parallel sequences",n);
+        state = ANNA_ERROR;
+        return;
+    }
+
+    slots.resize(n);
+    for (int i = 0; i < n; i++) slots[i].seq = i;
+    batch = llama_batch_init(config.params.n_batch,0,1);
+    DBG("%d slots, %d tokens each\n",n,slot_ctx);
+}
+
+AnnaBatch::~AnnaBatch()
+{
+    for (auto &s : slots) {
+        if (s.sp) llama_sampling_free(s.sp);
+    }
+    llama_batch_free(batch);
+}
+
+double AnnaBatch::Now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
+}
+
+bool AnnaBatch::setSharedPrompt(string str)
+{
+    if (state != ANNA_READY || n_active) return false;
+
+    // the shared prompt lives in its own sequence, which is never used for generation
+    const llama_seq_id sseq = slots.size();
+    llama_kv_cache_seq_rm(ctx,sseq,-1,-1);
+    shared.clear();
+    slot_ctx = llama_n_ctx(ctx) / slots.size();
+    if (str.empty()) return true;
+
+    shared = ::llama_tokenize(ctx,str,true);
+    int n_own = ((int)llama_n_ctx(ctx) - (int)shared.size()) / (int)slots.size();
+    if (n_own < 2) {
+        internal_error = myformat("Shared prompt is too long: %zu tokens",shared.size());
+        shared.clear();
+        return false;
+    }
+
+    for (int i = 0; i < (int)shared.size(); i += config.params.n_batch) {
+        llama_batch_clear(batch);
+        for (int j = i; j < (int)shared.size() && j < i + config.params.n_batch; j++)
+            llama_batch_add(batch,shared[j],j,{ sseq },false);
+
+        int r = llama_decode(ctx,batch);
+        if (r) {
+            internal_error = myformat("Failed to evaluate the shared prompt - error %d",r);
+            llama_kv_cache_seq_rm(ctx,sseq,-1,-1);
+            shared.clear();
+            return false;
+        }
+    }
+
+    // shared cells don't count against the slots' own share of the context
+    slot_ctx = (int)shared.size() + n_own;
+    n_total += shared.size();
+    DBG("Shared prompt: %zu tokens, %d tokens per slot\n",shared.size(),slot_ctx);
+    return true;
+}
+
+void AnnaBatch::addJob(const AnnaBatchJob& job)
+{
+    jobs.push_back(job);
+    job_times.push_back(Now());
+    if (state == ANNA_READY) state = ANNA_PROCESSING;
+}
+
+bool AnnaBatch::getResult(AnnaBatchResult& res)
+{
+    if (results.empty()) return false;
+    res = std::move(results.front());
+    results.pop_front();
+    return true;
+}
+
+void AnnaBatch::StartJob(slot_rec& s)
+{
+    s.job = std::move(jobs.front());
+    jobs.pop_front();
+    s.res = AnnaBatchResult();
+    s.res.index = s.job.index;
+    s.t_start = Now();
+    s.t_first = 0;
+    s.res.t_wait = s.t_start - job_times.front();
+    job_times.pop_front();
+    s.active = true;
+    n_active++;
+
+    // the sampling context is created from the config, so let's temporarily replace its sampling params
+    llama_sampling_params old = config.params.sparams;
+    config.params.sparams = s.job.sparams;
+    s.sp = llama_sampling_init(config.params);
+    config.params.sparams = old;
+
+    s.inp = shared.empty()? ::llama_tokenize(ctx,s.job.prompt,true) : ::llama_tokenize(ctx,s.job.prompt,false,true);
+    s.n_consumed = 0;
+    s.n_past = shared.size();
+    s.i_batch = -1;
+    s.res.n_prompt = s.inp.size();
+
+    int n_predict = (s.job.n_predict > 0)? s.job.n_predict : config.params.n_predict;
+    s.n_limit = slot_ctx;
+    if (n_predict > 0 && s.n_past + (int)s.inp.size() + n_predict < s.n_limit)
+        s.n_limit = s.n_past + s.inp.size() + n_predict;
+
+    if (!s.sp) FinishJob(s,"Unable to create sampling context");
+    else if (s.inp.empty()) FinishJob(s,"Empty prompt");
+    else if (s.n_past + (int)s.inp.size() >= slot_ctx)
+        FinishJob(s,myformat("Prompt is too long: %d tokens for a %d tokens slot",s.n_past + (int)s.inp.size(),slot_ctx));
+    else if (!shared.empty()) {
+        llama_kv_cache_seq_cp(ctx,slots.size(),s.seq,-1,-1);
+        for (auto &i : shared) llama_sampling_accept(s.sp,ctx,i,false);
+    }
+}
+
+void AnnaBatch::FinishJob(slot_rec& s, string err)
+{
+    double now = Now();
+    if (s.t_first > 0) {
+        s.res.t_prompt = s.t_first - s.t_start;
+        s.res.t_gen = now - s.t_first;
+    } else
+        s.res.t_prompt = now - s.t_start;
+
+    s.res.ok = err.empty();
+    s.res.error = err;
+    results.push_back(std::move(s.res));
+
+    llama_kv_cache_seq_rm(ctx,s.seq,-1,-1);
+    if (s.sp) llama_sampling_free(s.sp);
+    s.sp = nullptr;
+    s.inp.clear();
+    s.active = false;
+    n_active--;
+}
+
+AnnaState AnnaBatch::Processing(bool)
+{
+    if (state != ANNA_READY && state != ANNA_PROCESSING) return state;
+
+    for (auto &s : slots) {
+        if (!s.active && !jobs.empty()) StartJob(s);
+    }
+    if (!n_active) {
+        state = jobs.empty()? ANNA_READY : ANNA_PROCESSING;
+        return state;
+    }
+
+    // make up the batch: generating slots go first, so long prompts won't stall them
+    llama_batch_clear(batch);
+    for (int pass = 0; pass < 2; pass++) {
+        for (auto &s : slots) {
+            if (!s.active || s.n_consumed >= (int)s.inp.size()) continue;
+            if ((s.inp.size() - s.n_consumed == 1) != (pass == 0)) continue;
+
+            while (s.n_consumed < (int)s.inp.size() && batch.n_tokens < config.params.n_batch) {
+                llama_token tok = s.inp[s.n_consumed++];
+                bool last = (s.n_consumed == (int)s.inp.size());
+                if (s.t_first == 0) llama_sampling_accept(s.sp,ctx,tok,false); // prompt tokens
+                if (last) s.i_batch = batch.n_tokens;
+                llama_batch_add(batch,tok,s.n_past++,{ s.seq },last);
+            }
+        }
+    }
+
+    // the KV cache might be fragmented, so it's better to be ready to split the batch into smaller pieces
+    int n_chunk = batch.n_tokens;
+    for (int i = 0; i < batch.n_tokens; i += n_chunk) {
+        int n = min(n_chunk,batch.n_tokens - i);
+        llama_batch view = {
+            n,
+            batch.token + i,
+            nullptr,
+            batch.pos + i,
+            batch.n_seq_id + i,
+            batch.seq_id + i,
+            batch.logits + i,
+            0, 0, 0,
+        };
+
+        int r = llama_decode(ctx,view);
+        if (r == 1 && n_chunk > 1) {
+            n_chunk /= 2;
+            i -= n_chunk; // the loop will advance it back
+            DBG("KV cache slot not found, retrying with %d tokens\n",n_chunk);
+            continue;
+        }
+        if (r) {
+            internal_error = myformat("Failed to decode the batch - error %d",r);
+            for (auto &s : slots) {
+                if (s.active) FinishJob(s,internal_error);
+            }
+            state = jobs.empty()? ANNA_READY : ANNA_PROCESSING;
+            return state;
+        }
+        n_total += n;
+
+        // sample the slots whose last token is in this chunk
+        for (auto &s : slots) {
+            if (!s.active || s.i_batch < i || s.i_batch >= i + n) continue;
+
+            llama_token tok = llama_sampling_sample(s.sp,ctx,NULL,s.i_batch - i);
+            llama_sampling_accept(s.sp,ctx,tok,false);
+            s.i_batch = -1;
+            if (s.t_first == 0) s.t_first = Now();
+
+            s.inp.clear();
+            s.n_consumed = 0;
+            s.res.n_gen++;
+
+            if (tok == llama_token_eos(model)) {
+                FinishJob(s);
+                continue;
+            }
+
+            s.res.output += llama_token_to_piece(ctx,tok);
+            if (s.n_past + 1 >= s.n_limit) FinishJob(s);
+            else s.inp.push_back(tok);
+        }
+    }
+
+    state = (n_active || !jobs.empty())? ANNA_PROCESSING : ANNA_READY;
+    return state;
+}
@@ -0,0 +1,79 @@
+/* ANNA - Automatic Neural Network Assistant
+ * Batch (offline) inference over multiple independent sequences
+ * (C) Dmitry 'MatrixS_Master' Solovyev, 2023-2025
+ * */
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include <deque>
+#include "brain.h"
+
+#define ANNA_BATCH_VERSION "0.1.0"
+
+struct AnnaBatchJob {
+    int index = 0;                              // caller-defined job number, reported back in the result
+    std::string prompt;
+    int n_predict = -1;                         // -1 = use the config's value, or run until the slot is full
+    llama_sampling_params sparams;
+};
+
+struct AnnaBatchResult {
+    int index = 0;
+    bool ok = false;
+    std::string output, error;
+    int n_prompt = 0, n_gen = 0;
+    double t_wait = 0, t_prompt = 0, t_gen = 0; // in milliseconds
+};
+
+/*
+ * Runs many independent prompts through one model and one context.
+ * Each running job occupies a "slot", which is a separate sequence in the KV cache,
+ * so prompt processing and generation for all the slots are done in the same llama_decode() calls.
+ * The context is split evenly between the slots. A shared prompt (if set) is evaluated only once,
+ * and its KV cache cells are shared by all the sequences.
+ * */
+class AnnaBatch : public AnnaBrain
+{
+public:
+    AnnaBatch(AnnaConfig* cfg);
+    virtual ~AnnaBatch();
+
+    int getTokensUsed() override                        { return n_total; }
+
+    bool setSharedPrompt(std::string str);
+    void addJob(const AnnaBatchJob& job);
+    bool getResult(AnnaBatchResult& res);
+
+    int getNumSlots()                                   { return (int)slots.size(); }
+    int getPending()                                    { return (int)jobs.size() + n_active; }
+
+    AnnaState Processing(bool skip_sampling = false) override;
+
+private:
+    struct slot_rec {
+        llama_seq_id seq = 0;
+        bool active = false;
+        AnnaBatchJob job;
+        AnnaBatchResult res;
+        llama_sampling_context* sp = nullptr;
+        std::vector<llama_token> inp;
+        int n_consumed = 0, n_past = 0, n_limit = 0;
+        int i_batch = -1;
+        double t_start = 0, t_first = 0;
+    };
+
+    std::vector<slot_rec> slots;
+    std::deque<AnnaBatchJob> jobs;
+    std::deque<AnnaBatchResult> results;
+    std::deque<double> job_times;
+    llama_batch batch;
+    std::vector<llama_token> shared;
+    int n_active = 0, n_total = 0, slot_ctx = 0;
+
+    static double Now();
+
+    void StartJob(slot_rec& s);
+    void FinishJob(slot_rec& s, std::string err = "");
+};
@@ -12,6 +12,9 @@
 #include <time.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <memory>
+#include <algorithm>
+#include <mutex>
 #include "brain.h"
 #include "clip.h"
 
@@ -29,6 +32,7 @@
 using namespace std;
 
 static int users = 0;
+static std::mutex users_mtx; // brains might be created concurrently
 
 static const char* states_to_strings[ANNA_NUM_STATES] = {
     "not initialized",
@@ -82,12 +86,14 @@ AnnaBrain::~AnnaBrain()
 
 void AnnaBrain::backend_init()
 {
+    std::lock_guard<std::mutex> lk(users_mtx);
     if (!users) llama_backend_init(false);
     users++;
 }
 
 void AnnaBrain::backend_free()
 {
+    std::lock_guard<std::mutex> lk(users_mtx);
     if (--users <= 0) llama_backend_free();
 }
 
@@ -125,30 +131,27 @@ void AnnaBrain::Evaluate()
                 }
 
                 DBG("Context overflow: n_past = %d, queue = %zu, ext_emb = %d\n",n_past,queue.size(),n_ext_emb);
-
-#if 0 /* FIXME: Bring back reload-on-reset feature later */
-                int nseed = llama_get_rng_seed(ctx);
-                if (reload_on_reset && load_cache(ctx,n_past,ctx_sampling->prev)) {
-                    queue.clear();
-                    ext_emb.clear();
-                    inp_emb.clear();
-                    llama_set_rng_seed(ctx,nseed);
-                    n_remain = params.n_predict;
-                    DBG("State reloaded from cache due to context overflow. nseed = %d, n_past = %d\n",nseed,n_past);
-                    continue;
+                if (cache_reload && ReloadCache()) {
+                    DBG("State reloaded from cache due to context overflow, n_past = %d\n",n_past);
                 }
-#endif
+            }
 
+            if (n_past + (int)queue.size() + n_ext_emb > (int)llama_n_ctx(ctx)) {
                 int n_left    = n_past - config.params.n_keep - 1;
                 int n_discard = n_left/2;
-                DBG("n_past = %d, n_left = %d, n_discard = %d\n",n_past,n_left,n_discard);
 
-                llama_kv_cache_seq_rm(ctx,0,config.params.n_keep + 1,config.params.n_keep + n_discard + 1);
-                llama_kv_cache_seq_shift(ctx,0,config.params.n_keep + 1 + n_discard,n_past,-n_discard);
+                if (config.ctx_policy == ANNA_CTX_WINDOW) {
+                    // evict only as much as needed, rounded up to a whole chunk: every shift re-ropes the whole cache,
+                    // whatever its size, so the chunk has to be large enough to make the shifts rare
+                    // the chunk comes from the config as is, so it's clamped to keep the rounding from overflowing
+                    int chunk = min(config.ctx_chunk,(int)llama_n_ctx(ctx));
+                    if (chunk <= 0) chunk = max(1,((int)llama_n_ctx(ctx) - config.params.n_keep) / ANNA_CTX_CHUNK_DIV);
+                    int n_need = n_past + (int)queue.size() + n_ext_emb - (int)llama_n_ctx(ctx);
+                    n_discard = min(n_left,((n_need + chunk - 1) / chunk) * chunk);
+                }
 
-                n_past -= n_discard;
-                //state = ANNA_PROCESSING;
-                //return;
+                DBG("n_past = %d, n_left = %d, n_discard = %d\n",n_past,n_left,n_discard);
+                DiscardContext(n_discard);
             }
 
         } else {
@@ -217,8 +220,41 @@ void AnnaBrain::Evaluate()
 
         if (n_consumed >= (int)inp_emb.size()) inp_emb.clear();
         state = ANNA_PROCESSING;
-    } else
+
+    } else {
         state = ANNA_READY;
+
+        if (cache_pending) {
+            // the prompt has been fully evaluated, that's exactly the state worth caching
+            string err = internal_error;
+            cache_pending = false;
+            cache_saving = true;
+            if (!SaveState(cache_file,nullptr,0)) {
+                DBG("Unable to save prompt cache: %s\n",internal_error.c_str());
+            }
+            cache_saving = false;
+            internal_error = err;
+        }
+    }
+}
+
+void AnnaBrain::DiscardContext(int n_discard)
+{
+    if (n_discard <= 0) return;
+    const int start = config.params.n_keep + 1;
+
+    llama_kv_cache_seq_rm(ctx,0,start,start + n_discard);
+    llama_kv_cache_seq_shift(ctx,0,start + n_discard,n_past,-n_discard);
+
+    // keep the sampler's history in sync with the KV cache (its tail is the context followed by the queue)
+    auto & prev = ctx_sp->prev;
+    int first = (int)prev.size() - (int)queue.size() - n_past + start;
+    if (first >= 0 && first + n_discard <= (int)prev.size()) {
+        prev.erase(prev.begin() + first,prev.begin() + first + n_discard);
+        prev.insert(prev.begin(),n_discard,0);
+    }
+
+    n_past -= n_discard;
 }
 
 void AnnaBrain::Generate()
@@ -263,18 +299,46 @@ void AnnaBrain::Generate()
 
 AnnaState AnnaBrain::Processing(bool skip_sampling)
 {
+    // only pure generation steps are timed, input processing would just skew the numbers
+    bool timed = !skip_sampling && inp_emb.empty() && ext_emb.empty() && queue.size() <= 1;
+    timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC,&t0);
+
     Evaluate();
     if (!skip_sampling) Generate();
 
+    if (timed && (state == ANNA_READY || state == ANNA_TURNOVER)) {
+        clock_gettime(CLOCK_MONOTONIC,&t1);
+        tok_times.push_back((float)(t1.tv_sec - t0.tv_sec) * 1000.f + (float)(t1.tv_nsec - t0.tv_nsec) / 1000000.f);
+        if (tok_times.size() > ANNA_TIMING_WINDOW) tok_times.pop_front();
+    }
+
     return state;
 }
 
+AnnaTimings AnnaBrain::getTimings()
+{
+    AnnaTimings r;
+    if (tok_times.empty()) return r;
+
+    vector<float> v(tok_times.begin(),tok_times.end());
+    sort(v.begin(),v.end());
+    r.n_tokens = v.size();
+    for (auto &i : v) r.mean_ms += i;
+    r.mean_ms /= v.size();
+    r.p50_ms = v[v.size() / 2];
+    r.p99_ms = v[min(v.size() - 1,(v.size() * 99) / 100)];
+    r.max_ms = v.back();
+    return r;
+}
+
 void AnnaBrain::Reset(int flags)
 {
     if (flags & ANNA_RESET_CONTEXT) {
         llama_kv_cache_seq_rm(ctx,0,0,n_past);
         n_past = 0;
         ga_i = 0;
+        cache_pending = false;
     }
 
     if (flags & ANNA_RESET_PROMPT) {
@@ -307,6 +371,13 @@ string AnnaBrain::getOutput()
     return tmp;
 }
 
+void AnnaBrain::setConfig(const AnnaConfig& cfg)
+{
+    config = cfg;
+    // most of the parameters are used directly from the config, but the context keeps its own number of threads
+    if (ctx) llama_set_n_threads(ctx,config.params.n_threads,config.params.n_threads);
+}
+
 void AnnaBrain::setInput(string inp)
 {
     if (state == ANNA_TURNOVER) state = ANNA_READY; // revert the state
@@ -330,6 +401,19 @@ void AnnaBrain::setInput(string inp)
     if (prompt.empty()) {
         prompt = emb; // save the first sequence as prompt
         config.params.n_keep = prompt.size();
+
+        // a fresh context and the same prompt means we can skip its evaluation altogether
+        if (!cache_file.empty() && !n_past && inp_emb.size() == emb.size()) {
+            cache_key = MakeCacheKey(emb);
+            if (LoadCache()) {
+                DBG("Prompt state loaded from cache '%s', n_past = %d\n",cache_file.c_str(),n_past);
+                inp_emb.clear();
+                n_consumed = 0;
+                n_remain = config.params.n_predict;
+                state = ANNA_READY;
+            } else
+                cache_pending = true;
+        }
     }
 }
 
@@ -420,6 +504,7 @@ bool AnnaBrain::SaveState(std::string fname, const void* user_data, size_t user_
     memset((void*)&hdr,0,sizeof(hdr));
     memcpy(hdr.magic,ANNA_STATE_MAGIC,sizeof(hdr.magic));
     hdr.version = ANNA_STATE_VERSION;
+    hdr.cache_key = cache_saving? cache_key : 0; // only pure prompt states are usable as a prompt cache
     hdr.cfg = config;
     hdr.n_past = n_past;
     hdr.n_remain = n_remain;
@@ -532,16 +617,19 @@ bool AnnaBrain::LoadState(std::string fname, void* user_data, size_t* user_size)
 
     if (!fread(&hdr,sizeof(hdr),1,f))
         internal_error = "Couldn't read the header from the state file";
+    if (internal_error.empty() && strncmp(hdr.magic,ANNA_STATE_MAGIC,sizeof(hdr.magic)))
+        internal_error = myformat("Wrong state file magic ID: expected " ANNA_STATE_MAGIC ", got %4s",hdr.magic);
+    if (internal_error.empty() && hdr.version != ANNA_STATE_VERSION)
+        internal_error = myformat("Unsupported state file version %u (expected %u)",hdr.version,ANNA_STATE_VERSION);
 
     if (state == ANNA_NOT_INITIALIZED || !ctx) {
-        config = hdr.cfg;
+        // the config of another version would be garbage
+        if (internal_error.empty()) config = hdr.cfg;
         fclose(f);
         return internal_error.empty(); // we have no context, so this means loading is complete (config acquired)
     }
 
     size_t dsize = llama_get_state_size(ctx);
-    if (internal_error.empty() && strncmp(hdr.magic,ANNA_STATE_MAGIC,sizeof(hdr.magic)))
-        internal_error = myformat("Wrong state file magic ID: expected " ANNA_STATE_MAGIC ", got %4s",hdr.magic);
     if (internal_error.empty() && hdr.data_size != dsize)
         internal_error = myformat("Wrong state data size: expected %zu, got %zu bytes",dsize,hdr.data_size);
     if (internal_error.empty() && user_data && hdr.user_size > (user_size? (*user_size):0))
@@ -640,6 +728,186 @@ bool AnnaBrain::LoadState(std::string fname, void* user_data, size_t* user_size)
     return true;
 }
 
+bool AnnaBrain::SaveStateData(string& out)
+{
+    if (state == ANNA_NOT_INITIALIZED || !ctx) return false;
+
+    // same layout as the state file, but only the used part of the KV cache is stored, and there's no user data
+    AnnaSave hdr;
+    memset((void*)&hdr,0,sizeof(hdr));
+    memcpy(hdr.magic,ANNA_STATE_MAGIC,sizeof(hdr.magic));
+    hdr.version = ANNA_STATE_VERSION;
+    hdr.cfg = config;
+    hdr.n_past = n_past;
+    hdr.n_remain = n_remain;
+    hdr.n_consumed = n_consumed;
+    hdr.ga_i = ga_i;
+    hdr.vector_size += vector_storage<llama_token>::size(queue);
+    hdr.vector_size += vector_storage<llama_token>::size(prompt);
+    hdr.vector_size += vector_storage<llama_token>::size(inp_emb);
+    hdr.vector_size += vector_storage<float>::size(ext_emb);
+    hdr.vector_size += vector_storage<llama_token>::size(forced_start);
+    hdr.vector_size += vector_storage<char>::size(accumulator);
+    hdr.vector_size += vector_storage<llama_token>::size(ctx_sp->prev);
+
+    out.resize(sizeof(hdr) + llama_get_state_size(ctx) + hdr.vector_size);
+    uint8_t* data = (uint8_t*)&out[0];
+    hdr.data_size = llama_copy_state_data(ctx,data + sizeof(hdr));
+    memcpy(data,&hdr,sizeof(hdr));
+
+    void* ptr = data + sizeof(hdr) + hdr.data_size;
+    ptr = vector_storage<llama_token>::store(queue,ptr);
+    ptr = vector_storage<llama_token>::store(prompt,ptr);
+    ptr = vector_storage<llama_token>::store(inp_emb,ptr);
+    ptr = vector_storage<float>::store(ext_emb,ptr);
+    ptr = vector_storage<llama_token>::store(vector_storage<llama_token>::from_deque(forced_start),ptr);
+    ptr = vector_storage<char>::store(vector_storage<char>::from_string(accumulator),ptr);
+    ptr = vector_storage<llama_token>::store(ctx_sp->prev,ptr);
+    out.resize((uint8_t*)ptr - data);
+
+    DBG("State data: %zu bytes (%zu of the full state)\n",out.size(),hdr.data_size);
+    return true;
+}
+
+bool AnnaBrain::LoadStateData(const string& in)
+{
+    if (state == ANNA_NOT_INITIALIZED || !ctx) return false;
+
+    AnnaSave hdr;
+    if (in.size() < sizeof(hdr)) {
+        internal_error = "State data is too short";
+        return false;
+    }
+    memcpy(&hdr,in.data(),sizeof(hdr));
+    if (strncmp(hdr.magic,ANNA_STATE_MAGIC,sizeof(hdr.magic)) || hdr.version != ANNA_STATE_VERSION) {
+        internal_error = "Wrong state data header";
+        return false;
+    }
+    if (hdr.data_size > llama_get_state_size(ctx) || sizeof(hdr) + hdr.data_size + hdr.vector_size != in.size()) {
+        internal_error = myformat("Wrong state data size: %zu bytes, %zu bytes expected",in.size(),sizeof(hdr) + hdr.data_size + hdr.vector_size);
+        return false;
+    }
+
+    uint8_t* ptr = (uint8_t*)in.data() + sizeof(hdr);
+    llama_set_state_data(ctx,ptr);
+    ptr += hdr.data_size;
+
+    queue = vector_storage<llama_token>::load((void**)&ptr);
+    prompt = vector_storage<llama_token>::load((void**)&ptr);
+    inp_emb = vector_storage<llama_token>::load((void**)&ptr);
+    ext_emb = vector_storage<float>::load((void**)&ptr);
+    forced_start = vector_storage<llama_token>::to_deque(vector_storage<llama_token>::load((void**)&ptr));
+    accumulator = vector_storage<char>::to_string(vector_storage<char>::load((void**)&ptr));
+    ctx_sp->prev = vector_storage<llama_token>::load((void**)&ptr);
+
+    // the rest of the config (threads, etc) is up to the current owner of the brain
+    n_past = hdr.n_past;
+    n_remain = hdr.n_remain;
+    n_consumed = hdr.n_consumed;
+    ga_i = hdr.ga_i;
+    return true;
+}
+
+void AnnaBrain::setPromptCache(string fname, bool reload_on_overflow)
+{
+    cache_file = fname;
+    cache_reload = reload_on_overflow;
+    cache_pending = false;
+}
+
+static uint64_t fnv1a(const void* data, size_t len, uint64_t h = 0xcbf29ce484222325ULL)
+{
+    const uint8_t* p = (const uint8_t*)data;
+    while (len--) {
+        h ^= *p++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+uint64_t AnnaBrain::MakeCacheKey(const vector<llama_token>& tokens)
+{
+    uint64_t h = fnv1a(nullptr,0);
+
+    // hashing the whole model file would take too long, so only its size and the beginning (all the metadata) are used
+    FILE* f = fopen(config.params.model,"rb");
+    if (f) {
+        vector<uint8_t> buf(ANNA_CACHE_FINGERPRINT_BYTES);
+        size_t n = fread(buf.data(),1,buf.size(),f);
+        h = fnv1a(buf.data(),n,h);
+        fseek(f,0,SEEK_END);
+        uint64_t fsize = ftell(f);
+        h = fnv1a(&fsize,sizeof(fsize),h);
+        fclose(f);
+    }
+    uint64_t msize[] = { llama_model_size(model), llama_model_n_params(model) };
+    h = fnv1a(msize,sizeof(msize),h);
+
+    // context parameters which affect the contents of the state
+    const gpt_params & p = config.params;
+    int32_t ip[] = { (int32_t)llama_n_ctx(ctx), p.grp_attn_n, p.grp_attn_w, p.rope_scaling_type, p.yarn_orig_ctx, p.cache_type_k, p.cache_type_v };
+    float fp[] = { p.rope_freq_base, p.rope_freq_scale, p.yarn_ext_factor, p.yarn_attn_factor, p.yarn_beta_fast, p.yarn_beta_slow };
+    h = fnv1a(ip,sizeof(ip),h);
+    h = fnv1a(fp,sizeof(fp),h);
+
+    // and the prompt itself
+    h = fnv1a(tokens.data(),tokens.size() * sizeof(llama_token),h);
+    return h? h : 1; // zero means "no key"
+}
+
+bool AnnaBrain::LoadCache()
+{
+    if (cache_file.empty() || !cache_key) return false;
+
+    // check the key first, without touching anything
+    unique_ptr<AnnaSave> hdr(new AnnaSave);
+    FILE* f = fopen(cache_file.c_str(),"rb");
+    if (!f) return false;
+    bool ok = fread(hdr.get(),sizeof(AnnaSave),1,f) == 1;
+    fclose(f);
+
+    if (!ok || strncmp(hdr->magic,ANNA_STATE_MAGIC,sizeof(hdr->magic)) || hdr->version != ANNA_STATE_VERSION || hdr->cache_key != cache_key) {
+        DBG("Prompt cache '%s' doesn't match the current model, prompt or settings\n",cache_file.c_str());
+        return false;
+    }
+
+    // the cached state is used as is, but the current settings must stay
+    unique_ptr<AnnaConfig> cur(new AnnaConfig(config));
+    string err = internal_error;
+    ok = LoadState(cache_file,nullptr,nullptr);
+    config = *cur;
+    if (!ok) {
+        DBG("Unable to load prompt cache: %s\n",internal_error.c_str());
+        internal_error = err;
+    }
+    return ok;
+}
+
+bool AnnaBrain::ReloadCache()
+{
+    // everything which hasn't been evaluated yet must survive the reload
+    auto old_queue = queue;
+    auto old_inp = inp_emb;
+    auto old_ext = ext_emb;
+    auto old_forced = forced_start;
+    auto old_acc = accumulator;
+    int old_consumed = n_consumed, old_remain = n_remain;
+
+    if (!LoadCache()) return false;
+
+    queue = std::move(old_queue);
+    inp_emb = std::move(old_inp);
+    ext_emb = std::move(old_ext);
+    forced_start = std::move(old_forced);
+    accumulator = std::move(old_acc);
+    n_consumed = old_consumed;
+    n_remain = old_remain;
+
+    // don't let the model repeat itself after each reload
+    llama_set_rng_seed(ctx,config.params.seed + (++cache_reloads));
+    return true;
+}
+
 void AnnaBrain::anna_no_log(ggml_log_level, const char*, void*)
 {
     // This is an empty function
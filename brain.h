@@ -15,11 +15,15 @@
 #include "sampling.h"
 #include "vecstore.h"
 
-#define ANNA_VERSION "0.13.0"
+#define ANNA_VERSION "0.14.0"
 
 #define ANNA_FORMAT_DEF_CHARS 1024
-#define ANNA_STATE_VERSION 3
+// 4: AnnaSave::cache_key, AnnaConfig::ctx_policy/ctx_chunk and gpt_params::flash_attn were appended
+#define ANNA_STATE_VERSION 4
 #define ANNA_STATE_MAGIC "ANNA"
+#define ANNA_CACHE_FINGERPRINT_BYTES (1024UL * 1024UL)
+#define ANNA_CTX_CHUNK_DIV 8
+#define ANNA_TIMING_WINDOW 8192
 
 enum AnnaState
 {
@@ -31,6 +35,13 @@ enum AnnaState
     ANNA_NUM_STATES
 };
 
+enum AnnaContextPolicy
+{
+    ANNA_CTX_HALVE = 0,     // on overflow, discard a half of the context (except the kept part)
+    ANNA_CTX_WINDOW,        // keep the sink tokens and slide the window, evicting a chunk at a time
+    ANNA_NUM_CTX_POLICIES
+};
+
 enum AnnaResetFlag
 {
     ANNA_RESET_NONE = 0,
@@ -50,6 +61,14 @@ struct __attribute__((packed)) AnnaConfig
     bool no_pad_in_prefix   = true;
     gpt_params params;
     void* user              = nullptr;
+    int ctx_policy          = ANNA_CTX_HALVE;
+    int ctx_chunk           = 0;    // 0 = auto (1/ANNA_CTX_CHUNK_DIV of the sliding part of the context)
+};
+
+struct AnnaTimings
+{
+    int n_tokens = 0;       // number of generated tokens in the current window
+    double mean_ms = 0, p50_ms = 0, p99_ms = 0, max_ms = 0;
 };
 
 struct __attribute__((packed)) AnnaSave
@@ -59,6 +78,7 @@ struct __attribute__((packed)) AnnaSave
     AnnaConfig cfg;
     int n_past, n_remain, n_consumed, ga_i;
     size_t data_size, vector_size, user_size;
+    uint64_t cache_key;
 };
 
 class AnnaBrain
@@ -70,8 +90,9 @@ public:
     virtual AnnaState getState()                    { return state; }
     virtual const std::string & getError()          { return internal_error; }
     virtual int getTokensUsed()                     { return n_past; }
+    virtual AnnaTimings getTimings();
     virtual AnnaConfig getConfig()                  { return config; }
-    virtual void setConfig(const AnnaConfig& cfg)   { config = cfg; }
+    virtual void setConfig(const AnnaConfig& cfg);
     virtual void setClipModelFile(std::string fn)   { clip_file = fn; }
     virtual std::string getClipModelFile()          { return clip_file; }
 
@@ -91,6 +112,10 @@ public:
 
     virtual bool SaveState(std::string fname, const void* user_data, size_t user_size);
     virtual bool LoadState(std::string fname, void* user_data, size_t* user_size);
+    // in-memory state, with only the used part of the KV cache
+    virtual bool SaveStateData(std::string& out);
+    virtual bool LoadStateData(const std::string& in);
+    virtual void setPromptCache(std::string fname, bool reload_on_overflow = false);
 
     virtual bool EmbedImage(std::string imgfile);
 
@@ -113,6 +138,11 @@ protected:
     std::vector<float> ext_emb;
     std::string accumulator,piecebuf;
     std::string clip_file;
+    std::string cache_file;
+    uint64_t cache_key = 0;
+    bool cache_reload = false, cache_pending = false, cache_saving = false;
+    int cache_reloads = 0;
+    std::deque<float> tok_times;
 
     static void anna_no_log(ggml_log_level level, const char * text, void * user_data);
     static void backend_init();
@@ -121,6 +151,11 @@ protected:
     llama_batch batch_embeddings(int n_tokens, float *embeds, int n_past);
     void print_vec(std::string& str, const std::vector<llama_token>& vec);
 
+    uint64_t MakeCacheKey(const std::vector<llama_token>& tokens);
+    bool LoadCache();
+    bool ReloadCache();
+    void DiscardContext(int n_discard);
+
     void Evaluate();
     void Generate();
 };
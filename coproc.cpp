@@ -0,0 +1,324 @@
+/* ANNA - Automatic Neural Network Assistant
+ * Requester plugin process runner
+ * (C) Dmitry 'MatrixS_Master' Solovyev, 2023-2025
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+#include "coproc.h"
+#include "brain.h"
+
+#ifndef NDEBUG
+#define DBG(...) do { fprintf(stderr,"[COPROC DBG] " __VA_ARGS__); fflush(stderr); } while (0)
+#else
+#define DBG(...)
+#endif
+
+using namespace std;
+
+AnnaCoprocess::AnnaCoprocess(string cmd, bool persist) :
+    command(cmd),
+    persistent(persist)
+{
+    worker = thread([this] { WorkerLoop(); });
+}
+
+AnnaCoprocess::~AnnaCoprocess()
+{
+    {
+        lock_guard<mutex> lk(mtx);
+        quit = true;
+    }
+    cv_job.notify_all();
+    worker.join();
+    Kill(true);
+}
+
+void AnnaCoprocess::setLimits(int timeout_ms, size_t max_output)
+{
+    if (timeout_ms > 0) timeout = timeout_ms;
+    if (max_output > 0) maxout = max_output;
+}
+
+void AnnaCoprocess::Request(const string& data)
+{
+    {
+        lock_guard<mutex> lk(mtx);
+        jobs.push_back(data);
+    }
+    cv_job.notify_one();
+}
+
+bool AnnaCoprocess::isBusy()
+{
+    lock_guard<mutex> lk(mtx);
+    return running || !jobs.empty();
+}
+
+bool AnnaCoprocess::getResult(string& out)
+{
+    lock_guard<mutex> lk(mtx);
+    if (results.empty()) return false;
+    out = std::move(results.front());
+    results.pop_front();
+    return true;
+}
+
+bool AnnaCoprocess::Wait(string& out)
+{
+    unique_lock<mutex> lk(mtx);
+    cv_done.wait(lk,[this] { return !results.empty() || (!running && jobs.empty()); });
+    if (results.empty()) return false;
+    out = std::move(results.front());
+    results.pop_front();
+    return true;
+}
+
+string AnnaCoprocess::getError()
+{
+    lock_guard<mutex> lk(mtx);
+    return merror;
+}
+
+void AnnaCoprocess::SetError(const string& err)
+{
+    lock_guard<mutex> lk(mtx);
+    merror = err;
+}
+
+long long AnnaCoprocess::Now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (long long)ts.tv_sec * 1000LL + ts.tv_nsec / 1000000LL;
+}
+
+void AnnaCoprocess::WorkerLoop()
+{
+    // a dead plugin must not bring the whole process down with SIGPIPE
+    sigset_t ss;
+    sigemptyset(&ss);
+    sigaddset(&ss,SIGPIPE);
+    pthread_sigmask(SIG_BLOCK,&ss,NULL);
+
+    unique_lock<mutex> lk(mtx);
+    while (!quit) {
+        if (jobs.empty()) {
+            cv_job.wait(lk);
+            continue;
+        }
+
+        string job = std::move(jobs.front());
+        jobs.pop_front();
+        running++;
+        lk.unlock();
+
+        string res = Execute(job);
+
+        lk.lock();
+        running--;
+        results.push_back(std::move(res));
+        cv_done.notify_all();
+    }
+}
+
+string AnnaCoprocess::Execute(const string& data)
+{
+    DBG("Executing request (%zu bytes)\n",data.size());
+    SetError("");
+    return persistent? ExecuteFramed(data) : ExecuteOnce(data);
+}
+
+bool AnnaCoprocess::Spawn(const string& cmd, bool with_stdin)
+{
+    int pin[2] = {-1,-1}, pout[2];
+    if (pipe2(pout,O_CLOEXEC)) {
+        SetError(AnnaBrain::myformat("Unable to create pipe: %s",strerror(errno)));
+        return false;
+    }
+    if (with_stdin && pipe2(pin,O_CLOEXEC)) {
+        SetError(AnnaBrain::myformat("Unable to create pipe: %s",strerror(errno)));
+        close(pout[0]);
+        close(pout[1]);
+        return false;
+    }
+
+    pid = fork();
+    if (pid < 0) {
+        SetError(AnnaBrain::myformat("Unable to fork: %s",strerror(errno)));
+        close(pout[0]);
+        close(pout[1]);
+        if (with_stdin) {
+            close(pin[0]);
+            close(pin[1]);
+        }
+        return false;
+    }
+
+    if (!pid) {
+        // child: the blocked SIGPIPE of the worker thread would survive exec, and break the pipelines of the plugin
+        sigset_t ss;
+        sigemptyset(&ss);
+        sigaddset(&ss,SIGPIPE);
+        sigprocmask(SIG_UNBLOCK,&ss,NULL);
+        dup2(pout[1],STDOUT_FILENO);
+        if (with_stdin) dup2(pin[0],STDIN_FILENO);
+        execl("/bin/sh","sh","-c",cmd.c_str(),(char*)NULL);
+        _exit(127);
+    }
+
+    close(pout[1]);
+    fd_out = pout[0];
+    if (with_stdin) {
+        close(pin[0]);
+        fd_in = pin[1];
+    }
+    rbuf.clear();
+    DBG("Process %d started: '%s'\n",pid,cmd.c_str());
+    return true;
+}
+
+void AnnaCoprocess::Kill(bool graceful)
+{
+    if (fd_in >= 0) close(fd_in);
+    fd_in = -1;
+
+    if (pid > 0) {
+        // closed stdin is a polite request to exit, so give it a chance
+        bool done = false;
+        for (int i = 0; graceful && i < ANNA_COPROC_EXIT_WAIT_MS && !done; i++) {
+            if (waitpid(pid,NULL,WNOHANG) == pid) done = true;
+            else usleep(1000);
+        }
+        if (!done) {
+            kill(pid,SIGKILL);
+            waitpid(pid,NULL,0);
+        }
+        DBG("Process %d finished\n",pid);
+    }
+    pid = -1;
+
+    if (fd_out >= 0) close(fd_out);
+    fd_out = -1;
+    rbuf.clear();
+}
+
+bool AnnaCoprocess::WriteAll(const char* data, size_t len, long long deadline)
+{
+    while (len) {
+        pollfd p = { fd_in, POLLOUT, 0 };
+        int left = deadline - Now();
+        int r = (left > 0)? poll(&p,1,left) : 0;
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) {
+            SetError("Timeout writing the request");
+            return false;
+        }
+        ssize_t n = write(fd_in,data,len);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            SetError(AnnaBrain::myformat("Unable to write the request: %s",strerror(errno)));
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+int AnnaCoprocess::ReadChunk(long long deadline)
+{
+    char buf[ANNA_COPROC_CHUNK];
+    for (;;) {
+        pollfd p = { fd_out, POLLIN, 0 };
+        int left = deadline - Now();
+        int r = (left > 0)? poll(&p,1,left) : 0;
+        if (r < 0 && errno == EINTR) continue;
+        if (r == 0) {
+            SetError("Request timed out");
+            return -1;
+        }
+        ssize_t n = read(fd_out,buf,sizeof(buf));
+        if (n < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+        if (n > 0) rbuf.append(buf,n);
+        return n;
+    }
+}
+
+string AnnaCoprocess::ExecuteOnce(const string& cmd)
+{
+    long long deadline = Now() + timeout;
+    if (!Spawn(cmd,false)) return "";
+
+    string out;
+    int n;
+    while ((n = ReadChunk(deadline)) > 0) {
+        if (rbuf.size() > maxout) {
+            DBG("Output limit reached, truncating\n");
+            rbuf.resize(maxout);
+            break;
+        }
+    }
+    out.swap(rbuf);
+
+    // EOF has been reached or the output was cut short; in both cases the process is not needed anymore
+    Kill(n == 0);
+    if (n < 0) return "";
+    return out;
+}
+
+string AnnaCoprocess::ExecuteFramed(const string& data)
+{
+    long long deadline = Now() + timeout;
+    if (pid <= 0 && !Spawn(command,true)) return "";
+
+    // send the request
+    string hdr = AnnaBrain::myformat("%zu\n",data.size());
+    if (!WriteAll(hdr.data(),hdr.size(),deadline) || !WriteAll(data.data(),data.size(),deadline)) {
+        Kill(false);
+        return "";
+    }
+
+    // receive the response header
+    size_t eol;
+    while ((eol = rbuf.find('\n')) == string::npos) {
+        if (rbuf.size() > ANNA_COPROC_MAX_HEADER || ReadChunk(deadline) <= 0) {
+            if (rbuf.size() > ANNA_COPROC_MAX_HEADER) SetError("Malformed response header");
+            else if (Now() < deadline) SetError("Plugin process has exited");
+            Kill(false);
+            return "";
+        }
+    }
+    char* end = nullptr;
+    unsigned long long len = strtoull(rbuf.c_str(),&end,10);
+    if (end != rbuf.c_str() + eol) {
+        SetError("Malformed response header");
+        Kill(false);
+        return "";
+    }
+    rbuf.erase(0,eol+1);
+
+    // receive the body; anything over the limit is drained and thrown away to keep the stream in sync
+    string out;
+    while (len) {
+        if (rbuf.empty() && ReadChunk(deadline) <= 0) {
+            if (Now() < deadline) SetError("Plugin process has exited");
+            Kill(false);
+            return "";
+        }
+        size_t n = min((size_t)len,rbuf.size());
+        if (out.size() < maxout) out.append(rbuf,0,min(n,maxout - out.size()));
+        rbuf.erase(0,n);
+        len -= n;
+    }
+
+    return out;
+}
@@ -0,0 +1,78 @@
+/* ANNA - Automatic Neural Network Assistant
+ * Requester plugin process runner
+ * (C) Dmitry 'MatrixS_Master' Solovyev, 2023-2025
+ * */
+
+#pragma once
+
+#include <string>
+#include <deque>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <sys/types.h>
+
+#define ANNA_COPROC_VERSION "0.1.0"
+
+#define ANNA_COPROC_TIMEOUT_MS 60000
+#define ANNA_COPROC_MAX_OUTPUT (1024UL * 1024UL)
+#define ANNA_COPROC_CHUNK 4096
+#define ANNA_COPROC_EXIT_WAIT_MS 200
+#define ANNA_COPROC_MAX_HEADER 32
+
+/*
+ * Runs requester plugins on a dedicated worker thread, so the caller is free to continue its work.
+ * Two modes are supported:
+ *  - One-shot: every request is a shell command line, which is executed and its stdout collected until EOF.
+ *  - Persistent: the command is started once and kept running. Requests and responses are exchanged
+ *    through its stdin/stdout using simple length-framed messages: "<decimal length>\n<payload bytes>".
+ * Requests are processed in order, and every request produces exactly one result (empty on failure).
+ * */
+class AnnaCoprocess
+{
+public:
+    AnnaCoprocess(std::string cmd = "", bool persist = false);
+    virtual ~AnnaCoprocess();
+
+    void setLimits(int timeout_ms, size_t max_output);
+
+    // data is either a command line (one-shot mode) or a message payload (persistent mode)
+    void Request(const std::string& data);
+
+    bool isBusy();
+    bool getResult(std::string& out);
+    bool Wait(std::string& out);
+    std::string getError();
+
+private:
+    std::string command;
+    bool persistent;
+    std::atomic<int> timeout = ANNA_COPROC_TIMEOUT_MS;
+    std::atomic<size_t> maxout = ANNA_COPROC_MAX_OUTPUT;
+
+    pid_t pid = -1;
+    int fd_in = -1, fd_out = -1;
+    std::string rbuf;
+
+    std::thread worker;
+    std::mutex mtx;
+    std::condition_variable cv_job, cv_done;
+    std::deque<std::string> jobs, results;
+    int running = 0;
+    bool quit = false;
+    std::string merror;
+
+    void WorkerLoop();
+    std::string Execute(const std::string& data);
+    std::string ExecuteOnce(const std::string& cmd);
+    std::string ExecuteFramed(const std::string& data);
+
+    bool Spawn(const std::string& cmd, bool with_stdin);
+    void Kill(bool graceful);
+    bool WriteAll(const char* data, size_t len, long long deadline);
+    int ReadChunk(long long deadline);
+    void SetError(const std::string& err);
+
+    static long long Now();
+};
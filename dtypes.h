@@ -123,6 +123,9 @@ struct __attribute__((packed)) gpt_params {
     char model[LLAMA_MAX_FILENAME_LEN] = {0}; // model path
     char prompt[LLAMA_MAX_PROMPT_LEN]  = {0};
 
+    // the struct is stored in the state files and sent over the network as is, so new fields go to its end
+    bool flash_attn        = false; // use the fused attention kernel (CPU only)
+
     //std::vector<llama_model_kv_override> kv_overrides;
     //gpt_string_params* strings;
 };
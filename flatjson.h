@@ -0,0 +1,236 @@
+/* ANNA - Automatic Neural Network Assistant
+ * Minimalistic reader/writer for flat JSON objects (one per line, as in JSONL files)
+ * (C) Dmitry 'MatrixS_Master' Solovyev, 2023-2025
+ * */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <map>
+
+/*
+ * Only the top level of an object is parsed. String values are unescaped,
+ * everything else (numbers, booleans, null, nested objects and arrays) is kept as raw JSON text.
+ * */
+class AnnaJSONRecord
+{
+public:
+    bool parse(const std::string& in)
+    {
+        vals.clear();
+        raw.clear();
+        err.clear();
+        pos = 0;
+        src = &in;
+
+        skip_ws();
+        if (!expect('{')) return false;
+        skip_ws();
+        if (peek() == '}') return true;
+
+        for (;;) {
+            std::string key, val;
+            skip_ws();
+            if (!read_string(key)) return fail("key expected");
+            skip_ws();
+            if (!expect(':')) return false;
+            skip_ws();
+            if (peek() == '"') {
+                if (!read_string(val)) return false;
+                raw[key] = false;
+            } else {
+                size_t start = pos;
+                if (!skip_value()) return false;
+                val = in.substr(start,pos-start);
+                raw[key] = true;
+            }
+            vals[key] = val;
+
+            skip_ws();
+            if (peek() == ',') {
+                pos++;
+                continue;
+            }
+            return expect('}');
+        }
+    }
+
+    const std::string & getError() const                { return err; }
+    bool has(const std::string& key) const              { return vals.count(key); }
+    bool isString(const std::string& key) const         { return has(key) && !raw.at(key); }
+
+    std::string str(const std::string& key, const std::string& def = "") const
+    {
+        auto it = vals.find(key);
+        return (it == vals.end())? def : it->second;
+    }
+
+    double num(const std::string& key, double def = 0) const
+    {
+        auto it = vals.find(key);
+        if (it == vals.end() || it->second.empty()) return def;
+        char* end = nullptr;
+        double r = strtod(it->second.c_str(),&end);
+        return (end && !*end)? r : def;
+    }
+
+    // returns the value as a piece of JSON text, suitable for copying into another object
+    std::string json(const std::string& key) const
+    {
+        auto it = vals.find(key);
+        if (it == vals.end()) return "null";
+        return raw.at(key)? it->second : escape(it->second);
+    }
+
+    static std::string escape(const std::string& in)
+    {
+        std::string out = "\"";
+        for (unsigned char c : in) {
+            switch (c) {
+            case '\"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            case '\b': out += "\\b"; break;
+            case '\f': out += "\\f"; break;
+            default:
+                if (c < 0x20) {
+                    char buf[8];
+                    snprintf(buf,sizeof(buf),"\\u%04x",c);
+                    out += buf;
+                } else
+                    out += c;
+            }
+        }
+        return out + "\"";
+    }
+
+private:
+    std::map<std::string,std::string> vals;
+    std::map<std::string,bool> raw;
+    std::string err;
+    const std::string* src = nullptr;
+    size_t pos = 0;
+
+    char peek() const { return (pos < src->size())? (*src)[pos] : 0; }
+
+    bool fail(const char* what)
+    {
+        char buf[128];
+        snprintf(buf,sizeof(buf),"JSON error at position %zu: %s",pos,what);
+        err = buf;
+        return false;
+    }
+
+    bool expect(char c)
+    {
+        if (peek() != c) {
+            char buf[16];
+            snprintf(buf,sizeof(buf),"'%c' expected",c);
+            return fail(buf);
+        }
+        pos++;
+        return true;
+    }
+
+    void skip_ws()
+    {
+        while (pos < src->size() && strchr(" \t\r\n",(*src)[pos])) pos++;
+    }
+
+    static void put_utf8(std::string& out, unsigned cp)
+    {
+        if (cp < 0x80) out += (char)cp;
+        else if (cp < 0x800) {
+            out += (char)(0xC0 | (cp >> 6));
+            out += (char)(0x80 | (cp & 0x3F));
+        } else if (cp < 0x10000) {
+            out += (char)(0xE0 | (cp >> 12));
+            out += (char)(0x80 | ((cp >> 6) & 0x3F));
+            out += (char)(0x80 | (cp & 0x3F));
+        } else {
+            out += (char)(0xF0 | (cp >> 18));
+            out += (char)(0x80 | ((cp >> 12) & 0x3F));
+            out += (char)(0x80 | ((cp >> 6) & 0x3F));
+            out += (char)(0x80 | (cp & 0x3F));
+        }
+    }
+
+    bool read_hex4(unsigned& cp)
+    {
+        if (pos + 4 > src->size()) return fail("truncated escape sequence");
+        char* end = nullptr;
+        std::string h = src->substr(pos,4);
+        cp = strtoul(h.c_str(),&end,16);
+        if (!end || *end) return fail("bad escape sequence");
+        pos += 4;
+        return true;
+    }
+
+    bool read_string(std::string& out)
+    {
+        if (!expect('"')) return false;
+        while (pos < src->size()) {
+            char c = (*src)[pos++];
+            if (c == '"') return true;
+            if (c != '\\') {
+                out += c;
+                continue;
+            }
+
+            c = peek();
+            pos++;
+            switch (c) {
+            case 'n': out += '\n'; break;
+            case 'r': out += '\r'; break;
+            case 't': out += '\t'; break;
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'u':
+                {
+                    unsigned cp;
+                    if (!read_hex4(cp)) return false;
+                    if (cp >= 0xD800 && cp < 0xDC00 && src->compare(pos,2,"\\u") == 0) {
+                        // surrogate pair
+                        unsigned lo;
+                        pos += 2;
+                        if (!read_hex4(lo)) return false;
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                    }
+                    put_utf8(out,cp);
+                }
+                break;
+            default: out += c;
+            }
+        }
+        return fail("unterminated string");
+    }
+
+    bool skip_value()
+    {
+        int depth = 0;
+        size_t start = pos;
+        while (pos < src->size()) {
+            char c = peek();
+            if (c == '"') {
+                std::string dummy;
+                if (!read_string(dummy)) return false;
+                continue;
+            }
+            if (c == '{' || c == '[') depth++;
+            else if (c == '}' || c == ']') {
+                if (!depth) break;
+                depth--;
+            } else if (c == ',' && !depth) break;
+            pos++;
+        }
+        if (depth) return fail("unbalanced brackets");
+        while (pos > start && strchr(" \t\r\n",(*src)[pos-1])) pos--;
+        if (pos == start) return fail("value expected");
+        return true;
+    }
+};
@@ -0,0 +1,127 @@
+/* ANNA - Automatic Neural Network Assistant
+ * FME transport benchmark: file backend vs shared memory backend
+ * (C) Dmitry 'MatrixS_Master' Solovyev, 2023-2025
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "libfme.h"
+
+#define FMEBENCH_WAIT 1000000UL // in FME time units (i.e. 1000 s)
+
+using namespace std;
+
+int g_rounds = 200, g_msgs = 2000, g_size = 256;
+string g_dir = "/tmp";
+
+static double now_us()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (double)ts.tv_sec * 1e6 + (double)ts.tv_nsec / 1e3;
+}
+
+static int receive(const char* name, vector<char>& buf)
+{
+    for (;;) {
+        if (!fme_waitfor_blocking(name,FMEBENCH_WAIT)) continue;
+        int r = fme_receive_msg(name,buf.data(),buf.size());
+        if (r > 0) return r;
+    }
+}
+
+static void child(const char* to, const char* back)
+{
+    vector<char> buf(g_size);
+
+    // echo the ping-pong messages back
+    for (int i = 0; i < g_rounds; i++) {
+        int n = receive(to,buf);
+        fme_send_msg(back,buf.data(),n,FME_SEND_QUEUE_WAIT);
+    }
+
+    // swallow the stream, then acknowledge
+    for (int i = 0; i < g_msgs; i++) receive(to,buf);
+    fme_send_msg(back,"done",4,FME_SEND_QUEUE_WAIT);
+}
+
+static void run(bool shm)
+{
+    string to = g_dir + "/fmebench_" + to_string(getpid()) + "_to";
+    string back = g_dir + "/fmebench_" + to_string(getpid()) + "_back";
+
+    if (shm) {
+        if (!fme_init_shm(to.c_str(),0) || !fme_init_shm(back.c_str(),0)) {
+            fprintf(stderr,"Unable to create shared memory rings\n");
+            return;
+        }
+    } else {
+        fme_init(to.c_str());
+        fme_init(back.c_str());
+    }
+
+    pid_t pid = fork();
+    if (!pid) {
+        child(to.c_str(),back.c_str());
+        _exit(0);
+    }
+
+    vector<char> buf(g_size,'x');
+    vector<double> rtt;
+
+    for (int i = 0; i < g_rounds; i++) {
+        double t = now_us();
+        fme_send_msg(to.c_str(),buf.data(),buf.size(),FME_SEND_QUEUE_WAIT);
+        receive(back.c_str(),buf);
+        rtt.push_back(now_us() - t);
+    }
+
+    double t = now_us();
+    for (int i = 0; i < g_msgs; i++) fme_send_msg(to.c_str(),buf.data(),buf.size(),FME_SEND_QUEUE_WAIT);
+    receive(back.c_str(),buf);
+    t = (now_us() - t) / 1e6;
+
+    waitpid(pid,NULL,0);
+    if (shm) {
+        fme_close_shm(to.c_str());
+        fme_close_shm(back.c_str());
+    }
+
+    sort(rtt.begin(),rtt.end());
+    double mean = 0;
+    for (auto i : rtt) mean += i;
+    mean /= rtt.size();
+
+    printf("%-6s round trip: mean %9.1f us, p50 %9.1f us, p99 %9.1f us | stream: %9.0f msg/s, %8.2f MB/s\n",
+           shm? "shm" : "file",mean,rtt[rtt.size()/2],rtt[rtt.size()*99/100],
+           g_msgs / t,(double)g_msgs * g_size / t / 1048576.0);
+}
+
+int main(int argc, char* argv[])
+{
+    int opt;
+    while ((opt = getopt(argc,argv,"r:n:s:d:")) != -1) {
+        switch (opt) {
+        case 'r': g_rounds = atoi(optarg); break;
+        case 'n': g_msgs = atoi(optarg); break;
+        case 's': g_size = atoi(optarg); break;
+        case 'd': g_dir = optarg; break;
+        default:
+            fprintf(stderr,"Usage: %s [-r round_trips] [-n stream_messages] [-s message_size] [-d directory]\n",argv[0]);
+            return -1;
+        }
+    }
+    if (g_rounds < 1 || g_msgs < 1 || g_size < 1) return -1;
+
+    printf("%d round trips, %d stream messages of %d bytes\n",g_rounds,g_msgs,g_size);
+    run(false);
+    run(true);
+    return 0;
+}
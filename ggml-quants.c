@@ -51,6 +51,17 @@
 
 #define MM256_SET_M128I(a, b) _mm256_insertf128_si256(_mm256_castsi128_si256(b), (a), 1)
 
+// 256-bit VNNI: AVX-VNNI (VEX) or AVX512-VNNI with AVX512VL (EVEX), the results are the same
+#if defined(__AVX512VNNI__) && defined(__AVX512VL__)
+#define GGML_VNNI_256
+#define ggml_mm256_dpbusd(acc, a, b) _mm256_dpbusd_epi32(acc, a, b)
+#define ggml_mm256_dpwssd(acc, a, b) _mm256_dpwssd_epi32(acc, a, b)
+#elif defined(__AVXVNNI__)
+#define GGML_VNNI_256
+#define ggml_mm256_dpbusd(acc, a, b) _mm256_dpbusd_avx_epi32(acc, a, b)
+#define ggml_mm256_dpwssd(acc, a, b) _mm256_dpwssd_avx_epi32(acc, a, b)
+#endif
+
 #if defined(__AVX__) || defined(__AVX2__) || defined(__AVX512F__) || defined(__SSSE3__)
 // multiply int8_t, add results pairwise twice
 static inline __m128i mul_sum_i8_pairs(const __m128i x, const __m128i y) {
@@ -123,9 +134,10 @@ static inline __m256 sum_i16_pairs_float(const __m256i x) {
 }
 
 static inline __m256 mul_sum_us8_pairs_float(const __m256i ax, const __m256i sy) {
-#if __AVXVNNI__
+#ifdef GGML_VNNI_256
+    // maddubs can't saturate here, as the values are at most 127 by magnitude, so it's exactly the same sum
     const __m256i zero = _mm256_setzero_si256();
-    const __m256i summed_pairs = _mm256_dpbusd_epi32(zero, ax, sy);
+    const __m256i summed_pairs = ggml_mm256_dpbusd(zero, ax, sy);
     return _mm256_cvtepi32_ps(summed_pairs);
 #else
     // Perform multiplication and create 16-bit values
@@ -6412,14 +6424,21 @@ void ggml_vec_dot_q4_K_q8_K(const int n, float * restrict s, const void * restri
 
             const __m256i q8l = _mm256_loadu_si256((const __m256i*)q8); q8 += 32;
             __m256i p16l = _mm256_maddubs_epi16(q4l, q8l);
-            p16l = _mm256_madd_epi16(scale_l, p16l);
 
             const __m256i q8h = _mm256_loadu_si256((const __m256i*)q8); q8 += 32;
             __m256i p16h = _mm256_maddubs_epi16(q4h, q8h);
+
+#ifdef GGML_VNNI_256
+            // scaling and accumulation in one go, the integer sums are exactly the same
+            sumi = ggml_mm256_dpwssd(sumi, scale_l, p16l);
+            sumi = ggml_mm256_dpwssd(sumi, scale_h, p16h);
+#else
+            p16l = _mm256_madd_epi16(scale_l, p16l);
             p16h = _mm256_madd_epi16(scale_h, p16h);
             const __m256i sumj = _mm256_add_epi32(p16l, p16h);
 
             sumi = _mm256_add_epi32(sumi, sumj);
+#endif
         }
 
         __m256 vd = _mm256_set1_ps(d);
@@ -7042,10 +7061,15 @@ void ggml_vec_dot_q5_K_q8_K(const int n, float * restrict s, const void * restri
             __m256i p16_0 = _mm256_maddubs_epi16(q5_0, q8_0);
             __m256i p16_1 = _mm256_maddubs_epi16(q5_1, q8_1);
 
+#ifdef GGML_VNNI_256
+            sumi = ggml_mm256_dpwssd(sumi, scale_0, p16_0);
+            sumi = ggml_mm256_dpwssd(sumi, scale_1, p16_1);
+#else
             p16_0 = _mm256_madd_epi16(scale_0, p16_0);
             p16_1 = _mm256_madd_epi16(scale_1, p16_1);
 
             sumi = _mm256_add_epi32(sumi, _mm256_add_epi32(p16_0, p16_1));
+#endif
 
         }
 
@@ -7742,6 +7766,12 @@ void ggml_vec_dot_q6_K_q8_K(const int n, float * restrict s, const void * restri
             p16_2 = _mm256_sub_epi16(p16_2, q8s_2);
             p16_3 = _mm256_sub_epi16(p16_3, q8s_3);
 
+#ifdef GGML_VNNI_256
+            sumi = ggml_mm256_dpwssd(sumi, _mm256_cvtepi8_epi16(scale_0), p16_0);
+            sumi = ggml_mm256_dpwssd(sumi, _mm256_cvtepi8_epi16(scale_1), p16_1);
+            sumi = ggml_mm256_dpwssd(sumi, _mm256_cvtepi8_epi16(scale_2), p16_2);
+            sumi = ggml_mm256_dpwssd(sumi, _mm256_cvtepi8_epi16(scale_3), p16_3);
+#else
             p16_0 = _mm256_madd_epi16(_mm256_cvtepi8_epi16(scale_0), p16_0);
             p16_1 = _mm256_madd_epi16(_mm256_cvtepi8_epi16(scale_1), p16_1);
             p16_2 = _mm256_madd_epi16(_mm256_cvtepi8_epi16(scale_2), p16_2);
@@ -7749,6 +7779,7 @@ void ggml_vec_dot_q6_K_q8_K(const int n, float * restrict s, const void * restri
 
             sumi = _mm256_add_epi32(sumi, _mm256_add_epi32(p16_0, p16_1));
             sumi = _mm256_add_epi32(sumi, _mm256_add_epi32(p16_2, p16_3));
+#endif
 
         }
 
@@ -8416,10 +8447,15 @@ void ggml_vec_dot_iq2_xxs_q8_K(const int n, float * restrict s, const void * res
             const __m256i dot2  = _mm256_maddubs_epi16(q2_2, q8s_2);
             const uint16_t ls1 = aux32[1] >> 28;
             const uint16_t ls2 = aux32[3] >> 28;
+#ifdef GGML_VNNI_256
+            sumi1 = ggml_mm256_dpwssd(sumi1, dot1, _mm256_set1_epi16(2*ls1+1));
+            sumi2 = ggml_mm256_dpwssd(sumi2, dot2, _mm256_set1_epi16(2*ls2+1));
+#else
             const __m256i p1 = _mm256_madd_epi16(dot1, _mm256_set1_epi16(2*ls1+1));
             const __m256i p2 = _mm256_madd_epi16(dot2, _mm256_set1_epi16(2*ls2+1));
             sumi1 = _mm256_add_epi32(sumi1, p1);
             sumi2 = _mm256_add_epi32(sumi2, p2);
+#endif
         }
 
         accumf = _mm256_fmadd_ps(_mm256_set1_ps(d), _mm256_cvtepi32_ps(_mm256_add_epi32(sumi1, sumi2)), accumf);
@@ -8627,10 +8663,17 @@ void ggml_vec_dot_iq2_xs_q8_K(const int n, float * restrict s, const void * rest
             const __m256i sc3 = _mm256_cvtepi8_epi16(_mm_shuffle_epi8(scales, get_scale_shuffle(ib32+2)));
             const __m256i sc4 = _mm256_cvtepi8_epi16(_mm_shuffle_epi8(scales, get_scale_shuffle(ib32+3)));
 
+#ifdef GGML_VNNI_256
+            sumi1 = ggml_mm256_dpwssd(sumi1, dot1, sc1);
+            sumi2 = ggml_mm256_dpwssd(sumi2, dot2, sc2);
+            sumi1 = ggml_mm256_dpwssd(sumi1, dot3, sc3);
+            sumi2 = ggml_mm256_dpwssd(sumi2, dot4, sc4);
+#else
             sumi1 = _mm256_add_epi32(sumi1, _mm256_madd_epi16(dot1, sc1));
             sumi2 = _mm256_add_epi32(sumi2, _mm256_madd_epi16(dot2, sc2));
             sumi1 = _mm256_add_epi32(sumi1, _mm256_madd_epi16(dot3, sc3));
             sumi2 = _mm256_add_epi32(sumi2, _mm256_madd_epi16(dot4, sc4));
+#endif
         }
 
         accumf = _mm256_fmadd_ps(_mm256_set1_ps(d), _mm256_cvtepi32_ps(_mm256_add_epi32(sumi1, sumi2)), accumf);
@@ -8763,10 +8806,15 @@ void ggml_vec_dot_iq3_xxs_q8_K(const int n, float * restrict s, const void * res
             const __m256i dot2  = _mm256_maddubs_epi16(q2_2, q8s_2);
             const uint16_t ls1 = aux32[0] >> 28;
             const uint16_t ls2 = aux32[1] >> 28;
+#ifdef GGML_VNNI_256
+            sumi1 = ggml_mm256_dpwssd(sumi1, dot1, _mm256_set1_epi16(2*ls1+1));
+            sumi2 = ggml_mm256_dpwssd(sumi2, dot2, _mm256_set1_epi16(2*ls2+1));
+#else
             const __m256i p1 = _mm256_madd_epi16(dot1, _mm256_set1_epi16(2*ls1+1));
             const __m256i p2 = _mm256_madd_epi16(dot2, _mm256_set1_epi16(2*ls2+1));
             sumi1 = _mm256_add_epi32(sumi1, p1);
             sumi2 = _mm256_add_epi32(sumi2, p2);
+#endif
         }
 
         accumf = _mm256_fmadd_ps(_mm256_set1_ps(d), _mm256_cvtepi32_ps(_mm256_add_epi32(sumi1, sumi2)), accumf);
@@ -9880,3 +9928,522 @@ void quantize_row_iq3_xxs_reference(const float * restrict x, block_iq3_xxs * re
     assert(k % QK_K == 0);
     quantize_row_iq3_xxs_impl(x, y, k, NULL);
 }
+
+//
+// Dot products of one x row with GGML_VEC_DOT_NC y rows (by bytes apart), used by the tiled mul_mat for batches:
+// the x blocks are loaded and unpacked once for all the columns. Every column gets exactly the same sequence
+// of operations as in the single row kernel, so the results don't depend on the batch size.
+//
+
+#ifdef GGML_HAS_VEC_DOT_X4
+
+void ggml_vec_dot_q4_0_q8_0_x4(const int n, float * restrict s, const void * restrict vx, const void * restrict vy, size_t by) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+
+    const block_q4_0 * restrict x = vx;
+    const block_q8_0 * y[GGML_VEC_DOT_NC];
+
+    __m256 acc[GGML_VEC_DOT_NC];
+    for (int c = 0; c < GGML_VEC_DOT_NC; ++c) {
+        y[c] = (const block_q8_0 *)((const char *)vy + c*by);
+        acc[c] = _mm256_setzero_ps();
+    }
+
+    for (int i = 0; i < nb; ++i) {
+        const float dx = GGML_FP16_TO_FP32(x[i].d);
+
+        __m256i bx = bytes_from_nibbles_32(x[i].qs);
+        const __m256i off = _mm256_set1_epi8( 8 );
+        bx = _mm256_sub_epi8( bx, off );
+
+        for (int c = 0; c < GGML_VEC_DOT_NC; ++c) {
+            const __m256 d = _mm256_set1_ps( dx * GGML_FP16_TO_FP32(y[c][i].d) );
+            const __m256i bq = _mm256_loadu_si256((const __m256i *)y[c][i].qs);
+            const __m256 q = mul_sum_i8_pairs_float(bx, bq);
+            acc[c] = _mm256_fmadd_ps( d, q, acc[c] );
+        }
+    }
+
+    for (int c = 0; c < GGML_VEC_DOT_NC; ++c) {
+        s[c] = hsum_float_8(acc[c]);
+    }
+}
+
+void ggml_vec_dot_q8_0_q8_0_x4(const int n, float * restrict s, const void * restrict vx, const void * restrict vy, size_t by) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+
+    const block_q8_0 * restrict x = vx;
+    const block_q8_0 * y[GGML_VEC_DOT_NC];
+
+    __m256 acc[GGML_VEC_DOT_NC];
+    for (int c = 0; c < GGML_VEC_DOT_NC; ++c) {
+        y[c] = (const block_q8_0 *)((const char *)vy + c*by);
+        acc[c] = _mm256_setzero_ps();
+    }
+
+    for (int i = 0; i < nb; ++i) {
+        const float dx = GGML_FP16_TO_FP32(x[i].d);
+        const __m256i bx = _mm256_loadu_si256((const __m256i *)x[i].qs);
+
+        for (int c = 0; c < GGML_VEC_DOT_NC; ++c) {
+            const __m256 d = _mm256_set1_ps(dx * GGML_FP16_TO_FP32(y[c][i].d));
+            const __m256i bq = _mm256_loadu_si256((const __m256i *)y[c][i].qs);
+            const __m256 q = mul_sum_i8_pairs_float(bx, bq);
+            acc[c] = _mm256_fmadd_ps( d, q, acc[c] );
+        }
+    }
+
+    for (int c = 0; c < GGML_VEC_DOT_NC; ++c) {
+        s[c] = hsum_float_8(acc[c]);
+    }
+}
+
+void ggml_vec_dot_q4_K_q8_K_x4(const int n, float * restrict s, const void * restrict vx, const void * restrict vy, size_t by) {
+    assert(n % QK_K == 0);
+
+    const block_q4_K * restrict x = vx;
+    const block_q8_K * y[GGML_VEC_DOT_NC];
+
+    const int nb = n / QK_K;
+
+    static const uint32_t kmask1 = 0x3f3f3f3f;
+    static const uint32_t kmask2 = 0x0f0f0f0f;
+    static const uint32_t kmask3 = 0x03030303;
+
+    uint32_t utmp[4];
+
+    const __m256i m4 = _mm256_set1_epi8(0xF);
+
+    __m256 acc[GGML_VEC_DOT_NC];
+    __m128 acc_m[GGML_VEC_DOT_NC];
+    for (int c = 0; c < GGML_VEC_DOT_NC; ++c) {
+        y[c] = (const block_q8_K *)((const char *)vy + c*by);
+        acc[c] = _mm256_setzero_ps();
+        acc_m[c] = _mm_setzero_ps();
+    }
+
+    for (int i = 0; i < nb; ++i) {
+
+        const float xd = GGML_FP16_TO_FP32(x[i].d);
+        const float xdmin = GGML_FP16_TO_FP32(x[i].dmin);
+
+        memcpy(utmp, x[i].scales, 12);
+        utmp[3] = ((utmp[2] >> 4) & kmask2) | (((utmp[1] >> 6) & kmask3) << 4);
+        const uint32_t uaux = utmp[1] & kmask1;
+        utmp[1] = (utmp[2] & kmask2) | (((utmp[0] >> 6) & kmask3) << 4);
+        utmp[2] = uaux;
+        utmp[0] &= kmask1;
+
+        const __m256i mins_and_scales = _mm256_cvtepu8_epi16(_mm_set_epi32(utmp[3], utmp[2], utmp[1], utmp[0]));
+        const __m128i mins = _mm256_extracti128_si256(mins_and_scales, 1);
+
+        __m256i sumi[GGML_VEC_DOT_NC];
+        for (int c = 0; c < GGML_VEC_DOT_NC; ++c) {
+            const float dmin = -y[c][i].d * xdmin;
+            const __m256i q8sums = _mm256_loadu_si256((const __m256i*)y[c][i].bsums);
+            const __m128i q8s = _mm_hadd_epi16(_mm256_extracti128_si256(q8sums, 0), _mm256_extracti128_si256(q8sums, 1));
+            const __m128i prod = _mm_madd_epi16(mins, q8s);
+            acc_m[c] = _mm_fmadd_ps(_mm_set1_ps(dmin), _mm_cvtepi32_ps(prod), acc_m[c]);
+            sumi[c] = _mm256_setzero_si256();
+        }
+
+        const __m128i sc128  = _mm256_extracti128_si256(mins_and_scales, 0);
+        const __m256i scales = MM256_SET_M128I(sc128, sc128);
+
+        const uint8_t * restrict q4 = x[i].qs;
+
+        for (int j = 0; j < QK_K/64; ++j) {
+
+            const __m256i scale_l = _mm256_shuffle_epi8(scales, get_scale_shuffle_k4(2*j+0));
+            const __m256i scale_h = _mm256_shuffle_epi8(scales, get_scale_shuffle_k4(2*j+1));
+
+            const __m256i q4bits = _mm256_loadu_si256((const __m256i*)q4); q4 += 32;
+            const __m256i q4l = _mm256_and_si256(q4bits, m4);
+            const __m256i q4h = _mm256_and_si256(_mm256_srli_epi16(q4bits, 4), m4);
+
+            for (int c = 0; c < GGML_VEC_DOT_NC; ++c) {
+                const int8_t * restrict q8 = y[c][i].qs + 64*j;
+
+                const __m256i q8l = _mm256_loadu_si256((const __m256i*)q8);
+                __m256i p16l = _mm256_maddubs_epi16(q4l, q8l);
+
+                const __m256i q8h = _mm256_loadu_si256((const __m256i*)(q8 + 32));
+                __m256i p16h = _mm256_maddubs_epi16(q4h, q8h);
+
+#ifdef GGML_VNNI_256
+                sumi[c] = ggml_mm256_dpwssd(sumi[c], scale_l, p16l);
+                sumi[c] = ggml_mm256_dpwssd(sumi[c], scale_h, p16h);
+#else
+                p16l = _mm256_madd_epi16(scale_l, p16l);
+                p16h = _mm256_madd_epi16(scale_h, p16h);
+                sumi[c] = _mm256_add_epi32(sumi[c], _mm256_add_epi32(p16l, p16h));
+#endif
+            }
+        }
+
+        for (int c = 0; c < GGML_VEC_DOT_NC; ++c) {
+            const float d = y[c][i].d * xd;
+            acc[c] = _mm256_fmadd_ps(_mm256_set1_ps(d), _mm256_cvtepi32_ps(sumi[c]), acc[c]);
+        }
+    }
+
+    for (int c = 0; c < GGML_VEC_DOT_NC; ++c) {
+        __m128 am = _mm_add_ps(acc_m[c], _mm_movehl_ps(acc_m[c], acc_m[c]));
+        am = _mm_add_ss(am, _mm_movehdup_ps(am));
+        s[c] = hsum_float_8(acc[c]) + _mm_cvtss_f32(am);
+    }
+}
+
+void ggml_vec_dot_q5_K_q8_K_x4(const int n, float * restrict s, const void * restrict vx, const void * restrict vy, size_t by) {
+    assert(n % QK_K == 0);
+
+    const block_q5_K * restrict x = vx;
+    const block_q8_K * y[GGML_VEC_DOT_NC];
+
+    const int nb = n / QK_K;
+
+    static const uint32_t kmask1 = 0x3f3f3f3f;
+    static const uint32_t kmask2 = 0x0f0f0f0f;
+    static const uint32_t kmask3 = 0x03030303;
+
+    uint32_t utmp[4];
+
+    const __m256i m4 = _mm256_set1_epi8(0xF);
+    const __m128i mzero = _mm_setzero_si128();
+    const __m256i mone  = _mm256_set1_epi8(1);
+
+    __m256 acc[GGML_VEC_DOT_NC];
+    float summs[GGML_VEC_DOT_NC];
+    for (int c = 0; c < GGML_VEC_DOT_NC; ++c) {
+        y[c] = (const block_q8_K *)((const char *)vy + c*by);
+        acc[c] = _mm256_setzero_ps();
+        summs[c] = 0.f;
+    }
+
+    for (int i = 0; i < nb; ++i) {
+
+        const float xd = GGML_FP16_TO_FP32(x[i].d);
+        const float xdmin = GGML_FP16_TO_FP32(x[i].dmin);
+
+        memcpy(utmp, x[i].scales, 12);
+        utmp[3] = ((utmp[2] >> 4) & kmask2) | (((utmp[1] >> 6) & kmask3) << 4);
+        const uint32_t uaux = utmp[1] & kmask1;
+        utmp[1] = (utmp[2] & kmask2) | (((utmp[0] >> 6) & kmask3) << 4);
+        utmp[2] = uaux;
+        utmp[0] &= kmask1;
+
+        const __m256i mins_and_scales = _mm256_cvtepu8_epi16(_mm_set_epi32(utmp[3], utmp[2], utmp[1], utmp[0]));
+        const __m128i mins = _mm256_extracti128_si256(mins_and_scales, 1);
+
+        __m256i sumi[GGML_VEC_DOT_NC];
+        for (int c = 0; c < GGML_VEC_DOT_NC; ++c) {
+            const float dmin = -y[c][i].d * xdmin;
+            const __m256i q8sums = _mm256_loadu_si256((const __m256i*)y[c][i].bsums);
+            const __m128i q8s = _mm_hadd_epi16(_mm256_extracti128_si256(q8sums, 0), _mm256_extracti128_si256(q8sums, 1));
+            const __m128i prod = _mm_madd_epi16(mins, q8s);
+            const __m128i hsum = _mm_hadd_epi32(_mm_hadd_epi32(prod, mzero), mzero);
+            summs[c] += dmin * _mm_extract_epi32(hsum, 0);
+            sumi[c] = _mm256_setzero_si256();
+        }
+
+        const __m128i sc128  = _mm256_extracti128_si256(mins_and_scales, 0);
+        const __m256i scales = MM256_SET_M128I(sc128, sc128);
+
+        const uint8_t * restrict q5 = x[i].qs;
+        const __m256i hbits = _mm256_loadu_si256((const __m256i*)x[i].qh);
+        __m256i hmask = mone;
+
+        int bit = 0;
+
+        for (int j = 0; j < QK_K/64; ++j) {
+
+            const __m256i scale_0 = _mm256_shuffle_epi8(scales, get_scale_shuffle_k4(2*j+0));
+            const __m256i scale_1 = _mm256_shuffle_epi8(scales, get_scale_shuffle_k4(2*j+1));
+
+            const __m256i q5bits = _mm256_loadu_si256((const __m256i*)q5); q5 += 32;
+
+            const __m256i q5l_0 = _mm256_and_si256(q5bits, m4);
+            const __m256i q5h_0 = _mm256_slli_epi16(_mm256_srli_epi16(_mm256_and_si256(hbits, hmask), bit++), 4);
+            const __m256i q5_0  = _mm256_add_epi8(q5l_0, q5h_0);
+            hmask = _mm256_slli_epi16(hmask, 1);
+
+            const __m256i q5l_1 = _mm256_and_si256(_mm256_srli_epi16(q5bits, 4), m4);
+            const __m256i q5h_1 = _mm256_slli_epi16(_mm256_srli_epi16(_mm256_and_si256(hbits, hmask), bit++), 4);
+            const __m256i q5_1  = _mm256_add_epi8(q5l_1, q5h_1);
+            hmask = _mm256_slli_epi16(hmask, 1);
+
+            for (int c = 0; c < GGML_VEC_DOT_NC; ++c) {
+                const int8_t * restrict q8 = y[c][i].qs + 64*j;
+
+                const __m256i q8_0 = _mm256_loadu_si256((const __m256i*)q8);
+                const __m256i q8_1 = _mm256_loadu_si256((const __m256i*)(q8 + 32));
+
+                __m256i p16_0 = _mm256_maddubs_epi16(q5_0, q8_0);
+                __m256i p16_1 = _mm256_maddubs_epi16(q5_1, q8_1);
+
+#ifdef GGML_VNNI_256
+                sumi[c] = ggml_mm256_dpwssd(sumi[c], scale_0, p16_0);
+                sumi[c] = ggml_mm256_dpwssd(sumi[c], scale_1, p16_1);
+#else
+                p16_0 = _mm256_madd_epi16(scale_0, p16_0);
+                p16_1 = _mm256_madd_epi16(scale_1, p16_1);
+                sumi[c] = _mm256_add_epi32(sumi[c], _mm256_add_epi32(p16_0, p16_1));
+#endif
+            }
+        }
+
+        for (int c = 0; c < GGML_VEC_DOT_NC; ++c) {
+            const float d = y[c][i].d * xd;
+            acc[c] = _mm256_fmadd_ps(_mm256_set1_ps(d), _mm256_cvtepi32_ps(sumi[c]), acc[c]);
+        }
+    }
+
+    for (int c = 0; c < GGML_VEC_DOT_NC; ++c) {
+        s[c] = hsum_float_8(acc[c]) + summs[c];
+    }
+}
+
+void ggml_vec_dot_q6_K_q8_K_x4(const int n, float * restrict s, const void * restrict vx, const void * restrict vy, size_t by) {
+    assert(n % QK_K == 0);
+
+    const block_q6_K * restrict x = vx;
+    const block_q8_K * y[GGML_VEC_DOT_NC];
+
+    const int nb = n / QK_K;
+
+    const __m256i m4 = _mm256_set1_epi8(0xF);
+    const __m256i m2 = _mm256_set1_epi8(3);
+    const __m256i m32s = _mm256_set1_epi8(32);
+
+    __m256 acc[GGML_VEC_DOT_NC];
+    for (int c = 0; c < GGML_VEC_DOT_NC; ++c) {
+        y[c] = (const block_q8_K *)((const char *)vy + c*by);
+        acc[c] = _mm256_setzero_ps();
+    }
+
+    for (int i = 0; i < nb; ++i) {
+
+        const float xd = GGML_FP16_TO_FP32(x[i].d);
+
+        const uint8_t * restrict q4 = x[i].ql;
+        const uint8_t * restrict qh = x[i].qh;
+
+        const __m128i scales = _mm_loadu_si128((const __m128i*)x[i].scales);
+
+        __m256i sumi[GGML_VEC_DOT_NC];
+        for (int c = 0; c < GGML_VEC_DOT_NC; ++c) {
+            sumi[c] = _mm256_setzero_si256();
+        }
+
+        int is = 0;
+
+        for (int j = 0; j < QK_K/128; ++j) {
+
+            const __m256i scale_0 = _mm256_cvtepi8_epi16(_mm_shuffle_epi8(scales, get_scale_shuffle(is + 0)));
+            const __m256i scale_1 = _mm256_cvtepi8_epi16(_mm_shuffle_epi8(scales, get_scale_shuffle(is + 1)));
+            const __m256i scale_2 = _mm256_cvtepi8_epi16(_mm_shuffle_epi8(scales, get_scale_shuffle(is + 2)));
+            const __m256i scale_3 = _mm256_cvtepi8_epi16(_mm_shuffle_epi8(scales, get_scale_shuffle(is + 3)));
+            is += 4;
+
+            const __m256i q4bits1 = _mm256_loadu_si256((const __m256i*)q4); q4 += 32;
+            const __m256i q4bits2 = _mm256_loadu_si256((const __m256i*)q4); q4 += 32;
+            const __m256i q4bitsH = _mm256_loadu_si256((const __m256i*)qh); qh += 32;
+
+            const __m256i q4h_0 = _mm256_slli_epi16(_mm256_and_si256(q4bitsH, m2), 4);
+            const __m256i q4h_1 = _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(q4bitsH, 2), m2), 4);
+            const __m256i q4h_2 = _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(q4bitsH, 4), m2), 4);
+            const __m256i q4h_3 = _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(q4bitsH, 6), m2), 4);
+
+            const __m256i q4_0 = _mm256_or_si256(_mm256_and_si256(q4bits1, m4), q4h_0);
+            const __m256i q4_1 = _mm256_or_si256(_mm256_and_si256(q4bits2, m4), q4h_1);
+            const __m256i q4_2 = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(q4bits1, 4), m4), q4h_2);
+            const __m256i q4_3 = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(q4bits2, 4), m4), q4h_3);
+
+            for (int c = 0; c < GGML_VEC_DOT_NC; ++c) {
+                const int8_t * restrict q8 = y[c][i].qs + 128*j;
+
+                const __m256i q8_0 = _mm256_loadu_si256((const __m256i*)(q8 +  0));
+                const __m256i q8_1 = _mm256_loadu_si256((const __m256i*)(q8 + 32));
+                const __m256i q8_2 = _mm256_loadu_si256((const __m256i*)(q8 + 64));
+                const __m256i q8_3 = _mm256_loadu_si256((const __m256i*)(q8 + 96));
+
+                __m256i p16_0 = _mm256_sub_epi16(_mm256_maddubs_epi16(q4_0, q8_0), _mm256_maddubs_epi16(m32s, q8_0));
+                __m256i p16_1 = _mm256_sub_epi16(_mm256_maddubs_epi16(q4_1, q8_1), _mm256_maddubs_epi16(m32s, q8_1));
+                __m256i p16_2 = _mm256_sub_epi16(_mm256_maddubs_epi16(q4_2, q8_2), _mm256_maddubs_epi16(m32s, q8_2));
+                __m256i p16_3 = _mm256_sub_epi16(_mm256_maddubs_epi16(q4_3, q8_3), _mm256_maddubs_epi16(m32s, q8_3));
+
+#ifdef GGML_VNNI_256
+                sumi[c] = ggml_mm256_dpwssd(sumi[c], scale_0, p16_0);
+                sumi[c] = ggml_mm256_dpwssd(sumi[c], scale_1, p16_1);
+                sumi[c] = ggml_mm256_dpwssd(sumi[c], scale_2, p16_2);
+                sumi[c] = ggml_mm256_dpwssd(sumi[c], scale_3, p16_3);
+#else
+                p16_0 = _mm256_madd_epi16(scale_0, p16_0);
+                p16_1 = _mm256_madd_epi16(scale_1, p16_1);
+                p16_2 = _mm256_madd_epi16(scale_2, p16_2);
+                p16_3 = _mm256_madd_epi16(scale_3, p16_3);
+
+                sumi[c] = _mm256_add_epi32(sumi[c], _mm256_add_epi32(p16_0, p16_1));
+                sumi[c] = _mm256_add_epi32(sumi[c], _mm256_add_epi32(p16_2, p16_3));
+#endif
+            }
+        }
+
+        for (int c = 0; c < GGML_VEC_DOT_NC; ++c) {
+            const float d = y[c][i].d * xd;
+            acc[c] = _mm256_fmadd_ps(_mm256_broadcast_ss(&d), _mm256_cvtepi32_ps(sumi[c]), acc[c]);
+        }
+    }
+
+    for (int c = 0; c < GGML_VEC_DOT_NC; ++c) {
+        s[c] = hsum_float_8(acc[c]);
+    }
+}
+
+#endif // GGML_HAS_VEC_DOT_X4
+
+#ifdef GGML_QUANTS_ISA
+
+#if defined(__AVX2__) && defined(__FMA__) && defined(__F16C__)
+// The F32/F16 vector code of ggml.c is built for the baseline ISA only, so the dot products and
+// conversions the matrix multiplications and the attention are built on are also provided here
+
+static void ggml_isa_vec_dot_f32(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    const float * restrict x = vx;
+    const float * restrict y = vy;
+    float sumf;
+    int i = 0;
+
+#if defined(__AVX512F__)
+    __m512 acc[4] = { _mm512_setzero_ps(), _mm512_setzero_ps(), _mm512_setzero_ps(), _mm512_setzero_ps() };
+    for (; i + 63 < n; i += 64) {
+        for (int j = 0; j < 4; ++j) {
+            acc[j] = _mm512_fmadd_ps(_mm512_loadu_ps(x + i + j*16), _mm512_loadu_ps(y + i + j*16), acc[j]);
+        }
+    }
+    for (; i + 15 < n; i += 16) {
+        acc[0] = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i), acc[0]);
+    }
+    sumf = _mm512_reduce_add_ps(_mm512_add_ps(_mm512_add_ps(acc[0], acc[1]), _mm512_add_ps(acc[2], acc[3])));
+#else
+    __m256 acc[4] = { _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps() };
+    for (; i + 31 < n; i += 32) {
+        for (int j = 0; j < 4; ++j) {
+            acc[j] = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + j*8), _mm256_loadu_ps(y + i + j*8), acc[j]);
+        }
+    }
+    for (; i + 7 < n; i += 8) {
+        acc[0] = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), acc[0]);
+    }
+    sumf = hsum_float_8(_mm256_add_ps(_mm256_add_ps(acc[0], acc[1]), _mm256_add_ps(acc[2], acc[3])));
+#endif
+
+    for (; i < n; ++i) {
+        sumf += x[i]*y[i];
+    }
+    *s = sumf;
+}
+
+static void ggml_isa_vec_dot_f16(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    const ggml_fp16_t * restrict x = vx;
+    const ggml_fp16_t * restrict y = vy;
+    float sumf;
+    int i = 0;
+
+#if defined(__AVX512F__)
+    __m512 acc[4] = { _mm512_setzero_ps(), _mm512_setzero_ps(), _mm512_setzero_ps(), _mm512_setzero_ps() };
+    for (; i + 63 < n; i += 64) {
+        for (int j = 0; j < 4; ++j) {
+            const __m512 ax = _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *)(x + i + j*16)));
+            const __m512 ay = _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *)(y + i + j*16)));
+            acc[j] = _mm512_fmadd_ps(ax, ay, acc[j]);
+        }
+    }
+    for (; i + 15 < n; i += 16) {
+        const __m512 ax = _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *)(x + i)));
+        const __m512 ay = _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *)(y + i)));
+        acc[0] = _mm512_fmadd_ps(ax, ay, acc[0]);
+    }
+    sumf = _mm512_reduce_add_ps(_mm512_add_ps(_mm512_add_ps(acc[0], acc[1]), _mm512_add_ps(acc[2], acc[3])));
+#else
+    __m256 acc[4] = { _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps() };
+    for (; i + 31 < n; i += 32) {
+        for (int j = 0; j < 4; ++j) {
+            const __m256 ax = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(x + i + j*8)));
+            const __m256 ay = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(y + i + j*8)));
+            acc[j] = _mm256_fmadd_ps(ax, ay, acc[j]);
+        }
+    }
+    for (; i + 7 < n; i += 8) {
+        const __m256 ax = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(x + i)));
+        const __m256 ay = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(y + i)));
+        acc[0] = _mm256_fmadd_ps(ax, ay, acc[0]);
+    }
+    sumf = hsum_float_8(_mm256_add_ps(_mm256_add_ps(acc[0], acc[1]), _mm256_add_ps(acc[2], acc[3])));
+#endif
+
+    for (; i < n; ++i) {
+        sumf += GGML_FP16_TO_FP32(x[i])*GGML_FP16_TO_FP32(y[i]);
+    }
+    *s = sumf;
+}
+
+static void ggml_isa_fp16_to_fp32_row(const void * restrict vx, float * restrict y, int n) {
+    const ggml_fp16_t * restrict x = vx;
+    int i = 0;
+    for (; i + 7 < n; i += 8) {
+        _mm256_storeu_ps(y + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(x + i))));
+    }
+    for (; i < n; ++i) {
+        y[i] = GGML_FP16_TO_FP32(x[i]);
+    }
+}
+
+static void ggml_isa_fp32_to_fp16_row(const float * restrict x, void * restrict vy, int n) {
+    ggml_fp16_t * restrict y = vy;
+    int i = 0;
+    for (; i + 7 < n; i += 8) {
+        _mm_storeu_si128((__m128i *)(y + i), _mm256_cvtps_ph(_mm256_loadu_ps(x + i), _MM_FROUND_TO_NEAREST_INT));
+    }
+    for (; i < n; ++i) {
+        y[i] = GGML_FP32_TO_FP16(x[i]);
+    }
+}
+
+#define GGML_ISA_VEC(x) ggml_isa_ ## x
+#else
+#define GGML_ISA_VEC(x) NULL
+#endif
+
+// Only the kernels which don't depend on the runtime-initialized grids (iq2xs_init_impl() etc.)
+// are taken from an ISA variant, as the variant has its own (never initialized) copy of them.
+#define GGML_QUANTS_KERNELS_CAT(x) ggml_quants_kernels_ ## x
+#define GGML_QUANTS_KERNELS(x) GGML_QUANTS_KERNELS_CAT(x)
+
+const ggml_quants_kernel GGML_QUANTS_KERNELS(GGML_QUANTS_ISA)[] = {
+    { GGML_TYPE_F32,     NULL,                                     NULL,              GGML_ISA_VEC(vec_dot_f32), NULL },
+    { GGML_TYPE_F16,     GGML_ISA_VEC(fp16_to_fp32_row),           GGML_ISA_VEC(fp32_to_fp16_row), GGML_ISA_VEC(vec_dot_f16), NULL },
+    { GGML_TYPE_Q4_0,    (ggml_to_float_t) dequantize_row_q4_0,    quantize_row_q4_0, ggml_vec_dot_q4_0_q8_0,    GGML_VEC_DOT_X4(ggml_vec_dot_q4_0_q8_0_x4) },
+    { GGML_TYPE_Q4_1,    (ggml_to_float_t) dequantize_row_q4_1,    quantize_row_q4_1, ggml_vec_dot_q4_1_q8_1,    NULL },
+    { GGML_TYPE_Q5_0,    (ggml_to_float_t) dequantize_row_q5_0,    quantize_row_q5_0, ggml_vec_dot_q5_0_q8_0,    NULL },
+    { GGML_TYPE_Q5_1,    (ggml_to_float_t) dequantize_row_q5_1,    quantize_row_q5_1, ggml_vec_dot_q5_1_q8_1,    NULL },
+    { GGML_TYPE_Q8_0,    (ggml_to_float_t) dequantize_row_q8_0,    quantize_row_q8_0, ggml_vec_dot_q8_0_q8_0,    GGML_VEC_DOT_X4(ggml_vec_dot_q8_0_q8_0_x4) },
+    { GGML_TYPE_Q8_1,    NULL,                                     quantize_row_q8_1, NULL,                      NULL },
+    { GGML_TYPE_Q2_K,    (ggml_to_float_t) dequantize_row_q2_K,    quantize_row_q2_K, ggml_vec_dot_q2_K_q8_K,    NULL },
+    { GGML_TYPE_Q3_K,    (ggml_to_float_t) dequantize_row_q3_K,    quantize_row_q3_K, ggml_vec_dot_q3_K_q8_K,    NULL },
+    { GGML_TYPE_Q4_K,    (ggml_to_float_t) dequantize_row_q4_K,    quantize_row_q4_K, ggml_vec_dot_q4_K_q8_K,    GGML_VEC_DOT_X4(ggml_vec_dot_q4_K_q8_K_x4) },
+    { GGML_TYPE_Q5_K,    (ggml_to_float_t) dequantize_row_q5_K,    quantize_row_q5_K, ggml_vec_dot_q5_K_q8_K,    GGML_VEC_DOT_X4(ggml_vec_dot_q5_K_q8_K_x4) },
+    { GGML_TYPE_Q6_K,    (ggml_to_float_t) dequantize_row_q6_K,    quantize_row_q6_K, ggml_vec_dot_q6_K_q8_K,    GGML_VEC_DOT_X4(ggml_vec_dot_q6_K_q8_K_x4) },
+    { GGML_TYPE_IQ2_XXS, (ggml_to_float_t) dequantize_row_iq2_xxs, NULL,              ggml_vec_dot_iq2_xxs_q8_K, NULL },
+    { GGML_TYPE_IQ2_XS,  (ggml_to_float_t) dequantize_row_iq2_xs,  NULL,              ggml_vec_dot_iq2_xs_q8_K,  NULL },
+    { GGML_TYPE_IQ3_XXS, (ggml_to_float_t) dequantize_row_iq3_xxs, NULL,              ggml_vec_dot_iq3_xxs_q8_K, NULL },
+    { GGML_TYPE_Q8_K,    NULL,                                     quantize_row_q8_K, NULL,                      NULL },
+    { GGML_TYPE_COUNT,   NULL,                                     NULL,              NULL,                      NULL },
+};
+#endif
@@ -256,6 +256,20 @@ void ggml_vec_dot_iq2_xxs_q8_K(int n, float * restrict s, const void * restrict
 void ggml_vec_dot_iq2_xs_q8_K (int n, float * restrict s, const void * restrict vx, const void * restrict vy);
 void ggml_vec_dot_iq3_xxs_q8_K(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
 
+// Multi-column dot products (GGML_VEC_DOT_NC columns), for the tiled mul_mat; only AVX2 for now
+#if defined(__AVX2__) && QK_K == 256
+#define GGML_HAS_VEC_DOT_X4
+#define GGML_VEC_DOT_X4(f) f
+#else
+#define GGML_VEC_DOT_X4(f) NULL
+#endif
+
+void ggml_vec_dot_q4_0_q8_0_x4(int n, float * restrict s, const void * restrict vx, const void * restrict vy, size_t by);
+void ggml_vec_dot_q8_0_q8_0_x4(int n, float * restrict s, const void * restrict vx, const void * restrict vy, size_t by);
+void ggml_vec_dot_q4_K_q8_K_x4(int n, float * restrict s, const void * restrict vx, const void * restrict vy, size_t by);
+void ggml_vec_dot_q5_K_q8_K_x4(int n, float * restrict s, const void * restrict vx, const void * restrict vy, size_t by);
+void ggml_vec_dot_q6_K_q8_K_x4(int n, float * restrict s, const void * restrict vx, const void * restrict vy, size_t by);
+
 //
 // Quantization utilizing an importance matrix (a.k.a. "Activation aWare Quantization")
 //
@@ -276,3 +290,21 @@ void iq2xs_init_impl(int grid_size);
 void iq2xs_free_impl(int grid_size);
 void iq3xs_init_impl(int grid_size);
 void iq3xs_free_impl(int grid_size);
+
+//
+// Runtime kernel dispatch (GGML_CPU_DISPATCH builds): ggml-quants.c is also compiled for other ISAs,
+// and each variant exports a table of its hot kernels, which ggml_init() puts into the type traits
+//
+typedef struct {
+    enum ggml_type    type;         // GGML_TYPE_COUNT terminates the table
+    ggml_to_float_t   to_float;
+    ggml_from_float_t from_float;
+    ggml_vec_dot_t    vec_dot;
+    ggml_vec_dot_x4_t vec_dot_x4;
+} ggml_quants_kernel;
+
+#ifdef GGML_CPU_DISPATCH
+extern const ggml_quants_kernel ggml_quants_kernels_avx2[];
+extern const ggml_quants_kernel ggml_quants_kernels_avx512[];
+extern const ggml_quants_kernel ggml_quants_kernels_avx512vnni[];
+#endif
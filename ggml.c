@@ -155,6 +155,14 @@ void ggml_print_backtrace(void) {
 #define GGML_VEC_DOT_UNROLL  2
 #define GGML_VEC_MAD_UNROLL  32
 
+// src1 columns per tile of the multi-column mul_mat (~300 KB of Q8_K for 4096 wide rows)
+#define GGML_MUL_MAT_TILE_COLS 64
+
+// KV positions per tile of the fused attention, and the rows (heads or tokens) sharing each tile of K and V;
+// the scores of a group (128 KB) stay in L2, and the V rows are read in long enough runs for the prefetcher
+#define GGML_FLASH_ATTN_EXT_TILE 1024
+#define GGML_FLASH_ATTN_EXT_ROWS 32
+
 //
 // logging
 //
@@ -431,7 +439,12 @@ static const size_t CACHE_LINE_SIZE_F32 = CACHE_LINE_SIZE/sizeof(float);
 static void ggml_vec_dot_f32(const int n, float * restrict s, const float * restrict x, const float * restrict y);
 static void ggml_vec_dot_f16(const int n, float * restrict s, ggml_fp16_t * restrict x, ggml_fp16_t * restrict y);
 
+#ifdef GGML_CPU_DISPATCH
+// the kernels are replaced with the best ISA variant available by ggml_cpu_dispatch()
+static ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
+#else
 static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
+#endif
     [GGML_TYPE_I8] = {
         .type_name                = "i8",
         .blck_size                = 1,
@@ -479,6 +492,7 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .from_float_reference     = (ggml_from_float_t) quantize_row_q4_0_reference,
         .vec_dot                  = ggml_vec_dot_q4_0_q8_0,
         .vec_dot_type             = GGML_TYPE_Q8_0,
+        .vec_dot_x4               = GGML_VEC_DOT_X4(ggml_vec_dot_q4_0_q8_0_x4),
     },
     [GGML_TYPE_Q4_1] = {
         .type_name                = "q4_1",
@@ -545,6 +559,7 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .from_float_reference     = (ggml_from_float_t) quantize_row_q8_0_reference,
         .vec_dot                  = ggml_vec_dot_q8_0_q8_0,
         .vec_dot_type             = GGML_TYPE_Q8_0,
+        .vec_dot_x4               = GGML_VEC_DOT_X4(ggml_vec_dot_q8_0_q8_0_x4),
     },
     [GGML_TYPE_Q8_1] = {
         .type_name                = "q8_1",
@@ -587,6 +602,7 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .from_float_reference     = (ggml_from_float_t) quantize_row_q4_K_reference,
         .vec_dot                  = ggml_vec_dot_q4_K_q8_K,
         .vec_dot_type             = GGML_TYPE_Q8_K,
+        .vec_dot_x4               = GGML_VEC_DOT_X4(ggml_vec_dot_q4_K_q8_K_x4),
     },
     [GGML_TYPE_Q5_K] = {
         .type_name                = "q5_K",
@@ -598,6 +614,7 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .from_float_reference     = (ggml_from_float_t) quantize_row_q5_K_reference,
         .vec_dot                  = ggml_vec_dot_q5_K_q8_K,
         .vec_dot_type             = GGML_TYPE_Q8_K,
+        .vec_dot_x4               = GGML_VEC_DOT_X4(ggml_vec_dot_q5_K_q8_K_x4),
     },
     [GGML_TYPE_Q6_K] = {
         .type_name                = "q6_K",
@@ -609,6 +626,7 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .from_float_reference     = (ggml_from_float_t) quantize_row_q6_K_reference,
         .vec_dot                  = ggml_vec_dot_q6_K_q8_K,
         .vec_dot_type             = GGML_TYPE_Q8_K,
+        .vec_dot_x4               = GGML_VEC_DOT_X4(ggml_vec_dot_q6_K_q8_K_x4),
     },
     [GGML_TYPE_IQ2_XXS] = {
         .type_name                = "iq2_xxs",
@@ -658,6 +676,112 @@ ggml_type_traits_t ggml_internal_get_type_traits(enum ggml_type type) {
     return type_traits[type];
 }
 
+//
+// runtime kernel dispatch
+//
+
+#ifdef GGML_CPU_DISPATCH
+
+static const char * ggml_kernels_name = "base";
+
+// ordered from the best to the worst; the baseline is compiled into the type traits
+static const struct {
+    const char * name;
+    const ggml_quants_kernel * kernels;
+} ggml_kernel_variants[] = {
+    { "avx512vnni", ggml_quants_kernels_avx512vnni },
+    { "avx512", ggml_quants_kernels_avx512 },
+    { "avx2",   ggml_quants_kernels_avx2   },
+    { "base",   NULL                       },
+};
+
+static bool ggml_cpu_supports(const char * name) {
+    __builtin_cpu_init();
+    if (!strcmp(name,"avx512vnni")) {
+        return __builtin_cpu_supports("avx512vnni") && ggml_cpu_supports("avx512");
+    }
+    if (!strcmp(name,"avx512")) {
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+               __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512dq") &&
+               __builtin_cpu_supports("avx512cd") && ggml_cpu_supports("avx2");
+    }
+    if (!strcmp(name,"avx2")) {
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") &&
+               __builtin_cpu_supports("f16c") && __builtin_cpu_supports("bmi2");
+    }
+    return true;
+}
+
+// the baseline kernels, saved before the first switch
+static ggml_type_traits_t ggml_base_traits[GGML_TYPE_COUNT];
+static bool ggml_base_saved = false;
+
+static void ggml_cpu_apply_kernels(int sel) {
+    if (!ggml_base_saved) {
+        memcpy(ggml_base_traits, type_traits, sizeof(type_traits));
+        ggml_base_saved = true;
+    } else {
+        memcpy(type_traits, ggml_base_traits, sizeof(type_traits));
+    }
+
+    ggml_kernels_name = ggml_kernel_variants[sel].name;
+    const ggml_quants_kernel * k = ggml_kernel_variants[sel].kernels;
+    for (; k && k->type != GGML_TYPE_COUNT; k++) {
+        if (k->to_float)   type_traits[k->type].to_float   = k->to_float;
+        if (k->from_float) type_traits[k->type].from_float = k->from_float;
+        if (k->vec_dot)    type_traits[k->type].vec_dot    = k->vec_dot;
+        if (k->vec_dot_x4) type_traits[k->type].vec_dot_x4 = k->vec_dot_x4;
+    }
+    GGML_PRINT_DEBUG("%s: using %s kernels\n", __func__, ggml_kernels_name);
+}
+
+// called once, from the first ggml_init(); GGML_CPU_KERNELS environment variable overrides the choice
+static void ggml_cpu_dispatch(void) {
+    const int nvars = sizeof(ggml_kernel_variants) / sizeof(ggml_kernel_variants[0]);
+    const char * force = getenv("GGML_CPU_KERNELS");
+    int sel = -1;
+
+    if (force && *force) {
+        for (int i = 0; i < nvars; i++) {
+            if (strcmp(force,ggml_kernel_variants[i].name)) continue;
+            if (ggml_cpu_supports(force)) sel = i;
+            else fprintf(stderr, "%s: %s kernels are not supported by this CPU\n", __func__, force);
+            break;
+        }
+        if (sel < 0) fprintf(stderr, "%s: unable to use %s kernels, selecting automatically\n", __func__, force);
+    }
+    for (int i = 0; sel < 0 && i < nvars; i++) {
+        if (ggml_cpu_supports(ggml_kernel_variants[i].name)) sel = i;
+    }
+
+    ggml_cpu_apply_kernels(sel);
+}
+
+#endif
+
+bool ggml_cpu_set_kernels(const char * name) {
+#ifdef GGML_CPU_DISPATCH
+    const int nvars = sizeof(ggml_kernel_variants) / sizeof(ggml_kernel_variants[0]);
+    for (int i = 0; i < nvars; i++) {
+        if (strcmp(name,ggml_kernel_variants[i].name)) continue;
+        if (!ggml_cpu_supports(name)) return false;
+        ggml_cpu_apply_kernels(i);
+        return true;
+    }
+    return false;
+#else
+    return !strcmp(name,"native");
+#endif
+}
+
+const char * ggml_cpu_kernels(void) {
+#ifdef GGML_CPU_DISPATCH
+    return ggml_kernels_name;
+#else
+    return "native";
+#endif
+}
+
 //
 // simd mappings
 //
@@ -1340,6 +1464,19 @@ inline static void ggml_vec_dot_f16_unroll(const int n, const int xs, float * re
     }
 }
 
+#ifdef GGML_CPU_DISPATCH
+// from here on, the direct users of the dot products above (the attention, convolutions etc.) call the selected kernels
+#define ggml_vec_dot_f32(n, s, x, y) type_traits[GGML_TYPE_F32].vec_dot((n), (s), (x), (y))
+#define ggml_vec_dot_f16(n, s, x, y) type_traits[GGML_TYPE_F16].vec_dot((n), (s), (x), (y))
+#define ggml_vec_dot_f16_unroll(n, xs, s, xv, y) ggml_vec_dot_f16_unroll_dispatch((n), (xs), (s), (xv), (y))
+
+inline static void ggml_vec_dot_f16_unroll_dispatch(const int n, const int xs, float * restrict s, void * restrict xv, ggml_fp16_t * restrict y) {
+    for (int i = 0; i < GGML_VEC_DOT_UNROLL; ++i) {
+        ggml_vec_dot_f16(n, s + i, (ggml_fp16_t *) ((char *) xv + i*xs), y);
+    }
+}
+#endif
+
 inline static void ggml_vec_mad_f32(const int n, float * restrict y, const float * restrict x, const float v) {
 #if defined(GGML_SIMD)
     const int np = (n & ~(GGML_F32_STEP - 1));
@@ -1701,6 +1838,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "LEAKY_RELU",
 
     "FLASH_ATTN",
+    "FLASH_ATTN_EXT",
     "FLASH_FF",
     "FLASH_ATTN_BACK",
     "WIN_PART",
@@ -1725,7 +1863,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "CROSS_ENTROPY_LOSS_BACK",
 };
 
-static_assert(GGML_OP_COUNT == 72, "GGML_OP_COUNT != 72");
+static_assert(GGML_OP_COUNT == 73, "GGML_OP_COUNT != 73");
 
 static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "none",
@@ -1787,6 +1925,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "leaky_relu(x)",
 
     "flash_attn(x)",
+    "flash_attn_ext(x)",
     "flash_ff(x)",
     "flash_attn_back(x)",
     "win_part(x)",
@@ -1811,7 +1950,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "cross_entropy_loss_back(x,y)",
 };
 
-static_assert(GGML_OP_COUNT == 72, "GGML_OP_COUNT != 72");
+static_assert(GGML_OP_COUNT == 73, "GGML_OP_COUNT != 73");
 
 static_assert(GGML_OP_POOL_COUNT == 2, "GGML_OP_POOL_COUNT != 2");
 
@@ -2350,6 +2489,10 @@ struct ggml_context * ggml_init(struct ggml_init_params params) {
 
         ggml_setup_op_has_task_pass();
 
+#ifdef GGML_CPU_DISPATCH
+        ggml_cpu_dispatch();
+#endif
+
         is_first_call = false;
     }
 
@@ -5775,6 +5918,51 @@ struct ggml_tensor * ggml_flash_attn(
     return result;
 }
 
+// ggml_flash_attn_ext
+
+struct ggml_tensor * ggml_flash_attn_ext(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * q,
+        struct ggml_tensor  * k,
+        struct ggml_tensor  * v,
+        struct ggml_tensor  * mask,
+        float                 scale) {
+    GGML_ASSERT(ggml_can_mul_mat(k, q));
+    GGML_ASSERT(q->ne[2] % k->ne[2] == 0);
+    GGML_ASSERT(v->ne[0] == k->ne[1]); // v is transposed
+    GGML_ASSERT(v->ne[2] == k->ne[2]);
+    GGML_ASSERT(q->ne[3] == 1 && k->ne[3] == 1 && v->ne[3] == 1);
+    if (mask) {
+        GGML_ASSERT(mask->type == GGML_TYPE_F32);
+        GGML_ASSERT(ggml_is_contiguous(mask));
+        GGML_ASSERT(mask->ne[0] == k->ne[1]);
+        GGML_ASSERT(mask->ne[1] >= q->ne[1]);
+    }
+
+    bool is_node = false;
+
+    if (q->grad || k->grad || v->grad) {
+        GGML_ASSERT(false); // TODO: implement backward
+        is_node = true;
+    }
+
+    // the result is permuted to [D, n_head, n_tokens], so that the heads of a token are contiguous
+    const int64_t ne[4] = { v->ne[1], q->ne[2], q->ne[1], 1 };
+    struct ggml_tensor * result = ggml_new_tensor(ctx, GGML_TYPE_F32, 3, ne);
+
+    float params[] = { scale };
+    ggml_set_op_params(result, params, sizeof(params));
+
+    result->op   = GGML_OP_FLASH_ATTN_EXT;
+    result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->src[0] = q;
+    result->src[1] = k;
+    result->src[2] = v;
+    result->src[3] = mask;
+
+    return result;
+}
+
 // ggml_flash_ff
 
 struct ggml_tensor * ggml_flash_ff(
@@ -9989,6 +10177,7 @@ static void ggml_compute_forward_mul_mat(
     const bool src1_cont = ggml_is_contiguous(src1);
 
     ggml_vec_dot_t    const vec_dot               = type_traits[type].vec_dot;
+    ggml_vec_dot_x4_t const vec_dot_x4            = type_traits[type].vec_dot_x4;
     enum ggml_type    const vec_dot_type          = type_traits[type].vec_dot_type;
     ggml_from_float_t const from_float_to_vec_dot = type_traits[vec_dot_type].from_float;
 
@@ -10155,15 +10344,23 @@ static void ggml_compute_forward_mul_mat(
     assert(ne13 % ne03 == 0);
 
     // block-tiling attempt
+    // with a multi-column kernel (prompt batches), a tile of blck_0 src0 rows is reused for all the
+    // blck_1 src1 columns (which should stay in L2), GGML_VEC_DOT_NC columns per kernel call
+    const bool    tiled  = vec_dot_x4 && ir111 - ir110 >= GGML_VEC_DOT_NC;
     const int64_t blck_0 = 16;
-    const int64_t blck_1 = 16;
+    const int64_t blck_1 = tiled ? GGML_MUL_MAT_TILE_COLS : 16;
+
+    const size_t col_stride = src1_cont || src1->type != vec_dot_type ? row_size : nb11;
 
     // attempt to reduce false-sharing (does not seem to make a difference)
-    float tmp[16];
+    float tmp[16*GGML_VEC_DOT_NC];
 
     for (int64_t iir1 = ir110; iir1 < ir111; iir1 += blck_1) {
         for (int64_t iir0 = ir010; iir0 < ir011; iir0 += blck_0) {
-            for (int64_t ir1 = iir1; ir1 < iir1 + blck_1 && ir1 < ir111; ++ir1) {
+            const int64_t ir1e = MIN(iir1 + blck_1, ir111);
+            const int64_t ir0e = MIN(iir0 + blck_0, ir011);
+
+            for (int64_t ir1 = iir1; ir1 < ir1e; ) {
                 const int64_t i13 = (ir1/(ne12*ne1));
                 const int64_t i12 = (ir1 - i13*ne12*ne1)/ne1;
                 const int64_t i11 = (ir1 - i13*ne12*ne1 - i12*ne1);
@@ -10189,14 +10386,30 @@ static void ggml_compute_forward_mul_mat(
 
                 float * dst_col = (float *) ((char *) dst->data + (i1*nb1 + i2*nb2 + i3*nb3));
 
+                // the columns of one kernel call must belong to the same src1 matrix
+                if (tiled && ir1 + GGML_VEC_DOT_NC <= ir1e && i11 + GGML_VEC_DOT_NC <= ne11) {
+                    for (int64_t ir0 = iir0; ir0 < ir0e; ++ir0) {
+                        vec_dot_x4(ne00, &tmp[(ir0 - iir0)*GGML_VEC_DOT_NC], src0_row + ir0*nb01, src1_col, col_stride);
+                    }
+                    for (int64_t c = 0; c < GGML_VEC_DOT_NC; ++c) {
+                        float * d = (float *) ((char *) dst_col + c*nb1);
+                        for (int64_t ir0 = iir0; ir0 < ir0e; ++ir0) {
+                            d[ir0] = tmp[(ir0 - iir0)*GGML_VEC_DOT_NC + c];
+                        }
+                    }
+                    ir1 += GGML_VEC_DOT_NC;
+                    continue;
+                }
+
                 //for (int64_t ir0 = iir0; ir0 < iir0 + blck_0 && ir0 < ir011; ++ir0) {
                 //    vec_dot(ne00, &dst_col[ir0], src0_row + ir0*nb01, src1_col);
                 //}
 
-                for (int64_t ir0 = iir0; ir0 < iir0 + blck_0 && ir0 < ir011; ++ir0) {
+                for (int64_t ir0 = iir0; ir0 < ir0e; ++ir0) {
                     vec_dot(ne00, &tmp[ir0 - iir0], src0_row + ir0*nb01, src1_col);
                 }
-                memcpy(&dst_col[iir0], tmp, (MIN(iir0 + blck_0, ir011) - iir0)*sizeof(float));
+                memcpy(&dst_col[iir0], tmp, (ir0e - iir0)*sizeof(float));
+                ir1++;
             }
         }
     }
@@ -13552,6 +13765,217 @@ static void ggml_compute_forward_flash_attn(
     }
 }
 
+// ggml_compute_forward_flash_attn_ext
+
+static void ggml_compute_forward_flash_attn_ext_f16(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * q,
+        const struct ggml_tensor * k,
+        const struct ggml_tensor * v,
+        const struct ggml_tensor * mask,
+        struct ggml_tensor * dst) {
+    int64_t t0 = ggml_perf_time_us();
+    UNUSED(t0);
+
+    GGML_TENSOR_LOCALS(int64_t, neq, q,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbq, q,   nb)
+    GGML_TENSOR_LOCALS(int64_t, nek, k,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbk, k,   nb)
+    GGML_TENSOR_LOCALS(int64_t, nev, v,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbv, v,   nb)
+    GGML_TENSOR_LOCALS(int64_t, ne,  dst, ne)
+    GGML_TENSOR_LOCALS(size_t,  nb,  dst, nb)
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t D   = neq0; // K head size
+    const int64_t DV  = nev1; // V head size
+    const int64_t N   = neq1; // tokens
+    const int64_t H   = neq2; // query heads
+    const int64_t KV  = nek1; // KV cache positions
+
+    GGML_ASSERT(nek0 == D);
+    GGML_ASSERT(nev0 == KV);
+    GGML_ASSERT(ne0 == DV);
+    GGML_ASSERT(ne1 == H);
+    GGML_ASSERT(ne2 == N);
+
+    GGML_ASSERT(nbq0 == sizeof(float));
+    GGML_ASSERT(nbk0 == sizeof(ggml_fp16_t));
+    GGML_ASSERT(nbv0 == sizeof(ggml_fp16_t));
+    GGML_ASSERT(nb0  == sizeof(float));
+
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    float scale = 1.0f;
+    memcpy(&scale, (const float *) dst->op_params + 0, sizeof(float));
+
+    // query heads sharing one KV head
+    const int64_t rk = H/nek2;
+
+    // parallelize over the heads (the rows are head-major, so a thread gets whole heads, unless there are fewer heads than threads)
+    const int64_t nr = H*N;
+    const int64_t dr = (nr + nth - 1)/nth;
+    const int64_t ir0 = dr*ith;
+    const int64_t ir1 = MIN(ir0 + dr, nr);
+
+    // per-thread scratch (see ggml_graph_plan): the running sums and maximums, the scores of a tile,
+    // the output accumulators, the probabilities of a tile and the queries, for a group of rows
+    const int64_t T = GGML_FLASH_ATTN_EXT_TILE;
+    const int64_t R = GGML_FLASH_ATTN_EXT_ROWS;
+    const size_t  wsize = GGML_PAD(sizeof(ggml_float)*R + sizeof(float)*(R + R*T + R*DV) + sizeof(ggml_fp16_t)*(T + R*D), CACHE_LINE_SIZE);
+    ggml_float  * sum = (ggml_float *) ((char *) params->wdata + ith*wsize);
+    float       * M   = (float *) (sum + R);
+    float       * S   = M + R;
+    float       * acc = S + R*T;
+    ggml_fp16_t * P16 = (ggml_fp16_t *) (acc + R*DV);
+    ggml_fp16_t * Q16 = P16 + T;
+
+    // KV positions per block of the scores, as in ggml_compute_forward_mul_mat
+    const int64_t blck = 16;
+
+    // a tile of K and V is visited by a group of rows at once, instead of streaming the whole cache for every row:
+    // the tokens of a head share the same K and V, and for a single token the heads of a KV position are adjacent in K,
+    // so the scores are computed in small blocks of positions for all the rows of the group
+    for (int64_t ig = ir0; ig < ir1; ig += R) {
+        const int64_t nrg = MIN(R, ir1 - ig);
+
+        for (int64_t r = 0; r < nrg; ++r) {
+            const int64_t iq2 = (ig + r)/N; // head
+            const int64_t iq1 = (ig + r)%N; // token
+
+            const float * pq = (const float *) ((const char *) q->data + iq1*nbq1 + iq2*nbq2);
+            for (int64_t i = 0; i < D; ++i) {
+                Q16[r*D + i] = GGML_FP32_TO_FP16(pq[i]);
+            }
+
+            // online softmax: M is the running maximum, acc and sum are kept scaled by exp(-M)
+            M[r]   = -INFINITY;
+            sum[r] = 0.0;
+        }
+        memset(acc, 0, nrg*DV*sizeof(float));
+
+        for (int64_t j0 = 0; j0 < KV; j0 += T) {
+            const int64_t nt = MIN(T, KV - j0);
+
+            for (int64_t jb = 0; jb < nt; jb += blck) {
+                const int64_t jbe = MIN(jb + blck, nt);
+
+                for (int64_t r = 0; r < nrg; ++r) {
+                    const int64_t iq2 = (ig + r)/N;
+                    const int64_t iq1 = (ig + r)%N;
+
+                    const float * mp = mask ? (const float *) ((const char *) mask->data + iq1*mask->nb[1]) + j0 : NULL;
+                    char        * kp = (char *) k->data + (iq2/rk)*nbk2 + j0*nbk1;
+                    float       * sr = S + r*T;
+
+                    for (int64_t j = jb; j < jbe; ++j) {
+                        const float mv = mp ? mp[j] : 0.0f;
+                        if (mv == -INFINITY) {
+                            sr[j] = -INFINITY;
+                            continue;
+                        }
+                        ggml_vec_dot_f16(D, &sr[j], (ggml_fp16_t *) (kp + j*nbk1), Q16 + r*D);
+                        sr[j] = sr[j]*scale + mv;
+                    }
+                }
+            }
+
+            for (int64_t r = 0; r < nrg; ++r) {
+                const int64_t iq2 = (ig + r)/N;
+
+                char  * vp = (char *) v->data + (iq2/rk)*nbv2 + j0*nbv0;
+                float * sr = S + r*T;
+                float * ac = acc + r*DV;
+
+                float mt = -INFINITY;
+                for (int64_t j = 0; j < nt; ++j) {
+                    mt = MAX(mt, sr[j]);
+                }
+
+                if (mt == -INFINITY) {
+                    continue; // the whole tile is masked out for this row
+                }
+
+                if (mt > M[r]) {
+                    const float ms = expf(M[r] - mt);
+                    ggml_vec_scale_f32(DV, ac, ms);
+                    sum[r] *= ms;
+                    M[r] = mt;
+                }
+
+                // exp() from the FP16 table, as in the softmax
+                ggml_float st = 0.0;
+                for (int64_t j = 0; j < nt; ++j) {
+                    if (sr[j] == -INFINITY) {
+                        P16[j] = 0;
+                    } else {
+                        ggml_fp16_t s = GGML_FP32_TO_FP16(sr[j] - M[r]);
+                        uint16_t scvt;
+                        memcpy(&scvt, &s, sizeof(scvt));
+                        P16[j] = ggml_table_exp_f16[scvt];
+                        st += (ggml_float) GGML_FP16_TO_FP32(P16[j]);
+                    }
+                }
+                sum[r] += st;
+
+                // the rows of the transposed V are contiguous along the KV positions
+                int64_t id = 0;
+                for (; id + GGML_VEC_DOT_UNROLL <= DV; id += GGML_VEC_DOT_UNROLL) {
+                    float rs[GGML_VEC_DOT_UNROLL];
+                    ggml_vec_dot_f16_unroll(nt, nbv1, rs, vp + id*nbv1, P16);
+                    for (int u = 0; u < GGML_VEC_DOT_UNROLL; ++u) {
+                        ac[id + u] += rs[u];
+                    }
+                }
+                for (; id < DV; ++id) {
+                    float rs;
+                    ggml_vec_dot_f16(nt, &rs, (ggml_fp16_t *) (vp + id*nbv1), P16);
+                    ac[id] += rs;
+                }
+            }
+        }
+
+        // a fully masked row gives zeros rather than NaNs
+        for (int64_t r = 0; r < nrg; ++r) {
+            const int64_t iq2 = (ig + r)/N;
+            const int64_t iq1 = (ig + r)%N;
+
+            float * out = (float *) ((char *) dst->data + iq2*nb1 + iq1*nb2);
+            if (sum[r] > 0.0) {
+                for (int64_t i = 0; i < DV; ++i) {
+                    out[i] = acc[r*DV + i]/sum[r];
+                }
+            } else {
+                memset(out, 0, DV*sizeof(float));
+            }
+        }
+    }
+}
+
+static void ggml_compute_forward_flash_attn_ext(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * q,
+        const struct ggml_tensor * k,
+        const struct ggml_tensor * v,
+        const struct ggml_tensor * mask,
+        struct ggml_tensor * dst) {
+    switch (k->type) {
+        case GGML_TYPE_F16:
+            {
+                GGML_ASSERT(q->type == GGML_TYPE_F32 && v->type == GGML_TYPE_F16);
+                ggml_compute_forward_flash_attn_ext_f16(params, q, k, v, mask, dst);
+            } break;
+        default:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+}
+
 // ggml_compute_forward_flash_ff
 
 static void ggml_compute_forward_flash_ff_f16(
@@ -15086,6 +15510,10 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
                 const bool masked = t != 0;
                 ggml_compute_forward_flash_attn(params, tensor->src[0], tensor->src[1], tensor->src[2], masked, tensor);
             } break;
+        case GGML_OP_FLASH_ATTN_EXT:
+            {
+                ggml_compute_forward_flash_attn_ext(params, tensor->src[0], tensor->src[1], tensor->src[2], tensor->src[3], tensor);
+            } break;
         case GGML_OP_FLASH_FF:
             {
                 ggml_compute_forward_flash_ff(params, tensor->src[0], tensor->src[1], tensor->src[2], tensor->src[3], tensor->src[4], tensor);
@@ -16135,6 +16563,10 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
                             zero_table);
                 }
             } break;
+        case GGML_OP_FLASH_ATTN_EXT:
+            {
+                GGML_ASSERT(false); // TODO: not implemented
+            } break;
         case GGML_OP_FLASH_FF:
             {
                 GGML_ASSERT(false); // not supported
@@ -16810,6 +17242,7 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
                 n_tasks = n_threads;
             } break;
         case GGML_OP_FLASH_ATTN:
+        case GGML_OP_FLASH_ATTN_EXT:
             {
                 n_tasks = n_threads;
             } break;
@@ -17204,6 +17637,15 @@ struct ggml_cplan ggml_graph_plan(const struct ggml_cgraph * cgraph, int n_threa
                         cur += sizeof(float)*ne11*n_tasks; // this is overestimated by x2
                     }
                 } break;
+            case GGML_OP_FLASH_ATTN_EXT:
+                {
+                    const int64_t D  = node->src[0]->ne[0];
+                    const int64_t DV = node->src[2]->ne[1];
+                    const int64_t T  = GGML_FLASH_ATTN_EXT_TILE;
+                    const int64_t R  = GGML_FLASH_ATTN_EXT_ROWS;
+
+                    cur = GGML_PAD(sizeof(ggml_float)*R + sizeof(float)*(R + R*T + R*DV) + sizeof(ggml_fp16_t)*(T + R*D), CACHE_LINE_SIZE)*n_tasks;
+                } break;
             case GGML_OP_FLASH_FF:
                 {
                     if (node->src[1]->type == GGML_TYPE_F32) {
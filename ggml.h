@@ -454,6 +454,7 @@ extern "C" {
         GGML_OP_LEAKY_RELU,
 
         GGML_OP_FLASH_ATTN,
+        GGML_OP_FLASH_ATTN_EXT,
         GGML_OP_FLASH_FF,
         GGML_OP_FLASH_ATTN_BACK,
         GGML_OP_WIN_PART,
@@ -1645,6 +1646,22 @@ extern "C" {
             struct ggml_tensor  * v,
             bool                  masked);
 
+    // fused attention with an additive mask, for the inference over a KV cache:
+    // softmax(k*q*scale + mask) is never materialized, it is computed with the online softmax over the tiles of K and V
+    // q:    F32 [n_embd_k, n_tokens, n_head]
+    // k:    F16 [n_embd_k, n_kv, n_head_kv]
+    // v:    F16 [n_kv, n_embd_v, n_head_kv] (transposed, as in the KV cache)
+    // mask: F32 [n_kv, >= n_tokens] or NULL
+    // n_head must be a multiple of n_head_kv (grouped-query attention)
+    // res:  F32 [n_embd_v, n_head, n_tokens] (the heads are already merged)
+    GGML_API struct ggml_tensor * ggml_flash_attn_ext(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * q,
+            struct ggml_tensor  * k,
+            struct ggml_tensor  * v,
+            struct ggml_tensor  * mask,
+            float                 scale);
+
     GGML_API struct ggml_tensor * ggml_flash_attn_back(
            struct ggml_context * ctx,
            struct ggml_tensor  * q,
@@ -2274,6 +2291,12 @@ extern "C" {
     GGML_API int ggml_cpu_has_sycl       (void);
     GGML_API int ggml_cpu_has_vsx        (void);
 
+    // the set of CPU kernels in use: "native" (built for the build machine), or the variant selected at runtime
+    GGML_API const char * ggml_cpu_kernels   (void);
+    // switch the CPU kernels to the named variant (after ggml_init(), and never while a graph is being computed);
+    // returns false if the variant is unknown or not supported by this CPU
+    GGML_API bool         ggml_cpu_set_kernels(const char * name);
+
     //
     // Internal types and functions exposed for tests and benchmarks
     //
@@ -2287,6 +2310,9 @@ extern "C" {
     typedef void (*ggml_to_float_t)  (const void  * GGML_RESTRICT x, float * GGML_RESTRICT y, int k);
     typedef void (*ggml_from_float_t)(const float * GGML_RESTRICT x, void  * GGML_RESTRICT y, int k);
     typedef void (*ggml_vec_dot_t)   (const int n, float * GGML_RESTRICT s, const void * GGML_RESTRICT x, const void * GGML_RESTRICT y);
+#define GGML_VEC_DOT_NC 4
+    // GGML_VEC_DOT_NC dot products of x with y rows which are by bytes apart, into s[0..GGML_VEC_DOT_NC-1]
+    typedef void (*ggml_vec_dot_x4_t)(const int n, float * GGML_RESTRICT s, const void * GGML_RESTRICT x, const void * GGML_RESTRICT y, size_t by);
 
     typedef struct {
         const char      * type_name;
@@ -2298,6 +2324,7 @@ extern "C" {
         ggml_from_float_t from_float_reference;
         ggml_vec_dot_t    vec_dot;
         enum ggml_type    vec_dot_type;
+        ggml_vec_dot_x4_t vec_dot_x4;     // optional, for batches
     } ggml_type_traits_t;
 
     GGML_API ggml_type_traits_t ggml_internal_get_type_traits(enum ggml_type type);
@@ -14,8 +14,34 @@
 #include <alloca.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
+
+#ifndef _WIN32
+    #define FME_HAS_SHM
+    #include <fcntl.h>
+    #include <time.h>
+    #include <signal.h>
+    #include <pthread.h>
+    #include <sys/mman.h>
+#endif
+
+#ifdef __linux__
+    #define FME_HAS_INOTIFY
+    #include <pthread.h>
+    #include <poll.h>
+    #include <sys/inotify.h>
+#endif
 
 #define FME_TIMEOUT_UNIT_US 1000
+#define FME_INOTIFY_RECHECK_MS 100
+
+#define FME_SHM_DEFAULT_SIZE (1024 * 1024)
+#define FME_SHM_MAX_OPEN 64
+#define FME_SHM_MAGIC 0x464D4553UL     // changes along with the header layout
+#define FME_SHM_READY_WAIT 100
+#define FME_SHM_RECHECK_MS 20
+#define FME_SHM_OWNER_CHECK_MS 1000
+#define FME_SHM_APPEND_WAIT 1000
 
 enum fme_send_queue_e {
     FME_SEND_QUEUE_WAIT = 0,
@@ -31,6 +57,25 @@ bool fme_waitfor_blocking(const char* fname, unsigned long timeout);
 bool fme_send_msg(const char* fname, const void* msg, int len, int queue);
 int fme_receive_msg(const char* fname, void* msg, int len);
 
+/*
+ * Shared memory backend.
+ * Once fme_init_shm() has been called for a file name (by any process), all the functions above
+ * use a shared memory ring buffer for this name instead of the file, until fme_close_shm() is called.
+ * Other processes notice a new ring within FME_SHM_RECHECK_MS (fme_init() checks right away), so the ring
+ * should be set up before any messages are exchanged.
+ * The ring holds a sequence of messages, so a sender doesn't have to wait for each message to be taken:
+ *      FME_SEND_QUEUE_WAIT means waiting for enough free space in the ring
+ *      FME_SEND_QUEUE_OVERWRITE means dropping all the messages not yet taken
+ *      FME_SEND_QUEUE_APPEND means appending to the last message not yet taken
+ *          (waiting up to FME_SHM_APPEND_WAIT timeout units for free space)
+ *      > 0 means waiting for free space, then dropping the messages not yet taken (as the file backend does)
+ * Waiting is done on process-shared condition variables, so no polling is involved.
+ * A ring whose creator has died without closing it is closed by the first process which notices that
+ * (the creator is checked every FME_SHM_OWNER_CHECK_MS), so the processes sharing a ring should share PID namespace.
+ * */
+bool fme_init_shm(const char* fname, size_t size);
+void fme_close_shm(const char* fname);
+
 #endif /* LIBFME_INCLUDED_ */
 
 #if (!defined LIBFME_IMPLEMENTED_) || (defined LIBFME_IMPLEMENT_NOW)
@@ -53,10 +98,485 @@ int fme_receive_msg(const char* fname, void* msg, int len);
     #define LIBFME_DBG_LOCAL_
 #endif
 
+#ifdef FME_HAS_SHM
+
+struct fme_shm_hdr {
+    uint32_t magic;                 // set when the ring is ready to be used
+    uint32_t alive;                 // cleared by fme_close_shm()
+    pthread_mutex_t lock;
+    pthread_cond_t cv_data, cv_space;
+    uint64_t size;                  // size of the data area following the header
+    uint64_t head, tail;            // free-running write and read positions
+    uint64_t last;                  // position of the last message's header
+    uint32_t count;                 // number of messages in the ring
+    uint64_t key;                   // the name's key
+    pid_t owner;                    // the creator's PID
+};
+
+struct fme_shm_map {
+    uint64_t key;
+    struct fme_shm_hdr* hdr;        // NULL for a name which had no ring the last time it was checked
+    uint64_t recheck;               // when (ms) to look for the ring again, or to check its owner
+};
+
+static struct fme_shm_map fme_shm_maps[FME_SHM_MAX_OPEN];
+static int fme_shm_nmaps = 0;
+static pthread_rwlock_t fme_shm_maps_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static uint64_t fme_shm_key(const char* fname)
+{
+    // FNV-1a of the file name, as the name itself might be too long or contain slashes
+    uint64_t h = 14695981039346656037ULL;
+    for (const char* p = fname; *p; p++) h = (h ^ (uint8_t)*p) * 1099511628211ULL;
+    return h;
+}
+
+static void fme_shm_name(uint64_t key, char* name, size_t len)
+{
+    snprintf(name,len,"/fme_%016llx",(unsigned long long)key);
+}
+
+static uint64_t fme_shm_now_ms(void)
+{
+    // the coarse clock is read without entering the kernel
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE,&ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+#endif
+    return (uint64_t)ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static void fme_shm_recover(struct fme_shm_hdr* h)
+{
+    // the previous owner of the lock has died, possibly in the middle of a copy, so the contents can't be trusted
+    pthread_mutex_consistent(&h->lock);
+    h->tail = h->head;
+    h->count = 0;
+}
+
+static void fme_shm_lock(struct fme_shm_hdr* h)
+{
+    if (pthread_mutex_lock(&h->lock) == EOWNERDEAD) fme_shm_recover(h);
+}
+
+static bool fme_shm_owner_alive(const struct fme_shm_hdr* h)
+{
+    return kill(h->owner,0) == 0 || errno != ESRCH;
+}
+
+static void fme_shm_orphan(struct fme_shm_hdr* h)
+{
+    // a crashed creator can't close its ring, so it's closed for it (must be called with the lock held)
+    if (!h->alive) return;
+    h->alive = 0;
+    pthread_cond_broadcast(&h->cv_data);
+    pthread_cond_broadcast(&h->cv_space);
+
+    char name[32];
+    fme_shm_name(h->key,name,sizeof(name));
+    shm_unlink(name);
+    DBG("FME shared memory ring %s closed, as its owner %d is gone\n",name,(int)h->owner);
+}
+
+static bool fme_shm_check_owner(struct fme_shm_hdr* h)
+{
+    if (!h->alive || fme_shm_owner_alive(h)) return h->alive;
+    fme_shm_lock(h);
+    fme_shm_orphan(h);
+    pthread_mutex_unlock(&h->lock);
+    return false;
+}
+
+static void fme_shm_deadline(struct timespec* ts, unsigned long timeout)
+{
+    clock_gettime(CLOCK_MONOTONIC,ts);
+    unsigned long long ns = (unsigned long long)ts->tv_nsec + (unsigned long long)timeout * FME_TIMEOUT_UNIT_US * 1000ULL;
+    ts->tv_sec += ns / 1000000000ULL;
+    ts->tv_nsec = ns % 1000000000ULL;
+}
+
+static int fme_shm_wait(struct fme_shm_hdr* h, pthread_cond_t* cv, const struct timespec* deadline)
+{
+    // without a deadline, the owner is checked every FME_SHM_OWNER_CHECK_MS, so nobody waits for a dead ring forever
+    struct timespec slice;
+    if (!deadline) fme_shm_deadline(&slice,FME_SHM_OWNER_CHECK_MS * 1000UL / FME_TIMEOUT_UNIT_US);
+    int r = pthread_cond_timedwait(cv,&h->lock,deadline? deadline : &slice);
+    if (r == EOWNERDEAD) {
+        fme_shm_recover(h);
+        r = 0;
+    }
+    if (!deadline && r == ETIMEDOUT) {
+        if (!fme_shm_owner_alive(h)) fme_shm_orphan(h);
+        r = 0;
+    }
+    return r;
+}
+
+static void fme_shm_copy(struct fme_shm_hdr* h, uint64_t pos, const void* src, void* dst, uint64_t len)
+{
+    // copies into (src == NULL) or out of (dst == NULL) the ring, wrapping around its end
+    uint8_t* data = (uint8_t*)(h + 1);
+    while (len) {
+        uint64_t off = pos % h->size;
+        uint64_t n = (h->size - off < len)? h->size - off : len;
+        if (src) memcpy(data + off,src,n);
+        else memcpy(dst,data + off,n);
+        if (src) src = (const uint8_t*)src + n;
+        else dst = (uint8_t*)dst + n;
+        pos += n;
+        len -= n;
+    }
+}
+
+static struct fme_shm_hdr* fme_shm_open(uint64_t key)
+{
+    char name[32];
+    fme_shm_name(key,name,sizeof(name));
+    int fd = shm_open(name,O_RDWR,0);
+    if (fd < 0) return NULL;
+
+    // the ring might have just been created, so give its creator some time to size and initialize it
+    struct stat srec;
+    void* ptr = MAP_FAILED;
+    int i;
+    for (i = 0; i < FME_SHM_READY_WAIT; i++) {
+        if (fstat(fd,&srec)) break;
+        if ((size_t)srec.st_size > sizeof(struct fme_shm_hdr)) {
+            ptr = mmap(NULL,srec.st_size,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+            break;
+        }
+        usleep(FME_TIMEOUT_UNIT_US);
+    }
+    close(fd);
+    if (ptr == MAP_FAILED) return NULL;
+
+    struct fme_shm_hdr* h = (struct fme_shm_hdr*)ptr;
+    for (; i < FME_SHM_READY_WAIT && __atomic_load_n(&h->magic,__ATOMIC_ACQUIRE) != FME_SHM_MAGIC; i++)
+        usleep(FME_TIMEOUT_UNIT_US);
+
+    if (__atomic_load_n(&h->magic,__ATOMIC_ACQUIRE) != FME_SHM_MAGIC || !fme_shm_check_owner(h)) {
+        munmap(ptr,srec.st_size);
+        return NULL;
+    }
+    return h;
+}
+
+static struct fme_shm_hdr* fme_shm_find(const char* fname, bool force)
+{
+    if (!fname) return NULL;
+
+    uint64_t key = fme_shm_key(fname);
+    uint64_t now = fme_shm_now_ms();
+    struct fme_shm_hdr* h = NULL;
+    int i;
+
+    // fast path: a known ring, or a name which had no ring a moment ago (a plain file channel most likely)
+    pthread_rwlock_rdlock(&fme_shm_maps_lock);
+    for (i = 0; i < fme_shm_nmaps; i++) {
+        if (fme_shm_maps[i].key != key) continue;
+        h = fme_shm_maps[i].hdr;
+        uint64_t recheck = __atomic_load_n(&fme_shm_maps[i].recheck,__ATOMIC_RELAXED);
+        if (h && h->alive && (force || now >= recheck)) {
+            // any thread may do it, the worst case is checking twice
+            __atomic_store_n(&fme_shm_maps[i].recheck,now + FME_SHM_OWNER_CHECK_MS,__ATOMIC_RELAXED);
+            fme_shm_check_owner(h);
+        }
+        if (h? h->alive : (!force && now < recheck)) {
+            pthread_rwlock_unlock(&fme_shm_maps_lock);
+            return h;
+        }
+        break;
+    }
+    pthread_rwlock_unlock(&fme_shm_maps_lock);
+
+    // opening is done outside of the lock, as it might wait for the ring to become ready
+    h = fme_shm_open(key);
+
+    pthread_rwlock_wrlock(&fme_shm_maps_lock);
+    int match = -1, spare = -1;
+    for (i = 0; i < fme_shm_nmaps && match < 0; i++) {
+        if (fme_shm_maps[i].key == key) match = i;
+        else if (spare < 0 && (!fme_shm_maps[i].hdr || !fme_shm_maps[i].hdr->alive)) spare = i;
+    }
+
+    if (match >= 0 && fme_shm_maps[match].hdr && fme_shm_maps[match].hdr->alive) {
+        // another thread got there first
+        if (h) munmap(h,sizeof(struct fme_shm_hdr) + h->size);
+        h = fme_shm_maps[match].hdr;
+
+    } else {
+        // a closed ring might still be in use by another thread, so its old mapping is never unmapped
+        int slot = (match >= 0)? match : ((fme_shm_nmaps < FME_SHM_MAX_OPEN)? fme_shm_nmaps++ : spare);
+        if (slot >= 0) {
+            fme_shm_maps[slot].key = key;
+            fme_shm_maps[slot].hdr = h;
+            fme_shm_maps[slot].recheck = now + (h? FME_SHM_OWNER_CHECK_MS : FME_SHM_RECHECK_MS);
+        } else if (h) {
+            ERR("Too many FME shared memory rings open\n");
+            munmap(h,sizeof(struct fme_shm_hdr) + h->size);
+            h = NULL;
+        }
+    }
+
+    pthread_rwlock_unlock(&fme_shm_maps_lock);
+    return h;
+}
+
+bool fme_init_shm(const char* fname, size_t size)
+{
+    if (!fname) {
+        ERR("fme_init_shm() called with NULL socket name\n");
+        return false;
+    }
+    if (!size) size = FME_SHM_DEFAULT_SIZE;
+
+    // if the ring already exists, just drop its contents
+    struct fme_shm_hdr* h = fme_shm_find(fname,true);
+    if (h) {
+        fme_shm_lock(h);
+        h->tail = h->head;
+        h->count = 0;
+        pthread_cond_broadcast(&h->cv_space);
+        pthread_mutex_unlock(&h->lock);
+        return true;
+    }
+
+    char name[32];
+    fme_shm_name(fme_shm_key(fname),name,sizeof(name));
+    int fd = shm_open(name,O_RDWR | O_CREAT | O_EXCL,0600);
+    if (fd < 0) {
+        // somebody else is creating it right now, fme_shm_find() will wait for it to be ready
+        if (errno == EEXIST) return fme_shm_find(fname,true) != NULL;
+        ERR("Unable to create FME shared memory ring %s: %s\n",fname,strerror(errno));
+        return false;
+    }
+
+    size_t total = sizeof(struct fme_shm_hdr) + size;
+    if (ftruncate(fd,total)) {
+        ERR("Unable to allocate FME shared memory ring %s: %s\n",fname,strerror(errno));
+        close(fd);
+        shm_unlink(name);
+        return false;
+    }
+    void* ptr = mmap(NULL,total,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        ERR("Unable to map FME shared memory ring %s: %s\n",fname,strerror(errno));
+        shm_unlink(name);
+        return false;
+    }
+
+    h = (struct fme_shm_hdr*)ptr;
+    pthread_mutexattr_t ma;
+    pthread_mutexattr_init(&ma);
+    pthread_mutexattr_setpshared(&ma,PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&ma,PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&h->lock,&ma);
+    pthread_mutexattr_destroy(&ma);
+
+    pthread_condattr_t ca;
+    pthread_condattr_init(&ca);
+    pthread_condattr_setpshared(&ca,PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&ca,CLOCK_MONOTONIC);
+    pthread_cond_init(&h->cv_data,&ca);
+    pthread_cond_init(&h->cv_space,&ca);
+    pthread_condattr_destroy(&ca);
+
+    h->size = size;
+    h->head = h->tail = h->last = 0;
+    h->count = 0;
+    h->key = fme_shm_key(fname);
+    h->owner = getpid();
+    h->alive = 1;
+    __atomic_store_n(&h->magic,FME_SHM_MAGIC,__ATOMIC_RELEASE);
+
+    // the mapping will be picked up by fme_shm_find()
+    munmap(ptr,total);
+    return fme_shm_find(fname,true) != NULL;
+}
+
+void fme_close_shm(const char* fname)
+{
+    struct fme_shm_hdr* h = fme_shm_find(fname,true);
+    if (!h) return;
+
+    // wake up everybody, so they could notice the ring is gone
+    fme_shm_lock(h);
+    h->alive = 0;
+    pthread_cond_broadcast(&h->cv_data);
+    pthread_cond_broadcast(&h->cv_space);
+    pthread_mutex_unlock(&h->lock);
+
+    char name[32];
+    fme_shm_name(fme_shm_key(fname),name,sizeof(name));
+    shm_unlink(name);
+}
+
+static bool fme_shm_send(struct fme_shm_hdr* h, const void* msg, int len, int queue)
+{
+    uint32_t ulen = len;
+    bool res = false;
+    fme_shm_lock(h);
+
+    if (queue == FME_SEND_QUEUE_OVERWRITE) {
+        h->tail = h->head;
+        h->count = 0;
+    }
+
+    if (queue == FME_SEND_QUEUE_APPEND && h->count) {
+        // wait for the receiver to make room, unless it takes the last message meanwhile
+        struct timespec ts;
+        fme_shm_deadline(&ts,FME_SHM_APPEND_WAIT);
+        while (h->alive && h->count && h->size - (h->head - h->tail) < ulen)
+            if (fme_shm_wait(h,&h->cv_space,&ts) == ETIMEDOUT) break;
+    }
+
+    if (queue == FME_SEND_QUEUE_APPEND && h->count) {
+        // extend the last message
+        if (h->alive && h->size - (h->head - h->tail) >= ulen) {
+            uint32_t olen;
+            fme_shm_copy(h,h->last,NULL,&olen,sizeof(olen));
+            olen += ulen;
+            fme_shm_copy(h,h->last,&olen,NULL,sizeof(olen));
+            fme_shm_copy(h,h->head,msg,NULL,ulen);
+            h->head += ulen;
+            res = true;
+        }
+
+    } else if (ulen + sizeof(ulen) <= h->size) {
+        struct timespec ts;
+        if (queue > 0) fme_shm_deadline(&ts,queue);
+        while (h->alive && h->size - (h->head - h->tail) < ulen + sizeof(ulen)) {
+            if (queue < FME_SEND_QUEUE_WAIT) break;
+            if (fme_shm_wait(h,&h->cv_space,(queue > 0)? &ts : NULL) == ETIMEDOUT) {
+                // timed out - replace whatever has been left
+                h->tail = h->head;
+                h->count = 0;
+            }
+        }
+
+        if (h->alive && h->size - (h->head - h->tail) >= ulen + sizeof(ulen)) {
+            h->last = h->head;
+            fme_shm_copy(h,h->head,&ulen,NULL,sizeof(ulen));
+            fme_shm_copy(h,h->head + sizeof(ulen),msg,NULL,ulen);
+            h->head += ulen + sizeof(ulen);
+            h->count++;
+            res = true;
+        }
+    }
+
+    if (res) pthread_cond_broadcast(&h->cv_data);
+    pthread_mutex_unlock(&h->lock);
+    return res;
+}
+
+static int fme_shm_receive(struct fme_shm_hdr* h, void* msg, int len)
+{
+    int r = 0;
+    fme_shm_lock(h);
+    if (h->count) {
+        uint32_t mlen;
+        fme_shm_copy(h,h->tail,NULL,&mlen,sizeof(mlen));
+        if (msg && len > 0) {
+            r = (mlen < (uint32_t)len)? (int)mlen : len;
+            fme_shm_copy(h,h->tail + sizeof(mlen),NULL,msg,r);
+        }
+        h->tail += mlen + sizeof(mlen);
+        h->count--;
+        pthread_cond_broadcast(&h->cv_space);
+    }
+    pthread_mutex_unlock(&h->lock);
+    return r;
+}
+
+#endif /* FME_HAS_SHM */
+
+#ifdef FME_HAS_INOTIFY
+
+static pthread_key_t fme_inotify_key;
+static pthread_once_t fme_inotify_once = PTHREAD_ONCE_INIT;
+
+static void fme_inotify_close(void* ptr)
+{
+    close((int)(intptr_t)ptr - 1);
+}
+
+static void fme_inotify_init_key(void)
+{
+    pthread_key_create(&fme_inotify_key,fme_inotify_close);
+}
+
+static int fme_inotify_fd(void)
+{
+    // closing inotify instance is slow (the kernel waits for a grace period), so every thread keeps its own one
+    pthread_once(&fme_inotify_once,fme_inotify_init_key);
+    int fd = (int)(intptr_t)pthread_getspecific(fme_inotify_key) - 1;
+    if (fd < 0) {
+        fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+        if (fd >= 0) pthread_setspecific(fme_inotify_key,(void*)(intptr_t)(fd + 1));
+    }
+    return fd;
+}
+
+/*
+ * Waits for the message file to appear (or to disappear) using inotify on its directory.
+ * The file is re-checked every FME_INOTIFY_RECHECK_MS anyway, as some file systems (e.g. network ones)
+ * don't report the changes made by other hosts.
+ * Negative timeout means waiting indefinitely.
+ * Returns 1 if the condition is met, 0 on timeout, or -1 if inotify can't be used.
+ * */
+static int fme_inotify_wait(const char* fname, bool appear, long timeout)
+{
+    struct stat dummy;
+    if ((stat(fname,&dummy) == 0) == appear) return 1;
+    if (!timeout) return 0;
+
+    char* dir = (char*)alloca(strlen(fname)+2);
+    strcpy(dir,fname);
+    char* sl = strrchr(dir,'/');
+    if (!sl) strcpy(dir,".");
+    else if (sl == dir) dir[1] = 0;
+    else *sl = 0;
+
+    // the watches are never removed, so the events from other directories are possible, but harmless
+    int fd = fme_inotify_fd();
+    if (fd < 0) return -1;
+    if (inotify_add_watch(fd,dir,IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM) < 0) return -1;
+
+    struct timespec t0,t1;
+    clock_gettime(CLOCK_MONOTONIC,&t0);
+    long long left = 0;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    for (;;) {
+        // the events themselves don't matter, the file is checked again anyway
+        while (read(fd,buf,sizeof(buf)) > 0) ;
+        if ((stat(fname,&dummy) == 0) == appear) return 1;
+
+        if (timeout > 0) {
+            clock_gettime(CLOCK_MONOTONIC,&t1);
+            left = timeout * (long long)FME_TIMEOUT_UNIT_US / 1000LL - ((t1.tv_sec - t0.tv_sec) * 1000LL + (t1.tv_nsec - t0.tv_nsec) / 1000000LL);
+            if (left <= 0) return 0;
+        }
+
+        struct pollfd p = { fd, POLLIN, 0 };
+        poll(&p,1,(timeout < 0 || left > FME_INOTIFY_RECHECK_MS)? FME_INOTIFY_RECHECK_MS : (int)left);
+    }
+}
+
+#endif /* FME_HAS_INOTIFY */
+
 bool fme_check_msg(const char* fname)
 {
     if (!fname) return false;
 
+#ifdef FME_HAS_SHM
+    struct fme_shm_hdr* h = fme_shm_find(fname,false);
+    if (h) return __atomic_load_n(&h->count,__ATOMIC_ACQUIRE) > 0;
+#endif
+
     struct stat dummy;
     if (stat(fname,&dummy)) return false;
 
@@ -67,6 +587,17 @@ size_t fme_check_msglen(const char* fname)
 {
     if (!fname) return 0;
 
+#ifdef FME_HAS_SHM
+    struct fme_shm_hdr* h = fme_shm_find(fname,false);
+    if (h) {
+        uint32_t mlen = 0;
+        fme_shm_lock(h);
+        if (h->count) fme_shm_copy(h,h->tail,NULL,&mlen,sizeof(mlen));
+        pthread_mutex_unlock(&h->lock);
+        return mlen;
+    }
+#endif
+
     struct stat srec;
     if (stat(fname,&srec)) return 0;
 
@@ -75,6 +606,28 @@ size_t fme_check_msglen(const char* fname)
 
 bool fme_waitfor_blocking(const char* fname, unsigned long timeout)
 {
+#ifdef FME_HAS_SHM
+    struct fme_shm_hdr* h = fme_shm_find(fname,false);
+    if (h) {
+        struct timespec ts;
+        fme_shm_deadline(&ts,timeout);
+        fme_shm_lock(h);
+        while (h->alive && !h->count) {
+            if (fme_shm_wait(h,&h->cv_data,&ts) == ETIMEDOUT) break;
+        }
+        bool r = h->count > 0;
+        pthread_mutex_unlock(&h->lock);
+        return r;
+    }
+#endif
+
+#ifdef FME_HAS_INOTIFY
+    if (fname) {
+        int r = fme_inotify_wait(fname,true,(timeout > (unsigned long)LONG_MAX)? LONG_MAX : (long)timeout);
+        if (r >= 0) return r;
+    }
+#endif
+
     for (unsigned long i = 0; i < timeout; i++) {
         if (fme_check_msg(fname)) return true;
         usleep(FME_TIMEOUT_UNIT_US);
@@ -89,6 +642,10 @@ bool fme_init(const char* fname)
         return false;
     }
 
+#ifdef FME_HAS_SHM
+    if (fme_shm_find(fname,true)) return fme_init_shm(fname,0);
+#endif
+
     if (fme_check_msg(fname)) {
         if (unlink(fname)) {
             ERR("Unable to init FME socket %s: %s\n",fname,strerror(errno));
@@ -110,8 +667,18 @@ bool fme_send_msg(const char* fname, const void* msg, int len, int queue)
 {
     if (!fname || !msg || len < 1) return false;
 
+#ifdef FME_HAS_SHM
+    struct fme_shm_hdr* h = fme_shm_find(fname,false);
+    if (h) return fme_shm_send(h,msg,len,queue);
+#endif
+
     // Queuing support
-    if (queue >= FME_SEND_QUEUE_WAIT) {
+    bool waited = false;
+#ifdef FME_HAS_INOTIFY
+    // on timeout, the message is overwritten anyway
+    if (queue >= FME_SEND_QUEUE_WAIT) waited = (fme_inotify_wait(fname,false,queue? queue : -1) >= 0);
+#endif
+    if (queue >= FME_SEND_QUEUE_WAIT && !waited) {
         while (1) {
             if (!fme_check_msg(fname)) break;
             if (queue && queue-- == 1) break;
@@ -147,6 +714,11 @@ int fme_receive_msg(const char* fname, void* msg, int len)
 {
     if (!fname) return 0;
 
+#ifdef FME_HAS_SHM
+    struct fme_shm_hdr* h = fme_shm_find(fname,false);
+    if (h) return fme_shm_receive(h,msg,len);
+#endif
+
     // Prepare temporary filename
     char* tmpname = (char*)alloca(strlen(fname)+3);
     strcpy(tmpname,fname);
@@ -10,11 +10,14 @@
 #include <sys/stat.h>
 #include <string>
 #include "lscs.h"
+#include "ariaremote.h"
+#include "trace.h"
 
 #define LIBFME_IMPLEMENTED_
 #include "libfme.h"
 
-#define LISA_VERSION "0.0.6"
+#define LISA_VERSION "0.1.3"
+#define LISA_TRACE_FILE "lisa_trace.json"
 #define LISA_MAX_FME_MESSAGE 256
 
 #define ERR(X,...) fprintf(stderr, "[LISA] ERROR: " X "\n", __VA_ARGS__)
@@ -30,15 +33,20 @@ using namespace std;
 
 const char* argstrings[] = {
     "-s file : load LSCS scheme",
-    "-t time : inter-step delay value (in ms)",
+    "-t time : free-running pods period (in ms)",
     "-m file : use shutdown marker file",
     "-F file : use FME control",
+    "-c num  : number of CPU cores to share between the pods",
+    "-W [addr:]port : run as a worker, serving remote pods for other LISA instances (on loopback interface by default)",
+    "-D dir  : worker's scripts directory (current directory by default)",
+    "-K file : shared secret for the remote pods (required to serve on other interfaces than loopback)",
+    "-S file : restore the system's state from file (if exists), and save it there on exit",
     NULL
 };
 
 bool g_quit = false, g_pause = false;
-string g_lscs_file, g_shutmark, g_fme_socket;
-int g_timeout = 100;
+string g_lscs_file, g_shutmark, g_fme_socket, g_state_file, g_save_to, g_worker_addr, g_script_dir;
+int g_timeout = 100, g_cores = 0, g_worker = 0;
 
 void usage(const char* sname)
 {
@@ -53,7 +61,7 @@ int set_params(int argc, char* argv[])
     int opt;
 
     // parse params
-    while ((opt = getopt(argc,argv,"s:t:m:F:")) != -1) {
+    while ((opt = getopt(argc,argv,"s:t:m:F:c:W:S:D:K:")) != -1) {
         switch (opt) {
         case 's':
             g_lscs_file = optarg;
@@ -67,6 +75,34 @@ int set_params(int argc, char* argv[])
         case 'F':
             g_fme_socket = optarg;
             break;
+        case 'c':
+            g_cores = atoi(optarg);
+            break;
+        case 'W':
+            {
+                string arg = optarg;
+                auto pos = arg.rfind(':');
+                if (pos != string::npos) {
+                    g_worker_addr = arg.substr(0,pos);
+                    if (g_worker_addr.size() > 1 && g_worker_addr.front() == '[' && g_worker_addr.back() == ']')
+                        g_worker_addr = g_worker_addr.substr(1,g_worker_addr.size()-2);
+                    arg.erase(0,pos+1);
+                }
+                g_worker = atoi(arg.c_str());
+            }
+            break;
+        case 'D':
+            g_script_dir = optarg;
+            break;
+        case 'K':
+            if (!AriaMessage::setKeyFile(optarg)) {
+                ERR("Unable to read the shared secret from %s",optarg);
+                return 1;
+            }
+            break;
+        case 'S':
+            g_state_file = optarg;
+            break;
         default:
             usage(argv[0]);
             return -1;
@@ -74,7 +110,7 @@ int set_params(int argc, char* argv[])
     }
 
     // check'em
-    if (g_lscs_file.empty()) {
+    if (g_lscs_file.empty() && g_worker <= 0) {
         ERR("LSCS scheme file was not specified (%d args given)",argc-1);
         return 1;
     }
@@ -82,7 +118,28 @@ int set_params(int argc, char* argv[])
     return 0;
 }
 
-void recv_fme_cmd()
+void print_stats(AnnaLSCS* sys)
+{
+    AnnaLSCSStats st = sys->getStats();
+    fprintf(stderr,"%d waves, %.1f ms total, %.1f ms of pods processing, parallelism %.2f (max %d pods at once)\n",
+            st.n_waves,st.t_wall,st.t_busy,st.parallelism,st.max_running);
+
+    for (auto &i : sys->getPods()) {
+        AriaPod* pod = sys->getPod(i);
+        if (!pod || !pod->ptr) continue;
+        fprintf(stderr,"\t%s: %d runs, %.1f ms, %d cores\n",i.c_str(),pod->ptr->getRuns(),pod->ptr->getBusyTime(),pod->budget);
+    }
+
+    for (auto &i : sys->getPods()) {
+        for (auto &j : sys->getLinksFrom(i)) {
+            if (!j.capacity) continue;
+            fprintf(stderr,"\t%s.%d -> %s.%d: %zu/%d queued (max %d), %ld passed, %ld dropped\n",j.from.c_str(),j.pin_from,j.to.c_str(),j.pin_to,
+                    j.queue.size(),j.capacity,j.max_depth,j.n_passed,j.n_dropped);
+        }
+    }
+}
+
+void recv_fme_cmd(AnnaLSCS* sys)
 {
     char msg[LISA_MAX_FME_MESSAGE] = {0};
     int r = fme_receive_msg(g_fme_socket.c_str(),msg,sizeof(msg));
@@ -101,10 +158,71 @@ void recv_fme_cmd()
     } else if (!strncmp(msg,"unpause",LISA_MAX_FME_MESSAGE-1)) {
         g_pause = false;
 
+    } else if (!strncmp(msg,"stats",LISA_MAX_FME_MESSAGE-1)) {
+        print_stats(sys);
+
+    } else if (!strncmp(msg,"trace start",LISA_MAX_FME_MESSAGE-1)) {
+        AnnaTrace::Enable(true);
+
+    } else if (!strncmp(msg,"trace stop",10)) {
+        char fn[LISA_MAX_FME_MESSAGE] = {0};
+        if (sscanf(msg,"trace stop %s",fn) != 1) strcpy(fn,LISA_TRACE_FILE);
+        AnnaTrace::Enable(false);
+        if (AnnaTrace::WriteJSON(fn)) fprintf(stderr,"Trace written to %s\n",fn);
+        else ERR("Unable to write trace file %s",fn);
+        fprintf(stderr,"%s",sys->getTraceSummary().c_str());
+
+    } else if (!strncmp(msg,"save",4)) {
+        // the state can only be saved between the waves, so it's deferred
+        char fn[LISA_MAX_FME_MESSAGE] = {0};
+        if (sscanf(msg,"save %s",fn) == 1) g_save_to = fn;
+        else g_save_to = g_state_file;
+        if (g_save_to.empty()) ERRS("No file to save the state to\n");
+
     } else
         ERR("Unknown FME command received: '%s'",msg);
 }
 
+bool save_state(AnnaLSCS* sys, string fn)
+{
+    // let the current wave finish
+    while (sys->getState() == ANNA_PROCESSING) {
+        if (sys->Processing() != ANNA_PROCESSING) break;
+        sys->WaitEvent(g_timeout);
+    }
+
+    if (!sys->SaveState(fn,nullptr,0)) {
+        ERR("Unable to save state to %s: %s",fn.c_str(),sys->getError().c_str());
+        return false;
+    }
+    fprintf(stderr,"State saved to %s\n",fn.c_str());
+    return true;
+}
+
+int run_worker()
+{
+    AriaHost host;
+    if (!g_script_dir.empty()) host.setScriptDir(g_script_dir);
+    if (!host.Listen(g_worker,g_worker_addr)) {
+        ERR("%s",host.getError().c_str());
+        return 12;
+    }
+    fprintf(stderr,"Serving remote pods on %s:%d\n",g_worker_addr.empty()? "127.0.0.1" : g_worker_addr.c_str(),g_worker);
+
+    // the pods are served by their own threads, we only need to accept new connections
+    while (!g_quit) {
+        if (!g_shutmark.empty() && fme_check_msg(g_shutmark.c_str())) break;
+        if (!g_fme_socket.empty() && fme_check_msg(g_fme_socket.c_str())) {
+            char msg[LISA_MAX_FME_MESSAGE] = {0};
+            if (fme_receive_msg(g_fme_socket.c_str(),msg,sizeof(msg)) && !strncmp(msg,"quit",LISA_MAX_FME_MESSAGE-1)) break;
+        }
+        host.Poll(g_timeout);
+    }
+
+    fprintf(stderr,"LISA ver. " LISA_VERSION " worker closing down (%d clients)\n",host.getNumClients());
+    return 0;
+}
+
 int main(int argc, char* argv[])
 {
     fprintf(stderr,"LISA ver. " LISA_VERSION " (brain ver. " ANNA_VERSION ") starting up\n");
@@ -115,6 +233,7 @@ int main(int argc, char* argv[])
         return -1;
     }
     if (set_params(argc,argv)) return -1;
+    if (g_worker > 0) return run_worker();
 
     // create system
     AnnaLSCS* sys = new AnnaLSCS(g_lscs_file);
@@ -123,6 +242,25 @@ int main(int argc, char* argv[])
         ERR("Unable to create system: %s\n",sys->getError().c_str());
         return 11;
     }
+    if (g_cores > 0) sys->setCores(g_cores);
+    AnnaTrace::setThreadName("scheduler");
+
+    // the pods are created concurrently, so the total is less than the sum of their times
+    fprintf(stderr,"System started in %.1f ms\n",sys->getStats().t_startup);
+    for (auto &i : sys->getPods()) {
+        AriaPod* pod = sys->getPod(i);
+        if (pod && pod->ptr) fprintf(stderr,"\t%s: %.1f ms\n",i.c_str(),pod->t_load);
+    }
+
+    // restore the state from the previous run
+    struct stat st;
+    if (!g_state_file.empty() && !stat(g_state_file.c_str(),&st)) {
+        if (!sys->LoadState(g_state_file,nullptr,nullptr)) {
+            ERR("Unable to restore state from %s: %s",g_state_file.c_str(),sys->getError().c_str());
+            return 13;
+        }
+        fprintf(stderr,"State restored from %s\n",g_state_file.c_str());
+    }
 
     // run main loop
     while (!g_quit) {
@@ -132,18 +270,33 @@ int main(int argc, char* argv[])
         }
         if (!g_shutmark.empty() && fme_check_msg(g_shutmark.c_str())) break;
         if (!g_fme_socket.empty() && fme_check_msg(g_fme_socket.c_str())) {
-            recv_fme_cmd();
+            recv_fme_cmd(sys);
             continue; // skip a cycle to allow faster command execution and reaction to changes
         }
 
-        if (!g_pause) sys->Processing();
-        usleep(g_timeout * 1000);
+        if (g_pause) {
+            usleep(g_timeout * 1000);
+            continue;
+        }
+
+        if (!g_save_to.empty()) {
+            save_state(sys,g_save_to);
+            g_save_to.clear();
+        }
+
+        // sleep until some pod has finished its job (or new data has arrived), but don't miss the control messages
+        sys->Processing();
+        sys->WaitEvent(g_timeout);
     }
 
+    if (!g_state_file.empty() && sys->getState() != ANNA_ERROR) save_state(sys,g_state_file);
+
     // check for errors
     if (sys->getState() == ANNA_ERROR)
         ERR("%s\n",sys->getError().c_str());
 
+    print_stats(sys);
+
     // delete system
     delete sys;
     fprintf(stderr,"LISA ver. " LISA_VERSION " closing down\n");
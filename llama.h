@@ -235,6 +235,7 @@ extern "C" {
         bool logits_all;  // the llama_eval() call computes all logits, not just the last one (DEPRECATED - set llama_batch.logits instead)
         bool embedding;   // embedding mode only
         bool offload_kqv; // whether to offload the KQV ops (including the KV cache) to GPU
+        bool flash_attn;  // use the fused attention on the CPU (F16 KV cache only, not for ALiBi models)
     };
 
     // model quantization parameters
@@ -1,7 +1,14 @@
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <string>
+#include <thread>
+#include <set>
+#include <chrono>
+#include <unistd.h>
 #include "lscs.h"
+#include "ariaremote.h"
+#include "trace.h"
 
 #define ERR(X,...) fprintf(stderr, "[LSCS] ERROR: " X "\n", __VA_ARGS__)
 
@@ -13,6 +20,24 @@
 
 using namespace std;
 
+static const char* link_policies[ARIA_LINK_NUMPOLICIES] = { "block", "drop", "coalesce" };
+
+static bool ParseQueue(AriaLink& lnk, const char* str)
+{
+    char kw[32] = {0}, pol[32] = {0};
+    int r = sscanf(str,"%31s %d %31s",kw,&lnk.capacity,pol);
+    if (r < 2 || strcasecmp(kw,"queue") || lnk.capacity < 1) return false;
+    if (r < 3) return true;
+
+    for (int i = 0; i < ARIA_LINK_NUMPOLICIES; i++) {
+        if (!strcasecmp(pol,link_policies[i])) {
+            lnk.policy = (AriaLinkPolicy)i;
+            return true;
+        }
+    }
+    return false;
+}
+
 AnnaLSCS::AnnaLSCS()
 {
     state = ANNA_NOT_INITIALIZED;
@@ -42,23 +67,244 @@ void AnnaLSCS::setConfig(const AnnaConfig &cfg)
 
 void AnnaLSCS::setInput(string inp)
 {
+    bool any = false;
     for (auto &i : pods) {
         if (!i.second.ptr) continue;
         if (i.second.ptr->getState() != ARIA_READY) continue;
         i.second.ptr->setGlobalInput(inp);
+        i.second.dirty = true;
+        any = true;
     }
+    if (any) Wake();
 }
 
 bool AnnaLSCS::SaveState(string fname, const void *user_data, size_t user_size)
 {
-    //TODO
-    return false;
+    if (state == ANNA_PROCESSING || n_running) {
+        internal_error = "State can only be saved between the waves";
+        return false;
+    }
+
+    // the snapshots are the heavy part (brain states), so the pods are making them concurrently
+    vector<AriaPod*> lst;
+    vector<string> names;
+    for (auto &i : pods) {
+        if (!i.second.ptr) continue;
+        lst.push_back(&i.second);
+        names.push_back(i.first);
+    }
+    vector<string> snaps(lst.size());
+    vector<char> oks(lst.size(),0);
+    vector<thread> thr;
+    for (size_t i = 0; i < lst.size(); i++)
+        thr.push_back(thread([&,i] { oks[i] = lst[i]->ptr->SaveSnapshot(snaps[i]); }));
+    for (auto &i : thr) i.join();
+
+    for (size_t i = 0; i < lst.size(); i++) {
+        if (!oks[i]) {
+            internal_error = myformat("Unable to save pod %s: %s",names[i].c_str(),lst[i]->ptr->getError().c_str());
+            return false;
+        }
+    }
+
+    FILE* f = fopen(fname.c_str(),"wb");
+    if (!f) {
+        internal_error = myformat("Unable to open file %s for writing",fname.c_str());
+        return false;
+    }
+
+    // 1. header
+    AriaMessage hdr;
+    hdr.data = LSCS_STATE_MAGIC;
+    hdr.putU32(LSCS_STATE_VERSION);
+    hdr.putU32(lst.size());
+    bool ok = fwrite(hdr.data.data(),hdr.data.size(),1,f);
+
+    // 2. pods: name, script, undelivered inputs and the snapshot
+    for (size_t i = 0; i < lst.size() && ok; i++) {
+        AriaMessage sec;
+        sec.putStr(names[i]);
+        sec.putStr(lst[i]->ptr->getFName());
+        sec.putU8(lst[i]->dirty);
+        sec.putU32(lst[i]->pending.size());
+        for (auto &j : lst[i]->pending) {
+            sec.putU32(j.first);
+            sec.putPin(j.second);
+        }
+        sec.putU32(snaps[i].size());
+        ok = fwrite(sec.data.data(),sec.data.size(),1,f);
+        if (ok && !snaps[i].empty()) ok = fwrite(snaps[i].data(),snaps[i].size(),1,f);
+        snaps[i].clear();
+    }
+
+    // 3. queued links
+    AriaMessage lnk;
+    uint32_t nl = 0;
+    for (auto &i : links) {
+        for (auto &j : i.second) {
+            if (!j.capacity) continue;
+            lnk.putStr(j.from);
+            lnk.putU32(j.pin_from);
+            lnk.putStr(j.to);
+            lnk.putU32(j.pin_to);
+            lnk.putU32(j.max_depth);
+            lnk.putF64(j.n_passed);
+            lnk.putF64(j.n_dropped);
+            lnk.putU32(j.queue.size());
+            for (auto &k : j.queue) lnk.putPin(k);
+            nl++;
+        }
+    }
+    AriaMessage tail;
+    tail.putU32(nl);
+    tail.data += lnk.data;
+
+    // 4. user data
+    tail.putStr((user_data && user_size)? string((const char*)user_data,user_size) : string());
+    if (ok) ok = fwrite(tail.data.data(),tail.data.size(),1,f);
+
+    fclose(f);
+    if (!ok) {
+        internal_error = myformat("Unable to write to %s: %s",fname.c_str(),strerror(errno));
+        return false;
+    }
+    return true;
 }
 
 bool AnnaLSCS::LoadState(string fname, void *user_data, size_t *user_size)
 {
-    //TODO
-    return false;
+    if (state == ANNA_PROCESSING || n_running) {
+        internal_error = "State can only be loaded between the waves";
+        return false;
+    }
+
+    FILE* f = fopen(fname.c_str(),"rb");
+    if (!f) {
+        internal_error = myformat("Couldn't open state file %s",fname.c_str());
+        return false;
+    }
+    AriaMessage in;
+    fseek(f,0,SEEK_END);
+    in.data.resize(ftell(f));
+    fseek(f,0,SEEK_SET);
+    bool rd = in.data.empty() || fread(&in.data[0],in.data.size(),1,f);
+    fclose(f);
+
+    const size_t ml = strlen(LSCS_STATE_MAGIC);
+    if (!rd || in.data.compare(0,ml,LSCS_STATE_MAGIC)) {
+        internal_error = myformat("%s is not an LSCS state file",fname.c_str());
+        return false;
+    }
+    in.pos = ml;
+    uint32_t ver = in.getU32();
+    if (ver != LSCS_STATE_VERSION) {
+        internal_error = myformat("Unsupported state file version %u (expected %u)",ver,LSCS_STATE_VERSION);
+        return false;
+    }
+
+    // everything is checked before any of the pods is touched
+    struct pod_rec {
+        AriaPod* pod;
+        string name;
+        bool dirty;
+        vector<pair<int,AriaPinData>> pending;
+        string snap;
+    };
+    vector<pod_rec> recs(in.getU32());
+    for (auto &r : recs) {
+        r.name = in.getStr();
+        string script = in.getStr();
+        r.dirty = in.getU8();
+        for (uint32_t i = 0, n = in.getU32(); i < n && !in.bad; i++) {
+            int pin = in.getU32();
+            r.pending.push_back(make_pair(pin,in.getPin()));
+        }
+        r.snap = in.getStr();
+        if (in.bad) break;
+
+        auto it = pods.find(r.name);
+        if (it == pods.end() || !it->second.ptr) {
+            internal_error = myformat("Pod %s doesn't exist in the scheme",r.name.c_str());
+            return false;
+        }
+        if (it->second.ptr->getFName() != script) {
+            internal_error = myformat("Pod %s is running a different script (%s)",r.name.c_str(),script.c_str());
+            return false;
+        }
+        r.pod = &it->second;
+    }
+
+    struct link_rec {
+        AriaLink* lnk = nullptr;
+        AriaLink data;
+    };
+    vector<link_rec> lrecs(in.bad? 0 : in.getU32());
+    for (auto &r : lrecs) {
+        r.data.from = in.getStr();
+        r.data.pin_from = in.getU32();
+        r.data.to = in.getStr();
+        r.data.pin_to = in.getU32();
+        r.data.max_depth = in.getU32();
+        r.data.n_passed = in.getF64();
+        r.data.n_dropped = in.getF64();
+        for (uint32_t i = 0, n = in.getU32(); i < n && !in.bad; i++) r.data.queue.push_back(in.getPin());
+        if (in.bad) break;
+
+        auto it = links.find(r.data.from);
+        for (size_t j = 0; it != links.end() && j < it->second.size(); j++) {
+            AriaLink &l = it->second[j];
+            if (l.to == r.data.to && l.pin_from == r.data.pin_from && l.pin_to == r.data.pin_to && l.capacity) r.lnk = &l;
+        }
+        if (!r.lnk) {
+            internal_error = myformat("Queued link %s.%d -> %s.%d doesn't exist in the scheme",
+                                      r.data.from.c_str(),r.data.pin_from,r.data.to.c_str(),r.data.pin_to);
+            return false;
+        }
+    }
+
+    string udata = in.getStr();
+    if (in.bad) {
+        internal_error = myformat("State file %s is corrupted",fname.c_str());
+        return false;
+    }
+    if (user_data && udata.size() > (user_size? (*user_size):0)) {
+        internal_error = myformat("Unable to load user data: %zu bytes in the file, but can read only %zu bytes",udata.size(),(user_size? (*user_size):0));
+        return false;
+    }
+
+    // restore the pods concurrently, as they might need to start their brains
+    vector<char> oks(recs.size(),0);
+    vector<thread> thr;
+    for (size_t i = 0; i < recs.size(); i++)
+        thr.push_back(thread([&,i] { oks[i] = recs[i].pod->ptr->LoadSnapshot(recs[i].snap); }));
+    for (auto &i : thr) i.join();
+
+    for (size_t i = 0; i < recs.size(); i++) {
+        if (!oks[i]) {
+            internal_error = myformat("Unable to restore pod %s: %s",recs[i].name.c_str(),recs[i].pod->ptr->getError().c_str());
+            return false;
+        }
+        AriaPod &pod = *recs[i].pod;
+        pod.pending.swap(recs[i].pending);
+        pod.dirty = recs[i].dirty;
+        pod.mark = pod.rerun = false;
+        // the script might have got its brain back
+        pod.brainy = pod.ptr->hasLocalBrain();
+    }
+    for (auto &r : lrecs) {
+        r.lnk->queue.swap(r.data.queue);
+        r.lnk->max_depth = r.data.max_depth;
+        r.lnk->n_passed = r.data.n_passed;
+        r.lnk->n_dropped = r.data.n_dropped;
+    }
+
+    if (user_size) *user_size = udata.size();
+    if (user_data && !udata.empty()) memcpy(user_data,udata.data(),udata.size());
+
+    repartition = true;
+    state = ANNA_READY;
+    Wake();
+    return true;
 }
 
 bool AnnaLSCS::EmbedImage(string imgfile)
@@ -74,9 +320,7 @@ bool AnnaLSCS::EmbedImage(string imgfile)
 
 AnnaState AnnaLSCS::Processing(bool /*skip_sampling*/)
 {
-    string tmp;
-    AnnaState next = ANNA_TURNOVER;
-
+    AnnaTraceSpan span("lscs","Processing");
     switch (state) {
     case ANNA_ERROR:
     case ANNA_NOT_INITIALIZED:
@@ -84,59 +328,450 @@ AnnaState AnnaLSCS::Processing(bool /*skip_sampling*/)
 
     case ANNA_TURNOVER:
     case ANNA_READY:
-        // prepare and run the pods asynchronously
-        for (auto &i : pods) {
-            i.second.mark = false;
-            if (i.second.ptr) {
-                // if pod is immediately available, then we can mark it right now
-                if (i.second.ptr->Processing() == ARIA_READY) i.second.mark = true;
-                else next = ANNA_PROCESSING; // this means we have more cycles to do in the future
+        {
+            // start a new wave, but only if there's something to do
+            if (recompile) Compile();
+            bool any = false;
+            for (auto &p : plan) {
+                p.pod->mark = false;
+                if (isReady(p)) any = true;
             }
+            if (!any) return state;
         }
-        state = next;
-        break;
+        state = ANNA_PROCESSING;
+        wave_start = Now();
+        wave_trace = AnnaTrace::Begin();
+        stats.n_waves++;
+        // fall-through
 
     case ANNA_PROCESSING:
-        // check that all pods have joined their threads
-        for (auto &i : pods) {
-            if (!i.second.ptr) continue;
-            if (i.second.mark) continue; // has already been processed
-
-            switch (i.second.ptr->Processing()) {
-            case ARIA_ERROR:
+        for (;;) {
+            if (!Dispatch()) {
                 state = ANNA_ERROR;
-                internal_error = myformat("pod %s error: %s",i.first.c_str(),i.second.ptr->getError().c_str());
                 return state;
+            }
+            if (n_running) break;
 
-            case ARIA_READY:
-                i.second.mark = true;
-                // grab whatever global output which has been produced
-                tmp = i.second.ptr->getGlobalOutput();
-                if (!tmp.empty()) accumulator += tmp;
-                // propagate output signals
-                FanOut(i.first);
-                break;
+            // nothing is running, so there will be no completion events; either start more pods right away,
+            // or finish the wave if nothing else can be started in it
+            bool more = false;
+            for (auto &p : plan) {
+                if (!p.pod->mark && isReady(p)) more = true;
+            }
+            if (more) continue;
+
+            state = ANNA_TURNOVER;
+            stats.t_wall += Now() - wave_start;
+            AnnaTrace::End("lscs","wave",wave_trace);
+            // all the completion events have been collected by now
+            lock_guard<mutex> lk(evt_mtx);
+            evt_flag = false;
+            break;
+        }
+        break;
 
+    default:
+        break;
+    }
+
+    return state;
+}
+
+bool AnnaLSCS::isReady(const plan_pod& p)
+{
+    const AriaPod &pod = *p.pod;
+    if (!pod.ptr || pod.running || isBlocked(p)) return false;
+    if (pod.freerun || pod.dirty || !pod.pending.empty() || !pod.ptr->getNumInPins()) return true;
+
+    for (int l : p.in) {
+        if (!plan_links[l].lnk->queue.empty()) return true;
+    }
+    return false;
+}
+
+bool AnnaLSCS::canRerun(const plan_pod& p)
+{
+    // queued links decouple the pods from the waves: a pod can be started again if there's queued data on its inputs,
+    // or if all of its outputs are queued; but only while the first runs of the wave are still going, so the wave will end
+    if (n_first <= 0) return false;
+    for (int l : p.in) {
+        if (!plan_links[l].lnk->queue.empty()) return true;
+    }
+    return p.decoupled;
+}
+
+bool AnnaLSCS::isBlocked(const plan_pod& p)
+{
+    for (int l : p.out) {
+        const AriaLink &lnk = *plan_links[l].lnk;
+        if (lnk.capacity > 0 && lnk.policy == ARIA_LINK_BLOCK && (int)lnk.queue.size() >= lnk.capacity) return true;
+    }
+    return false;
+}
+
+void AnnaLSCS::Enqueue(AriaLink& lnk, const AriaPinData& data)
+{
+    if ((int)lnk.queue.size() >= lnk.capacity) {
+        switch (lnk.policy) {
+        case ARIA_LINK_DROP:
+            lnk.queue.pop_front();
+            lnk.n_dropped++;
+            break;
+        case ARIA_LINK_COALESCE:
+            lnk.queue.back() = data;
+            lnk.n_dropped++;
+            lnk.n_passed++;
+            return;
+        default:
+            // the producer shouldn't have been started, but let's not lose the data anyway
+            break;
+        }
+    }
+    lnk.queue.push_back(data);
+    lnk.n_passed++;
+    if ((int)lnk.queue.size() > lnk.max_depth) lnk.max_depth = lnk.queue.size();
+}
+
+bool AnnaLSCS::Dispatch()
+{
+    if (recompile) Compile();
+    if (repartition) Partition();
+
+    // upstream pods go first, so their outputs can be consumed in the same pass
+    for (auto &p : plan) {
+        AriaPod &pod = *p.pod;
+        const char* nm = p.name.c_str();
+        if (!pod.ptr) continue;
+
+        if (pod.running) {
+            switch (pod.ptr->Processing()) {
             case ARIA_RUNNING:
                 // normal situation, processing
-                next = ANNA_PROCESSING;
+                continue;
+
+            case ARIA_READY:
+                {
+                    pod.running = false;
+                    n_running--;
+                    if (!pod.rerun) n_first--;
+                    // the script might have started or stopped its brain
+                    if (pod.ptr->hasLocalBrain() != pod.brainy) {
+                        pod.brainy = !pod.brainy;
+                        Partition();
+                    }
+                    // grab whatever global output which has been produced
+                    string tmp = pod.ptr->getGlobalOutput();
+                    if (!tmp.empty()) accumulator += tmp;
+                    // propagate output signals
+                    FanOut(p);
+                }
                 break;
 
+            case ARIA_ERROR:
+                internal_error = myformat("pod %s error: %s",nm,pod.ptr->getError().c_str());
+                return false;
+
             default:
                 // wrong situation, stop
-                state = ANNA_ERROR;
-                internal_error = myformat("pod %s in in wrong state for processing() call: %d",i.first.c_str(),i.second.ptr->getState());
-                return state;
+                internal_error = myformat("pod %s is in wrong state for processing() call: %d",nm,pod.ptr->getState());
+                return false;
             }
         }
-        state = next;
-        break;
 
-    default:
-        break;
+        // each pod runs at most once per wave, the data arriving later will wait for the next one
+        if ((pod.mark && !canRerun(p)) || !isReady(p)) continue;
+
+        // deliver the inputs only now, when the pod is idle
+        for (auto &i : pod.pending) pod.ptr->setInPin(i.first,i.second);
+        pod.pending.clear();
+        for (int l : p.in) {
+            AriaLink &lnk = *plan_links[l].lnk;
+            if (lnk.queue.empty()) continue;
+            pod.ptr->setInPin(lnk.pin_to,lnk.queue.front());
+            lnk.queue.pop_front();
+        }
+        pod.dirty = false;
+        pod.rerun = pod.mark;
+        pod.mark = true;
+        if (pod.ptr->getCoreBudget() != pod.budget) pod.ptr->setCoreBudget(pod.budget);
+
+        switch (pod.ptr->Processing()) {
+        case ARIA_RUNNING:
+            pod.running = true;
+            n_running++;
+            if (!pod.rerun) n_first++;
+            if (n_running > stats.max_running) stats.max_running = n_running;
+            break;
+
+        case ARIA_ERROR:
+            internal_error = myformat("pod %s error: %s",nm,pod.ptr->getError().c_str());
+            return false;
+
+        default:
+            break;
+        }
     }
 
-    return state;
+    return true;
+}
+
+void AnnaLSCS::Compile()
+{
+    // pods are numbered in order of their names, which is the order of the map
+    vector<string> names;
+    map<string,int> idx;
+    for (auto &i : pods) {
+        idx[i.first] = names.size();
+        names.push_back(i.first);
+    }
+    const int n = names.size();
+
+    // resolve the links
+    vector<plan_link> lnks;
+    vector<vector<int>> adj(n);
+    vector<int> deg(n,0);
+    for (auto &i : links) {
+        auto f = idx.find(i.first);
+        if (f == idx.end()) continue;
+        for (auto &j : i.second) {
+            auto t = idx.find(j.to);
+            if (t == idx.end()) continue;
+            lnks.push_back({ &j, f->second, t->second });
+            if (t->second == f->second) continue;
+            adj[f->second].push_back(t->second);
+            deg[t->second]++;
+        }
+    }
+
+    // Kahn's algorithm; feedback loops are broken at a free-running pod, or at the first (by name) pod left
+    vector<int> order, pos(n,-1);
+    list<int> q;
+    for (int i = 0; i < n; i++) {
+        if (!deg[i]) q.push_back(i);
+    }
+    while ((int)order.size() < n) {
+        if (q.empty()) {
+            int brk = -1;
+            for (int i = 0; i < n; i++) {
+                if (deg[i] <= 0) continue;
+                if (brk < 0) brk = i;
+                if (pods[names[i]].freerun) {
+                    brk = i;
+                    break;
+                }
+            }
+            q.push_back(brk);
+            deg[brk] = -1;
+        }
+
+        int v = q.front();
+        q.pop_front();
+        pos[v] = order.size();
+        order.push_back(v);
+
+        for (int t : adj[v]) {
+            if (deg[t] > 0 && --deg[t] == 0) q.push_back(t);
+        }
+    }
+
+    plan.assign(n,plan_pod());
+    for (int i = 0; i < n; i++) {
+        plan[i].name = names[order[i]];
+        plan[i].pod = &pods[plan[i].name];
+    }
+
+    plan_links.clear();
+    for (auto &l : lnks) {
+        int li = plan_links.size();
+        plan_links.push_back({ l.lnk, pos[l.from], pos[l.to] });
+        plan[pos[l.from]].out.push_back(li);
+        if (l.lnk->capacity > 0) plan[pos[l.to]].in.push_back(li);
+    }
+    for (auto &p : plan) {
+        p.decoupled = !p.out.empty();
+        for (int l : p.out) {
+            if (!plan_links[l].lnk->capacity) p.decoupled = false;
+        }
+    }
+
+    n_running = n_first = 0;
+    for (auto &p : plan) {
+        if (p.pod->running) n_running++;
+        if (p.pod->running && !p.pod->rerun) n_first++;
+    }
+    recompile = false;
+    repartition = true;
+
+#ifndef NDEBUG
+    string tmp;
+    for (auto &p : plan) tmp += p.name + " ";
+    DBG("Pods order: %s\n",tmp.c_str());
+#endif
+}
+
+void AnnaLSCS::Partition()
+{
+    // explicit budgets are taken first, the rest of the cores is split evenly between the pods running local brains;
+    // pods without brains are only running Lua code, so they get a single core (in case they'll start a brain);
+    // remote pods don't use our cores at all, their explicit budget (if any) applies to the worker's machine
+    int left = cores? cores : (int)thread::hardware_concurrency();
+    int n_auto = 0;
+    for (auto &i : pods) {
+        if (!i.second.ptr || !i.second.host.empty()) continue;
+        if (i.second.cores > 0) left -= i.second.cores;
+        else if (i.second.brainy) n_auto++;
+    }
+
+    int k = 0;
+    for (auto &i : pods) {
+        AriaPod &pod = i.second;
+        if (!pod.ptr) continue;
+        if (pod.cores > 0 || !pod.host.empty()) pod.budget = pod.cores;
+        else if (!pod.brainy) pod.budget = 1;
+        else {
+            pod.budget = (left > 0)? left / n_auto + (k < left % n_auto) : 1;
+            if (pod.budget < 1) pod.budget = 1;
+            k++;
+        }
+        DBG("Pod %s budget: %d cores\n",i.first.c_str(),pod.budget);
+    }
+    repartition = false;
+}
+
+void AnnaLSCS::setCores(int n)
+{
+    cores = (n > 0)? n : 0;
+    repartition = true;
+}
+
+AnnaLSCSStats AnnaLSCS::getStats()
+{
+    AnnaLSCSStats res = stats;
+    for (auto &i : pods) {
+        if (i.second.ptr) res.t_busy += i.second.ptr->getBusyTime();
+    }
+    if (res.t_wall > 0) res.parallelism = res.t_busy / res.t_wall;
+    return res;
+}
+
+uint64_t AnnaLSCS::AvailableMemory()
+{
+    // MemAvailable accounts for the reclaimable caches, which is where the mmap()ed models are
+    FILE* f = fopen("/proc/meminfo","r");
+    if (f) {
+        char buf[256];
+        unsigned long long kb = 0;
+        bool found = false;
+        while (!found && fgets(buf,sizeof(buf),f)) found = (sscanf(buf,"MemAvailable: %llu kB",&kb) == 1);
+        fclose(f);
+        if (found) return kb * 1024ULL;
+    }
+    return (uint64_t)sysconf(_SC_AVPHYS_PAGES) * (uint64_t)sysconf(_SC_PAGESIZE);
+}
+
+double AnnaLSCS::Now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
+}
+
+string AnnaLSCS::getTraceSummary()
+{
+    struct run_rec {
+        int64_t start, end;
+        string pod;
+    };
+    struct pod_rec {
+        int runs = 0, critical = 0;
+        int64_t busy = 0, wait = 0;
+    };
+    vector<pair<int64_t,int64_t>> waves;
+    vector<run_rec> runs;
+    size_t dropped = 0;
+    for (auto &e : AnnaTrace::Collect(&dropped)) {
+        if (!strcmp(e.cat,"lscs") && !strcmp(e.name,"wave")) waves.push_back(make_pair(e.ts,e.ts+e.dur));
+        else if (!strcmp(e.cat,"pod")) runs.push_back({ e.ts, e.ts+e.dur, e.name });
+    }
+    if (waves.empty()) return "No waves traced\n";
+
+    map<string,set<string>> upstream;
+    for (auto &i : links) {
+        for (auto &j : i.second) upstream[j.to].insert(j.from);
+    }
+
+    // runs are split by waves; a pod waits from the wave's start to its first run in that wave
+    map<string,pod_rec> recs;
+    vector<vector<size_t>> by_wave(waves.size());
+    size_t w = 0;
+    for (size_t i = 0; i < runs.size(); i++) {
+        while (w + 1 < waves.size() && runs[i].start >= waves[w+1].first) w++;
+        pod_rec &r = recs[runs[i].pod];
+        bool first = true;
+        for (size_t j : by_wave[w]) first = first && (runs[j].pod != runs[i].pod);
+        if (first && runs[i].start > waves[w].first) r.wait += runs[i].start - waves[w].first;
+        r.runs++;
+        r.busy += runs[i].end - runs[i].start;
+        by_wave[w].push_back(i);
+    }
+
+    // critical path: going back from the last run of the wave, through the linked pods' runs which have finished last
+    string longest;
+    int64_t longest_t = -1;
+    for (size_t i = 0; i < waves.size(); i++) {
+        if (by_wave[i].empty()) continue;
+        size_t cur = by_wave[i].front();
+        for (size_t j : by_wave[i]) {
+            if (runs[j].end > runs[cur].end) cur = j;
+        }
+        string path;
+        for (;;) {
+            recs[runs[cur].pod].critical++;
+            path = path.empty()? runs[cur].pod : runs[cur].pod + " -> " + path;
+            const set<string> &up = upstream[runs[cur].pod];
+            size_t prev = runs.size();
+            for (size_t j : by_wave[i]) {
+                if (j == cur || !up.count(runs[j].pod) || runs[j].end > runs[cur].start) continue;
+                if (prev == runs.size() || runs[j].end > runs[prev].end) prev = j;
+            }
+            if (prev == runs.size()) break;
+            cur = prev;
+        }
+        if (waves[i].second - waves[i].first > longest_t) {
+            longest_t = waves[i].second - waves[i].first;
+            longest = path;
+        }
+    }
+
+    string res = myformat("%zu waves traced (%zu events dropped)\n",waves.size(),dropped);
+    for (auto &i : recs) {
+        res += myformat("\t%s: %d runs, busy %.1f ms, waiting %.1f ms, on critical path in %d waves\n",i.first.c_str(),
+                        i.second.runs,i.second.busy / 1e3,i.second.wait / 1e3,i.second.critical);
+    }
+    res += myformat("Longest wave (%.1f ms): %s\n",longest_t / 1e3,longest.c_str());
+    return res;
+}
+
+bool AnnaLSCS::WaitEvent(int timeout_ms)
+{
+    unique_lock<mutex> lk(evt_mtx);
+    bool r = evt_cv.wait_for(lk,chrono::milliseconds(timeout_ms),[this] { return evt_flag; });
+    evt_flag = false;
+    return r;
+}
+
+void AnnaLSCS::Wake()
+{
+    {
+        lock_guard<mutex> lk(evt_mtx);
+        evt_flag = true;
+    }
+    evt_cv.notify_all();
+}
+
+void AnnaLSCS::Attach(Aria* pod)
+{
+    pod->setNotify([this] { Wake(); });
 }
 
 void AnnaLSCS::Reset(int /*flags*/)
@@ -155,6 +790,11 @@ void AnnaLSCS::Clear()
     pods.clear();
     cfgmap.clear();
     links.clear();
+    plan.clear();
+    plan_links.clear();
+    recompile = true;
+    n_running = 0;
+    stats = AnnaLSCSStats();
 }
 
 AriaPod* AnnaLSCS::addPod(string name)
@@ -165,6 +805,7 @@ AriaPod* AnnaLSCS::addPod(string name)
     }
     AriaPod npod;
     pods[name] = npod;
+    recompile = true;
     return &(pods[name]);
 }
 
@@ -186,6 +827,7 @@ void AnnaLSCS::delPod(string name)
 
     AriaPod npod = pods[name];
     pods.erase(name);
+    recompile = true;
     if (npod.ptr) delete npod.ptr;
 }
 
@@ -195,6 +837,7 @@ void AnnaLSCS::delPod(AriaPod* pod)
         if (&(it->second) == pod) it = pods.erase(it);
         else ++it;
     }
+    recompile = true;
 }
 
 string AnnaLSCS::getPodName(AriaPod* pod)
@@ -216,6 +859,7 @@ void AnnaLSCS::setPodName(AriaPod* pod, string nname)
     old.ptr->setName(nname);
     pods.erase(oname);
     pods[nname] = old;
+    recompile = true;
 
     // update links by replacing old name with the new one
     for (auto it = links.begin(); it != links.end();) {
@@ -252,14 +896,19 @@ bool AnnaLSCS::setPodScript(string name, string path)
         pods[name].ptr = nullptr;
     }
 
-    Aria* ptr = new Aria(path,name);
+    const string &host = pods[name].host;
+    Aria* ptr = host.empty()? new Aria(path,name) : new AriaRemote(host,path,Aria::MakeRelativePath(config_fn,path),name,pods[name].cores);
     if (ptr->getState() != ARIA_READY) {
         internal_error = myformat("Aria error: %s",ptr->getError().c_str());
         delete ptr;
         return false;
     }
 
+    Attach(ptr);
     pods[name].ptr = ptr;
+    pods[name].running = false;
+    pods[name].brainy = ptr->hasLocalBrain();
+    recompile = true;
     return true;
 }
 
@@ -277,6 +926,7 @@ bool AnnaLSCS::Link(AriaLink lnk)
 
     // make the link
     links[lnk.from].push_back(lnk);
+    recompile = true;
     return true;
 }
 
@@ -289,6 +939,7 @@ bool AnnaLSCS::Unlink(AriaLink lnk)
     for (auto it = links.at(lnk.from).begin(); it != links.at(lnk.from).end(); ++it) {
         if (it->pin_from == lnk.pin_from && it->to == lnk.to && it->pin_to == lnk.pin_to) {
             links[lnk.from].erase(it);
+            recompile = true;
             return true;
         }
     }
@@ -303,6 +954,7 @@ vector<AriaLink> AnnaLSCS::getLinksFrom(string name)
 
 void AnnaLSCS::SanitizeLinks()
 {
+    recompile = true;
     for (auto it = links.begin(); it != links.end();) {
         if (!pods.count(it->first)) {
             DBG("Links sanitizer: branch is dead (%s doesn't exist)",it->first.c_str());
@@ -343,6 +995,11 @@ bool AnnaLSCS::WriteTo(string fn)
         return false;
     }
 
+    if (cores) fprintf(f,"Cores = %d\n",cores);
+    if (load_threads) fprintf(f,"LoadThreads = %d\n",load_threads);
+    if (load_reserve >= 0) fprintf(f,"LoadReserve = %d\n",load_reserve);
+    if (load_pod_mb) fprintf(f,"LoadPodMB = %d\n",load_pod_mb);
+
     // write pods
     int n = 0;
     for (auto &&i : pods) {
@@ -350,6 +1007,10 @@ bool AnnaLSCS::WriteTo(string fn)
         fprintf(f,"Pod%dName = %s\n",n,i.first.c_str());
         fprintf(f,"Pod%dScript = %s\n",n,Aria::MakeRelativePath(fn,i.second.ptr->getFName()).c_str());
         fprintf(f,"Pod%dDims = %d %d %d %d\n",n,i.second.x,i.second.y,i.second.w,i.second.h);
+        if (i.second.freerun) fprintf(f,"Pod%dFreeRun = 1\n",n);
+        if (i.second.cores) fprintf(f,"Pod%dCores = %d\n",n,i.second.cores);
+        if (!i.second.host.empty()) fprintf(f,"Pod%dHost = %s\n",n,i.second.host.c_str());
+        if (i.second.load_mb) fprintf(f,"Pod%dLoadMB = %d\n",n,i.second.load_mb);
         n++;
     }
     fprintf(f,"NPods = %d\n",n);
@@ -357,8 +1018,11 @@ bool AnnaLSCS::WriteTo(string fn)
     // write links
     fprintf(f,"\n\nCONNECTIONS\n\n");
     for (auto &&i: links) {
-        for (auto &&j : i.second)
-            fprintf(f,"%s.%d -> %s.%d\n",j.from.c_str(),j.pin_from,j.to.c_str(),j.pin_to);
+        for (auto &&j : i.second) {
+            fprintf(f,"%s.%d -> %s.%d",j.from.c_str(),j.pin_from,j.to.c_str(),j.pin_to);
+            if (j.capacity > 0) fprintf(f," queue %d %s",j.capacity,link_policies[j.policy]);
+            fprintf(f,"\n");
+        }
     }
 
     fclose(f);
@@ -405,10 +1069,20 @@ bool AnnaLSCS::ParseConfig()
             if (r == 2) {
                 lnk.from = key;
                 lnk.pin_from = atoi(val);
-                r = fscanf(f," -> %255[^.].%255s\n",key,val);
+                r = fscanf(f," -> %255[^.].%255s",key,val);
                 if (r == 2) {
                     lnk.to = key;
                     lnk.pin_to = atoi(val);
+                    // optional queue parameters: "queue <capacity> [block|drop|coalesce]"
+                    lnk.capacity = 0;
+                    lnk.policy = ARIA_LINK_BLOCK;
+                    val[0] = 0;
+                    if (fscanf(f,"%*[ \t]%2047[^\n]",val) == 1 && !ParseQueue(lnk,val)) {
+                        internal_error = myformat("Can't parse queue parameters '%s' in %s",val,config_fn.c_str());
+                        fclose(f);
+                        return false;
+                    }
+                    fscanf(f," "); // skip to the next line
                     links[lnk.from].push_back(lnk);
                 }
             }
@@ -434,13 +1108,19 @@ endparse:
 
 bool AnnaLSCS::CreatePods()
 {
+    cores = atoi(cfgmap["cores"].c_str());
     int npods = atoi(cfgmap["npods"].c_str());
     if (!npods) {
         internal_error = "No pods have been registered";
         return false;
     }
 
-    // create pods first
+    // check the pods' records first
+    struct new_pod {
+        string name, script;
+        AriaPod pod;
+    };
+    vector<new_pod> lst(npods);
     for (int i = 0; i < npods; i++) {
         // extract and check pod's name
         string pnm = cfgmap[myformat("pod%dname",i)];
@@ -449,9 +1129,11 @@ bool AnnaLSCS::CreatePods()
             return false;
         }
         // should be unique
-        if (pods.count(pnm)) {
-            internal_error = myformat("Duplicate pod name for pod %d",i);
-            return false;
+        for (int j = 0; j < i; j++) {
+            if (lst[j].name == pnm) {
+                internal_error = myformat("Duplicate pod name for pod %d",i);
+                return false;
+            }
         }
 
         // extract pod's script
@@ -461,23 +1143,91 @@ bool AnnaLSCS::CreatePods()
             return false;
         }
         // and fix its path
-        pscr = Aria::FixPath(config_fn,pscr);
+        lst[i].script = Aria::FixPath(config_fn,pscr);
+        lst[i].name = pnm;
 
-        // actually create the pod
-        AriaPod pod;
-        pod.ptr = new Aria(pscr,pnm);
-        if (pod.ptr->getState() != ARIA_READY) {
-            internal_error = myformat("Unable to start pod: %s",pod.ptr->getError().c_str());
-            delete pod.ptr;
-            return false;
-        }
+        AriaPod &pod = lst[i].pod;
+        pod.host = cfgmap[myformat("pod%dhost",i)];
+        pod.cores = atoi(cfgmap[myformat("pod%dcores",i)].c_str());
 
         // extract pod's graphical dimensions (if exists)
         string dims = cfgmap[myformat("pod%ddims",i)];
         if (!dims.empty()) sscanf(dims.c_str(),"%d %d %d %d",&pod.x,&pod.y,&pod.w,&pod.h);
 
-        // register the pod
-        pods[pnm] = pod;
+        // pods without inputs always run, others can be forced to
+        pod.freerun = atoi(cfgmap[myformat("pod%dfreerun",i)].c_str());
+
+        pod.load_mb = atoi(cfgmap[myformat("pod%dloadmb",i)].c_str());
+    }
+
+    // actually create the pods, either locally or in remote LISA workers; the scripts are usually loading their models
+    // right away, so it's done concurrently, but a new pod isn't started while the memory is running low
+    load_threads = atoi(cfgmap["loadthreads"].c_str());
+    int nthr = (load_threads > 0)? load_threads : LSCS_LOAD_THREADS;
+    nthr = max(1,min(nthr,npods));
+    string reserve = cfgmap["loadreserve"];
+    load_reserve = reserve.empty()? -1 : atoi(reserve.c_str());
+    uint64_t min_free = ((load_reserve < 0)? LSCS_LOAD_RESERVE_MB : load_reserve) * 1024ULL * 1024ULL;
+    load_pod_mb = atoi(cfgmap["loadpodmb"].c_str());
+
+    // MemAvailable doesn't drop until the models are actually read in (and the mmap()ed ones never make it drop),
+    // so each pod being created is charged with its expected cost until it's done
+    auto cost = [&](int i) -> uint64_t {
+        int mb = lst[i].pod.load_mb? lst[i].pod.load_mb : (load_pod_mb? load_pod_mb : LSCS_LOAD_POD_MB);
+        return max(mb,0) * 1024ULL * 1024ULL;
+    };
+
+    mutex mtx;
+    condition_variable cv;
+    int next = 0, in_flight = 0;
+    uint64_t charged = 0;
+    double t0 = Now();
+    vector<thread> thr;
+    for (int k = 0; k < nthr; k++) {
+        thr.push_back(thread([&] {
+            for (;;) {
+                int i;
+                {
+                    // at least one pod is always being created, so it won't stall
+                    unique_lock<mutex> lk(mtx);
+                    while (next < npods && in_flight && AvailableMemory() < min_free + charged + cost(next))
+                        cv.wait_for(lk,chrono::milliseconds(100));
+                    if (next >= npods) return;
+                    i = next++;
+                    in_flight++;
+                    charged += cost(i);
+                }
+
+                AriaPod &pod = lst[i].pod;
+                double t = Now();
+                pod.ptr = pod.host.empty()? new Aria(lst[i].script,lst[i].name) :
+                                            new AriaRemote(pod.host,lst[i].script,Aria::MakeRelativePath(config_fn,lst[i].script),
+                                                           lst[i].name,pod.cores);
+                pod.t_load = Now() - t;
+                DBG("Pod %s created in %.1f ms\n",lst[i].name.c_str(),pod.t_load);
+
+                lock_guard<mutex> lk(mtx);
+                in_flight--;
+                charged -= cost(i);
+                cv.notify_all();
+            }
+        }));
+    }
+    for (auto &i : thr) i.join();
+    stats.t_startup = Now() - t0;
+
+    // register the pods, or clean up if any of them has failed
+    for (auto &i : lst) {
+        if (i.pod.ptr->getState() != ARIA_READY) {
+            internal_error = myformat("Unable to start pod %s: %s",i.name.c_str(),i.pod.ptr->getError().c_str());
+            for (auto &j : lst) delete j.pod.ptr;
+            return false;
+        }
+    }
+    for (auto &i : lst) {
+        i.pod.brainy = i.pod.ptr->hasLocalBrain();
+        Attach(i.pod.ptr);
+        pods[i.name] = i.pod;
     }
 
     // now check the connections
@@ -505,23 +1255,32 @@ bool AnnaLSCS::CreatePods()
     return true;
 }
 
-void AnnaLSCS::FanOut(string from)
+void AnnaLSCS::FanOut(const plan_pod& p)
 {
-    if (!pods.count(from) || !links.count(from)) return;
-    Aria* pod = pods[from].ptr;
-    if (!pod) return;
-
-    map<int,string> outs;
-    for (auto &&i : links[from]) {
-        if (!outs.count(i.pin_from))
-            outs[i.pin_from] = pod->getOutPin(i.pin_from);
+    Aria* pod = p.pod->ptr;
+    if (!pod || p.out.empty()) return;
+    AnnaTraceSpan span("fanout",p.name.c_str());
+
+    // every output pin is read only once; buffers are shared by all the receivers, not copied
+    fan_data.resize(pod->getNumOutPins());
+    fan_got.assign(fan_data.size(),false);
+    for (int l : p.out) {
+        AriaLink &lnk = *plan_links[l].lnk;
+        if (lnk.pin_from < 0 || lnk.pin_from >= (int)fan_data.size()) continue;
+        AriaPinData &out = fan_data[lnk.pin_from];
+        if (!fan_got[lnk.pin_from]) {
+            out = pod->getOutPinData(lnk.pin_from);
+            fan_got[lnk.pin_from] = true;
+        }
 
-        Aria* recv = pods[i.to].ptr;
-        if (!recv) {
-            internal_error = myformat("Receiver pod %s doesn't exist",i.to.c_str());
+        AriaPod &recv = *plan[plan_links[l].to].pod;
+        if (!recv.ptr) {
+            internal_error = myformat("Receiver pod %s doesn't exist",lnk.to.c_str());
             return;
         }
-        if (!outs[i.pin_from].empty())
-            recv->setInPin(i.pin_to,outs[i.pin_from]);
+        // the receiver might be running right now, so it will get the data when it's idle
+        if (out.empty()) continue;
+        if (lnk.capacity > 0) Enqueue(lnk,out);
+        else recv.pending.push_back(make_pair(lnk.pin_to,out));
     }
 }
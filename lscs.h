@@ -1,22 +1,64 @@
 #pragma once
 
 #include <list>
+#include <deque>
 #include <map>
 #include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
 #include "brain.h"
 #include "aria.h"
 
-#define LSCS_VERSION "0.1.4"
+#define LSCS_VERSION "0.2.8"
+#define LSCS_STATE_MAGIC "LSCS"
+#define LSCS_STATE_VERSION 1
+#define LSCS_LOAD_RESERVE_MB 1024
+#define LSCS_LOAD_POD_MB 1024
+#define LSCS_LOAD_THREADS 2
 
 struct AriaPod {
     Aria* ptr = nullptr;
-    bool mark = false;
+    bool mark = false;                                  // has been started in the current wave
+    bool running = false;
+    bool dirty = false;                                 // global input has been changed
+    bool freerun = false;                               // runs on every wave, even without new inputs
+    bool rerun = false;                                 // has been started again within the current wave
+    std::vector<std::pair<int,AriaPinData>> pending;    // input pin data waiting for the pod to become idle
+    int cores = 0;                                      // explicit CPU cores budget (0 = automatic)
+    int budget = 0;                                     // actual budget, applied when the pod is idle
+    bool brainy = false;                                // has a local brain, so it takes a share of cores
+    std::string host;                                   // host:port of the LISA worker running the pod (empty = local)
     int x = 0, y = 0, w = 0, h = 0;
+    double t_load = 0;                                  // time it took to create the pod (run its script's init), ms
+    int load_mb = 0;                                    // memory expected to be taken by loading the pod, MB (0 = LoadPodMB)
+};
+
+struct AnnaLSCSStats {
+    int n_waves = 0;
+    int max_running = 0;                                // max number of pods running at the same time
+    double t_wall = 0;                                  // total time of all waves, ms
+    double t_busy = 0;                                  // total time of all processing() calls, ms
+    double parallelism = 0;                             // average number of pods running during a wave
+    double t_startup = 0;                               // time it took to create all the pods, ms
+};
+
+enum AriaLinkPolicy {
+    ARIA_LINK_BLOCK,                                    // the producer isn't started while the queue is full
+    ARIA_LINK_DROP,                                     // the oldest data is dropped
+    ARIA_LINK_COALESCE,                                 // the newest data replaces the last one in the queue
+    ARIA_LINK_NUMPOLICIES
 };
 
 struct AriaLink {
     std::string from, to;
-    int pin_from, pin_to;
+    int pin_from = 0, pin_to = 0;
+    int capacity = 0;                                   // queue size; 0 = not queued, everything is delivered at once
+    AriaLinkPolicy policy = ARIA_LINK_BLOCK;
+
+    std::deque<AriaPinData> queue;                      // one item is delivered per receiver's run
+    int max_depth = 0;
+    long n_passed = 0, n_dropped = 0;
 };
 
 class AnnaLSCS : public AnnaBrain
@@ -68,13 +110,70 @@ public:
 
     bool WriteTo(std::string fn);
 
+    // total number of CPU cores to be shared by the pods (0 = all available)
+    int getCores()                                              { return cores; }
+    void setCores(int n);
+
+    AnnaLSCSStats getStats();
+
+    // per-pod busy and waiting times, and the critical path of the waves, from the trace (see trace.h)
+    std::string getTraceSummary();
+
+    // blocks until a pod finishes its job or Wake() is called, returns false on timeout
+    bool WaitEvent(int timeout_ms);
+    void Wake();
+
 private:
     std::string config_fn;
     std::map<std::string,std::string> cfgmap;
     std::map<std::string,AriaPod> pods;
     std::map<std::string,std::vector<AriaLink> > links;
 
+    // execution plan: the scheme resolved into dense arrays, so the hot path doesn't look anything up by name;
+    // it's recompiled whenever the pods or the links are changed
+    struct plan_pod {
+        std::string name;
+        AriaPod* pod = nullptr;
+        std::vector<int> out;                           // outgoing links (indices into plan_links)
+        std::vector<int> in;                            // incoming queued links
+        bool decoupled = false;                         // has outgoing links, and all of them are queued
+    };
+    struct plan_link {
+        AriaLink* lnk;
+        int from, to;                                   // indices into plan
+    };
+    std::vector<plan_pod> plan;                         // in topological order of the links graph
+    std::vector<plan_link> plan_links;
+    std::vector<AriaPinData> fan_data;                  // FanOut() scratch space, one per output pin
+    std::vector<bool> fan_got;
+    bool recompile = true;
+    int n_running = 0;
+    int n_first = 0;                                    // pods running for the first time in the current wave
+    int cores = 0;
+    int load_threads = 0;                               // as set in the config (0 = not set)
+    int load_reserve = -1;
+    int load_pod_mb = 0;
+    bool repartition = true;
+    AnnaLSCSStats stats;
+    double wave_start = 0;
+    int64_t wave_trace = 0;
+
+    std::mutex evt_mtx;
+    std::condition_variable evt_cv;
+    bool evt_flag = false;
+
     bool ParseConfig();
     bool CreatePods();
-    void FanOut(std::string from);
+    void Attach(Aria* pod);
+    void Compile();
+    void Partition();
+    bool isReady(const plan_pod& p);
+    bool isBlocked(const plan_pod& p);
+    bool canRerun(const plan_pod& p);
+    void Enqueue(AriaLink& lnk, const AriaPinData& data);
+    bool Dispatch();
+    void FanOut(const plan_pod& p);
+
+    static double Now();
+    static uint64_t AvailableMemory();
 };
@@ -0,0 +1,123 @@
+/* ANNA - Automatic Neural Network Assistant
+ * LSCS scheduler benchmark on a synthetic scheme
+ * (C) Dmitry 'MatrixS_Master' Solovyev, 2023-2025
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include "lscs.h"
+
+using namespace std;
+
+int g_pods = 200, g_waves = 200, g_width = 10, g_fanout = 3;
+string g_dir = "/tmp";
+
+static double now_us()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (double)ts.tv_sec * 1e6 + (double)ts.tv_nsec / 1e3;
+}
+
+// Layered DAG: every pod feeds a few pods of the next layer, so every wave runs all the pods
+static string make_scheme()
+{
+    string dir = g_dir + "/lscsbench_" + to_string(getpid());
+    string cmd = "mkdir -p " + dir;
+    if (system(cmd.c_str())) return "";
+
+    FILE* f = fopen((dir + "/pod.lua").c_str(),"w");
+    if (!f) return "";
+    fprintf(f,"setiocount(%d,1)\n",g_fanout);
+    fprintf(f,"v = 0\n");
+    fprintf(f,"function processing() v = v + 1 end\n");
+    fprintf(f,"function inpin(n,s) v = v + #s end\n");
+    fprintf(f,"function outpin(n) return tostring(v) end\n");
+    fclose(f);
+
+    string fn = dir + "/bench.lscs";
+    f = fopen(fn.c_str(),"w");
+    if (!f) return "";
+    for (int i = 0; i < g_pods; i++) {
+        fprintf(f,"Pod%dName = p%03d\n",i,i);
+        fprintf(f,"Pod%dScript = pod.lua\n",i);
+        if (i < g_width) fprintf(f,"Pod%dFreeRun = 1\n",i);
+    }
+    fprintf(f,"NPods = %d\n\n\nCONNECTIONS\n\n",g_pods);
+
+    unsigned seed = 1;
+    for (int i = 0; i + g_width < g_pods; i++) {
+        int layer = i / g_width + 1;
+        for (int j = 0; j < g_fanout; j++) {
+            seed = seed * 1103515245 + 12345;
+            int to = layer * g_width + (seed >> 16) % g_width;
+            if (to >= g_pods) to = g_pods - 1;
+            fprintf(f,"p%03d.0 -> p%03d.%d\n",i,to,j);
+        }
+    }
+    fclose(f);
+    return fn;
+}
+
+int main(int argc, char* argv[])
+{
+    int opt;
+    while ((opt = getopt(argc,argv,"p:w:l:f:d:")) != -1) {
+        switch (opt) {
+        case 'p': g_pods = atoi(optarg); break;
+        case 'w': g_waves = atoi(optarg); break;
+        case 'l': g_width = atoi(optarg); break;
+        case 'f': g_fanout = atoi(optarg); break;
+        case 'd': g_dir = optarg; break;
+        default:
+            fprintf(stderr,"Usage: %s [-p pods] [-w waves] [-l layer_width] [-f fan_out] [-d directory]\n",argv[0]);
+            return -1;
+        }
+    }
+    if (g_pods < 1 || g_waves < 1 || g_width < 1 || g_fanout < 1) return -1;
+
+    string fn = make_scheme();
+    if (fn.empty()) {
+        fprintf(stderr,"Unable to create the scheme in %s\n",g_dir.c_str());
+        return 1;
+    }
+
+    double t = now_us();
+    AnnaLSCS* sys = new AnnaLSCS(fn);
+    t = now_us() - t;
+    if (sys->getState() == ANNA_ERROR) {
+        fprintf(stderr,"Unable to load the scheme: %s\n",sys->getError().c_str());
+        return 1;
+    }
+    printf("%d pods, %d links per pod, loaded in %.1f ms\n",g_pods,g_fanout,t / 1e3);
+
+    // time spent in Processing() calls is the scheduler's own overhead, the pods are running on their own threads
+    double t_sched = 0;
+    int waves = 0;
+    t = now_us();
+    while (waves < g_waves) {
+        double t0 = now_us();
+        AnnaState s = sys->Processing();
+        t_sched += now_us() - t0;
+        if (s == ANNA_ERROR) {
+            fprintf(stderr,"Error: %s\n",sys->getError().c_str());
+            break;
+        }
+        if (s == ANNA_TURNOVER) waves++;
+        else sys->WaitEvent(1000);
+    }
+    t = now_us() - t;
+
+    AnnaLSCSStats st = sys->getStats();
+    printf("%d waves: %.3f ms per wave, scheduler %.1f us per wave (%.2f us per pod run), parallelism %.2f\n",
+           waves,t / 1e3 / waves,t_sched / waves,t_sched / waves / g_pods,st.parallelism);
+
+    delete sys;
+    string cmd = "rm -rf " + fn.substr(0,fn.rfind('/'));
+    if (system(cmd.c_str())) return 1;
+    return 0;
+}
@@ -51,7 +51,7 @@ AnnaClient::AnnaClient(AnnaConfig* cfg, string server, bool mk_dummy, waitfuncti
     // begin the session
     if (request(true,"/sessionStart",ANNA_CLIENT_VERSION).empty()) {
         state = ANNA_ERROR;
-        internal_error = "Unable to create remote session!";
+        internal_error = "Unable to create remote session! (the server might not support client ver. " ANNA_CLIENT_VERSION ")";
         return;
     }
     startKeepAlives(true);
@@ -113,7 +113,7 @@ AnnaConfig AnnaClient::getConfig()
     size_t n = fromBase64(&cfg,sizeof(cfg),r);
     if (n != sizeof(cfg)) {
         state = ANNA_ERROR;
-        internal_error = "Failed to read encoded config";
+        internal_error = myformat("Failed to read encoded config: %zu bytes instead of %zu (client and server versions don't match?)",n,sizeof(cfg));
     } else
         config = cfg;
 
@@ -6,7 +6,7 @@
 #include "brain.h"
 
 // Keep minor version in sync with the server
-#define ANNA_CLIENT_VERSION "0.6.0"
+#define ANNA_CLIENT_VERSION "0.7.0"
 
 #define ANNA_CLIENT_TIMEOUT (4*60)
 #define ANNA_CLIENT_CHUNK (8ULL * 1024ULL * 1024ULL)
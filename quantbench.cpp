@@ -0,0 +1,183 @@
+/* ANNA - Automatic Neural Network Assistant
+ * Quantized dot product kernels benchmark and cross-check
+ * (C) Dmitry 'MatrixS_Master' Solovyev, 2023-2025
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include "ggml.h"
+
+using namespace std;
+
+int g_len = 4096, g_rows = 512, g_iters = 20, g_batch = 0, g_threads = 1;
+
+static const ggml_type g_types[] = { GGML_TYPE_Q4_0, GGML_TYPE_Q8_0, GGML_TYPE_Q4_K, GGML_TYPE_Q5_K, GGML_TYPE_Q6_K,
+                                   GGML_TYPE_IQ2_XXS, GGML_TYPE_IQ2_XS, GGML_TYPE_IQ3_XXS };
+static const char* g_variants[] = { "native", "base", "avx2", "avx512", "avx512vnni" };
+
+static double now_us()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (double)ts.tv_sec * 1e6 + (double)ts.tv_nsec / 1e3;
+}
+
+// mul_mat of a square weight matrix and a batch of activations (as in the prompt processing), checked against vec_dot
+static void bench_gemm(ggml_type t, int batch, const vector<float> &wsrc, const vector<float> &asrc, const vector<float> &imat)
+{
+    size_t wsz = ggml_row_size(t,g_len) * g_len;
+    size_t mem = wsz + (size_t)g_len * batch * sizeof(float) * 3 + ggml_tensor_overhead() * 4 + ggml_graph_overhead() + (16 << 20);
+    ggml_init_params ip = { mem, NULL, false };
+    ggml_context* ctx = ggml_init(ip);
+
+    ggml_tensor* w = ggml_new_tensor_2d(ctx,t,g_len,g_len);
+    ggml_tensor* a = ggml_new_tensor_2d(ctx,GGML_TYPE_F32,g_len,batch);
+    vector<int64_t> hist(16);
+    ggml_quantize_chunk(t,wsrc.data(),w->data,0,g_len,g_len,hist.data(),imat.data());
+    memcpy(a->data,asrc.data(),(size_t)g_len * batch * sizeof(float));
+
+    ggml_tensor* r = ggml_mul_mat(ctx,w,a);
+    ggml_cgraph* gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf,r);
+    ggml_graph_compute_with_ctx(ctx,gf,g_threads); // warm-up
+
+    int n = 0;
+    double tm = now_us();
+    do {
+        ggml_graph_compute_with_ctx(ctx,gf,g_threads);
+        n++;
+    } while (n < g_iters && now_us() - tm < 1e6);
+    tm = (now_us() - tm) / n;
+
+    // the activations are quantized just like mul_mat does it
+    ggml_type_traits_t tt = ggml_internal_get_type_traits(t);
+    size_t ysz = ggml_row_size(tt.vec_dot_type,g_len);
+    vector<uint8_t> y(ysz * batch);
+    for (int c = 0; c < batch; c++)
+        ggml_internal_get_type_traits(tt.vec_dot_type).from_float(asrc.data() + (size_t)c * g_len,y.data() + ysz * c,g_len);
+
+    int bad = 0;
+    const float* res = (const float*)r->data;
+    for (int c = 0; c < batch; c++) {
+        for (int i = c % 61; i < g_len; i += 61) {
+            float v;
+            tt.vec_dot(g_len,&v,(const char*)w->data + ggml_row_size(t,g_len) * i,y.data() + ysz * c);
+            if (memcmp(&v,&res[(size_t)c * g_len + i],sizeof(v))) bad++;
+        }
+    }
+
+    printf("%-7s batch %4d %9.2f ms %9.1f tokens/s %7.1f GOPS  %s\n",ggml_type_name(t),batch,tm / 1e3,batch / tm * 1e6,
+           2.0 * g_len * g_len * batch / tm / 1e3,bad? "differs from vec_dot" : "bit-exact to vec_dot");
+    ggml_free(ctx);
+}
+
+static uint64_t hash_bits(const vector<float> &v)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    const uint8_t* p = (const uint8_t*)v.data();
+    for (size_t i = 0; i < v.size() * sizeof(float); i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+int main(int argc, char* argv[])
+{
+    int opt;
+    while ((opt = getopt(argc,argv,"n:r:i:g:t:")) != -1) {
+        switch (opt) {
+        case 'n': g_len = atoi(optarg); break;
+        case 'r': g_rows = atoi(optarg); break;
+        case 'i': g_iters = atoi(optarg); break;
+        case 'g': g_batch = atoi(optarg); break;
+        case 't': g_threads = atoi(optarg); break;
+        default:
+            fprintf(stderr,"Usage: %s [-n row_length] [-r rows] [-i iterations] [-g max_batch [-t threads]]\n",argv[0]);
+            return -1;
+        }
+    }
+    if (g_len < 256 || g_len % 256 || g_rows < 1 || g_iters < 1 || g_batch < 0 || g_threads < 1) {
+        fprintf(stderr,"Row length must be a multiple of 256\n");
+        return -1;
+    }
+
+    // the first ggml_init() selects the kernels, and initializes the FP16 tables
+    ggml_init_params ip = { 1024, NULL, true };
+    ggml_context* ctx = ggml_init(ip);
+
+    vector<string> vars;
+    for (auto i : g_variants)
+        if (ggml_cpu_set_kernels(i)) vars.push_back(i);
+    printf("Row length %d, %d rows, %d iterations; kernels available:",g_len,g_rows,g_iters);
+    for (auto &i : vars) printf(" %s",i.c_str());
+    printf("\n\n");
+
+    srand(1);
+    vector<float> src((size_t)g_len * g_rows), act(g_len);
+    for (auto &i : src) i = (float)rand() / RAND_MAX * 2.f - 1.f;
+    for (auto &i : act) i = (float)rand() / RAND_MAX * 2.f - 1.f;
+    vector<float> imat(g_len,1.f);
+
+    if (g_batch) {
+        // GEMM mode: the best kernels available, on a g_len x g_len matrix
+        ggml_cpu_set_kernels(vars.back().c_str());
+        vector<float> wsrc((size_t)g_len * g_len), asrc((size_t)g_len * g_batch);
+        for (auto &i : wsrc) i = (float)rand() / RAND_MAX * 2.f - 1.f;
+        for (auto &i : asrc) i = (float)rand() / RAND_MAX * 2.f - 1.f;
+        for (auto t : g_types) {
+            int b = 1;
+            for (; b < g_batch; b *= 4) bench_gemm(t,b,wsrc,asrc,imat);
+            bench_gemm(t,g_batch,wsrc,asrc,imat);
+            printf("\n");
+        }
+        ggml_quantize_free();
+        ggml_free(ctx);
+        return 0;
+    }
+
+    for (auto t : g_types) {
+        // the data is quantized once, by the baseline (the first variant), so all the variants get the same input
+        ggml_cpu_set_kernels(vars.front().c_str());
+        ggml_type_traits_t tt = ggml_internal_get_type_traits(t);
+        ggml_type_traits_t vt = ggml_internal_get_type_traits(tt.vec_dot_type);
+        size_t rsz = ggml_row_size(t,g_len);
+        vector<uint8_t> x(rsz * g_rows), y(ggml_row_size(tt.vec_dot_type,g_len));
+        vector<int64_t> hist(16);
+        ggml_quantize_chunk(t,src.data(),x.data(),0,g_rows,g_len,hist.data(),imat.data()); // flat importance for the IQ types
+        vt.from_float(act.data(),y.data(),g_len);
+
+        vector<float> ref;
+        for (auto &v : vars) {
+            ggml_cpu_set_kernels(v.c_str());
+            ggml_vec_dot_t dot = ggml_internal_get_type_traits(t).vec_dot;
+            vector<float> res(g_rows);
+
+            double tm = now_us();
+            for (int it = 0; it < g_iters; it++)
+                for (int r = 0; r < g_rows; r++) dot(g_len,&res[r],x.data() + rsz * r,y.data());
+            tm = now_us() - tm;
+
+            if (ref.empty()) ref = res;
+            double md = 0;
+            for (int r = 0; r < g_rows; r++)
+                md = fmax(md,fabs(res[r] - ref[r]) / fmax(fabs(ref[r]),1e-6));
+
+            double calls = (double)g_iters * g_rows;
+            printf("%-7s %-11s %8.1f ns/row %7.2f GB/s  hash %016llx  %s (max rel.diff %.2e)\n",
+                   ggml_type_name(t),v.c_str(),tm * 1e3 / calls,rsz * calls / tm / 1e3,(unsigned long long)hash_bits(res),
+                   (res == ref)? "bit-exact" : "differs",md);
+        }
+        printf("\n");
+    }
+
+    ggml_quantize_free();
+    ggml_free(ctx);
+    return 0;
+}
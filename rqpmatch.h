@@ -0,0 +1,233 @@
+/* ANNA - Automatic Neural Network Assistant
+ * Streaming requester plugin tag matcher
+ * (C) Dmitry 'MatrixS_Master' Solovyev, 2023-2025
+ * */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <regex>
+
+// how much of unmatched text regex requesters are allowed to keep around while waiting for a start tag
+#define ANNA_RQP_REGEX_WINDOW (16UL * 1024UL)
+
+struct AnnaRQPMatch {
+    int id;                                 // requester ID, as returned by addRequester()
+    std::string body;                       // the text between the start and the stop tags
+    std::vector<std::string> bcaps, ecaps;  // regex captures of the start and the stop tags (index 0 is the whole match)
+};
+
+/*
+ * All literal tags of all requesters are compiled into a single Aho-Corasick automaton,
+ * so the text is scanned exactly once, as it arrives, regardless of the number of requesters.
+ * Regex requesters can't be done this way, so each of them keeps a small window of
+ * not-yet-matched text instead of re-scanning the whole conversation.
+ * */
+class AnnaRQPMatcher
+{
+public:
+    int addRequester(const std::string& prefix, const std::string& suffix, bool regex = false)
+    {
+        rqp_rec r;
+        r.prefix = prefix;
+        r.suffix = suffix;
+        r.regex = regex;
+        if (regex) {
+            try {
+                r.bex = std::regex(prefix);
+                r.eex = std::regex(suffix);
+            } catch (const std::regex_error&) {
+                r.valid = false;
+            }
+        }
+        reqs.push_back(r);
+        dirty = true;
+        return (int)reqs.size() - 1;
+    }
+
+    int size() const { return reqs.size(); }
+
+    void clear()
+    {
+        reqs.clear();
+        nodes.clear();
+        pats.clear();
+        cur = 0;
+        dirty = true;
+    }
+
+    // forget about everything seen so far (e.g. a new dialog has been started)
+    void reset()
+    {
+        for (auto &i : reqs) {
+            i.fsm = 0;
+            i.body.clear();
+            i.window.clear();
+        }
+        cur = 0;
+    }
+
+    std::vector<AnnaRQPMatch> feed(const std::string& chunk)
+    {
+        std::vector<AnnaRQPMatch> res;
+        if (reqs.empty() || chunk.empty()) return res;
+        if (dirty) compile();
+
+        for (int i = 0; i < (int)reqs.size(); i++) {
+            if (reqs[i].regex) feed_regex(i,chunk,res);
+        }
+        if (pats.empty()) return res;
+
+        std::vector<char> fired(reqs.size());
+        for (auto c : chunk) {
+            cur = nodes[cur].next[(unsigned char)c];
+            for (auto &r : reqs) {
+                if (r.fsm && !r.regex) r.body += c;
+            }
+
+            const auto & out = nodes[cur].out;
+            if (out.empty()) continue;
+
+            std::fill(fired.begin(),fired.end(),0);
+            for (int p : out) {
+                rqp_rec & r = reqs[pats[p].req];
+                if (fired[pats[p].req]) continue; // one transition per requester per character
+
+                if (!pats[p].suffix && !r.fsm) {
+                    fired[pats[p].req] = 1;
+                    r.body.clear();
+                    if (r.suffix.empty()) res.push_back(AnnaRQPMatch { pats[p].req, "", {}, {} });
+                    else r.fsm = 1;
+
+                } else if (pats[p].suffix && r.fsm && r.body.length() >= r.suffix.length()) {
+                    // the stop tag must not overlap the start tag
+                    fired[pats[p].req] = 1;
+                    r.body.erase(r.body.length() - r.suffix.length());
+                    res.push_back(AnnaRQPMatch { pats[p].req, r.body, {}, {} });
+                    r.body.clear();
+                    r.fsm = 0;
+                }
+            }
+        }
+
+        return res;
+    }
+
+private:
+    struct rqp_rec {
+        std::string prefix, suffix;
+        bool regex = false, valid = true;
+        int fsm = 0;
+        std::string body, window;
+        std::regex bex, eex;
+        std::vector<std::string> bcaps;
+    };
+
+    struct ac_pattern {
+        int req;
+        bool suffix;
+    };
+
+    struct ac_node {
+        int next[256];
+        int fail = 0;
+        std::vector<int> out;
+        ac_node() { std::fill(next,next+256,-1); }
+    };
+
+    std::vector<rqp_rec> reqs;
+    std::vector<ac_pattern> pats;
+    std::vector<ac_node> nodes;
+    int cur = 0;
+    bool dirty = true;
+
+    void compile()
+    {
+        nodes.assign(1,ac_node());
+        pats.clear();
+        cur = 0;
+        dirty = false;
+
+        // build the trie
+        for (int i = 0; i < (int)reqs.size(); i++) {
+            if (reqs[i].regex || reqs[i].prefix.empty()) continue;
+            add_pattern(reqs[i].prefix,ac_pattern { i, false });
+            if (!reqs[i].suffix.empty()) add_pattern(reqs[i].suffix,ac_pattern { i, true });
+        }
+
+        // BFS to make failure links and turn the trie into a complete DFA
+        std::deque<int> q;
+        for (auto &i : nodes[0].next) {
+            if (i < 0) i = 0;
+            else q.push_back(i);
+        }
+        while (!q.empty()) {
+            int n = q.front();
+            q.pop_front();
+            const auto & fo = nodes[nodes[n].fail].out;
+            nodes[n].out.insert(nodes[n].out.end(),fo.begin(),fo.end());
+
+            for (int c = 0; c < 256; c++) {
+                int s = nodes[n].next[c];
+                if (s < 0) {
+                    nodes[n].next[c] = nodes[nodes[n].fail].next[c];
+                    continue;
+                }
+                nodes[s].fail = nodes[nodes[n].fail].next[c];
+                q.push_back(s);
+            }
+        }
+    }
+
+    void add_pattern(const std::string& str, ac_pattern pat)
+    {
+        int n = 0;
+        for (auto c : str) {
+            int & nx = nodes[n].next[(unsigned char)c];
+            if (nx < 0) {
+                nx = nodes.size();
+                nodes.push_back(ac_node()); // nx is invalid after this point
+            }
+            n = nodes[n].next[(unsigned char)c];
+        }
+        pats.push_back(pat);
+        nodes[n].out.push_back(pats.size()-1);
+    }
+
+    static std::vector<std::string> captures(const std::smatch& m)
+    {
+        std::vector<std::string> r;
+        for (auto &i : m) r.push_back(i.str());
+        return r;
+    }
+
+    void feed_regex(int id, const std::string& chunk, std::vector<AnnaRQPMatch>& res)
+    {
+        rqp_rec & r = reqs[id];
+        if (!r.valid || r.prefix.empty()) return;
+
+        r.window += chunk;
+        std::smatch m;
+        while (!r.window.empty()) {
+            if (!r.fsm) {
+                if (!std::regex_search(r.window,m,r.bex) || !m.length()) break;
+                r.bcaps = captures(m);
+                r.window.erase(0,m.position() + m.length());
+                if (r.suffix.empty()) res.push_back(AnnaRQPMatch { id, "", r.bcaps, {} });
+                else r.fsm = 1;
+
+            } else {
+                if (!std::regex_search(r.window,m,r.eex) || !m.length()) break;
+                res.push_back(AnnaRQPMatch { id, r.window.substr(0,m.position()), r.bcaps, captures(m) });
+                r.window.erase(0,m.position() + m.length());
+                r.fsm = 0;
+            }
+        }
+
+        // nothing to wait for, so we can safely forget old text
+        if (!r.fsm && r.window.length() > ANNA_RQP_REGEX_WINDOW)
+            r.window.erase(0,r.window.length() - ANNA_RQP_REGEX_WINDOW);
+    }
+};
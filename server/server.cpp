@@ -16,7 +16,7 @@
 #include "../vecstore.h"
 
 // Keep minor version in sync with the client
-#define SERVER_VERSION "0.6.0"
+#define SERVER_VERSION "0.7.0"
 #define SERVER_DEBUG 1
 
 #define SERVER_SAVE_DIR "saves"
@@ -79,10 +79,9 @@ struct session {
     string org_fname, res_fname;
 };
 
+// AnnaConfig is sent as is, so the clients with a different layout of it can't work with us
 const char* allowed_versions[] = {
-    "0.4.0",
-    "0.5.0",
-    "0.6.0",
+    "0.7.0",
     NULL
 };
 
@@ -489,6 +488,13 @@ void fix_config(AnnaConfig& cfg)
     if (ps != string::npos) fn.erase(0,ps+1);
     fn = SERVER_MODEL_DIR + string("/") + fn;
     strncpy(cfg.params.model,fn.c_str(),sizeof(cfg.params.model)-1);
+
+    // sanitize the rest of the client-supplied fields
+    if (cfg.ctx_policy < 0 || cfg.ctx_policy >= ANNA_NUM_CTX_POLICIES) cfg.ctx_policy = ANNA_CTX_HALVE;
+    if (cfg.ctx_chunk < 0 || (cfg.params.n_ctx > 0 && cfg.ctx_chunk > cfg.params.n_ctx)) cfg.ctx_chunk = 0;
+    uint8_t fa;
+    memcpy(&fa,&cfg.params.flash_attn,1); // any byte might come from the wire, and not every one is a valid bool
+    cfg.params.flash_attn = (fa != 0);
 }
 
 bool is_workable(int id)
@@ -573,7 +579,7 @@ void install_services(Server* srv)
         AnnaConfig cfg;
         size_t r = from_base64(id,&cfg,sizeof(cfg),req.body.c_str());
         if (r != sizeof(cfg)) {
-            ERROR("Unable to decode params: %zu bytes read, %zu bytes needed\n",r,sizeof(cfg));
+            ERROR("Unable to decode params: %zu bytes read, %zu bytes needed (client version mismatch?)\n",r,sizeof(cfg));
             res.status = BadRequest_400;
             return;
         }
@@ -0,0 +1,181 @@
+/* ANNA - Automatic Neural Network Assistant
+ * Lightweight tracing of LSCS runs, with Chrome trace-event export
+ * (C) Dmitry 'MatrixS_Master' Solovyev, 2023-2025
+ * */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include "trace.h"
+#include "flatjson.h"
+
+using namespace std;
+
+struct trace_buffer {
+    vector<AnnaTraceEvent> ev;
+    atomic<size_t> count;                   // published events
+    atomic<size_t> dropped;
+    atomic<unsigned> gen;                   // session the events belong to
+    uint32_t tid = 0;                       // current owner
+};
+
+// returns the buffer to the free list when its thread exits
+struct trace_owner {
+    trace_buffer* buf = nullptr;
+    ~trace_owner();
+};
+
+atomic<bool> AnnaTrace::enabled(false);
+
+static mutex trace_mtx;                     // guards the lists of buffers and the thread names
+static vector<shared_ptr<trace_buffer>> trace_bufs;
+static vector<trace_buffer*> trace_free;
+static vector<string> trace_names;          // indexed by tid-1
+static atomic<unsigned> trace_gen(0);
+static thread_local trace_owner trace_local;
+static thread_local string trace_tname;
+
+trace_owner::~trace_owner()
+{
+    if (!buf) return;
+    lock_guard<mutex> lk(trace_mtx);
+    trace_free.push_back(buf);
+    buf = nullptr;
+}
+
+static trace_buffer* get_buffer()
+{
+    if (trace_local.buf) return trace_local.buf;
+
+    lock_guard<mutex> lk(trace_mtx);
+    trace_names.push_back(trace_tname);
+    uint32_t tid = trace_names.size();
+
+    // a buffer left by an exited thread is taken over along with its events, which keep their own tid
+    if (!trace_free.empty()) {
+        trace_local.buf = trace_free.back();
+        trace_free.pop_back();
+        trace_local.buf->tid = tid;
+        return trace_local.buf;
+    }
+
+    auto b = make_shared<trace_buffer>();
+    b->ev.resize(ANNA_TRACE_BUFFER);
+    b->count = 0;
+    b->dropped = 0;
+    b->gen = trace_gen.load();
+    b->tid = tid;
+    trace_bufs.push_back(b);
+    trace_local.buf = b.get();
+    return trace_local.buf;
+}
+
+int64_t AnnaTrace::Now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void AnnaTrace::Enable(bool on)
+{
+    // a new session makes the old events invisible, every buffer is reset by its owner on the next write
+    if (on && !isEnabled()) trace_gen++;
+    enabled = on;
+}
+
+void AnnaTrace::End(const char* cat, const char* name, int64_t start)
+{
+    if (!start || !isEnabled()) return;
+    int64_t now = Now();
+    trace_buffer* b = get_buffer();
+
+    unsigned g = trace_gen;
+    size_t n = b->count.load(memory_order_relaxed);
+    if (b->gen != g) {
+        b->count = 0;
+        b->dropped = 0;
+        b->gen = g;
+        n = 0;
+    }
+    if (n >= b->ev.size()) {
+        b->dropped++;
+        return;
+    }
+
+    AnnaTraceEvent &e = b->ev[n];
+    strncpy(e.name,name,sizeof(e.name)-1);
+    e.name[sizeof(e.name)-1] = 0;
+    e.cat = cat;
+    e.ts = start;
+    e.dur = now - start;
+    e.tid = b->tid;
+    b->count.store(n+1,memory_order_release);
+}
+
+void AnnaTrace::setThreadName(const string& name)
+{
+    trace_tname = name;
+    if (!trace_local.buf) return;
+    lock_guard<mutex> lk(trace_mtx);
+    trace_names[trace_local.buf->tid-1] = name;
+}
+
+vector<AnnaTraceEvent> AnnaTrace::Collect(size_t* dropped)
+{
+    vector<AnnaTraceEvent> res;
+    size_t nd = 0;
+    unsigned g = trace_gen;
+    {
+        lock_guard<mutex> lk(trace_mtx);
+        for (auto &b : trace_bufs) {
+            size_t n = b->count.load(memory_order_acquire);
+            if (b->gen != g) continue;
+            res.insert(res.end(),b->ev.begin(),b->ev.begin()+n);
+            nd += b->dropped;
+        }
+    }
+    sort(res.begin(),res.end(),[](const AnnaTraceEvent& a, const AnnaTraceEvent& b) { return a.ts < b.ts; });
+    if (dropped) *dropped = nd;
+    return res;
+}
+
+bool AnnaTrace::WriteJSON(string fn)
+{
+    FILE* f = fopen(fn.c_str(),"w");
+    if (!f) return false;
+
+    vector<AnnaTraceEvent> evs = Collect();
+    int64_t t0 = evs.empty()? 0 : evs.front().ts;
+    fprintf(f,"{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+    bool first = true;
+    {
+        // only the threads which have left some events are named
+        vector<bool> seen;
+        for (auto &e : evs) {
+            if (e.tid > seen.size()) seen.resize(e.tid,false);
+            seen[e.tid-1] = true;
+        }
+        lock_guard<mutex> lk(trace_mtx);
+        for (uint32_t i = 0; i < seen.size() && i < trace_names.size(); i++) {
+            if (!seen[i] || trace_names[i].empty()) continue;
+            fprintf(f,"%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":%s}}",
+                    first? "" : ",\n",i+1,AnnaJSONRecord::escape(trace_names[i]).c_str());
+            first = false;
+        }
+    }
+    for (auto &e : evs) {
+        fprintf(f,"%s{\"name\":%s,\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":1,\"tid\":%u}",
+                first? "" : ",\n",AnnaJSONRecord::escape(e.name).c_str(),e.cat,(long long)(e.ts-t0),(long long)e.dur,e.tid);
+        first = false;
+    }
+
+    fprintf(f,"\n]}\n");
+    bool ok = !ferror(f);
+    fclose(f);
+    return ok;
+}
@@ -0,0 +1,62 @@
+/* ANNA - Automatic Neural Network Assistant
+ * Lightweight tracing of LSCS runs, with Chrome trace-event export
+ * (C) Dmitry 'MatrixS_Master' Solovyev, 2023-2025
+ * */
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <atomic>
+
+#define ANNA_TRACE_BUFFER 65536
+#define ANNA_TRACE_NAME_LEN 40
+
+struct AnnaTraceEvent {
+    char name[ANNA_TRACE_NAME_LEN];
+    const char* cat;                        // always a string literal
+    int64_t ts, dur;                        // microseconds
+    uint32_t tid;
+};
+
+/*
+ * Every thread writes its spans into its own buffer, so recording is lock-free. The buffers
+ * are never freed, and are read only by Collect(), which only sees the events already published.
+ * The buffer of an exited thread is handed over to the next new thread, events included.
+ * When a buffer is full, the events are dropped (and counted). Nothing is recorded while disabled.
+ * */
+class AnnaTrace
+{
+public:
+    static void Enable(bool on);
+    static bool isEnabled()                 { return enabled.load(std::memory_order_relaxed); }
+
+    // Begin() returns 0 when disabled, and End() ignores such spans
+    static int64_t Begin()                  { return isEnabled()? Now() : 0; }
+    static void End(const char* cat, const char* name, int64_t start);
+
+    static void setThreadName(const std::string& name);
+
+    // all the events recorded since the last Enable(true), sorted by their start time
+    static std::vector<AnnaTraceEvent> Collect(size_t* dropped = nullptr);
+    static bool WriteJSON(std::string fn);
+
+    static int64_t Now();
+
+private:
+    static std::atomic<bool> enabled;
+};
+
+// Scope tracer; must not be used in functions which might longjmp out of the scope (e.g. via lua_error() or lua_yield())
+class AnnaTraceSpan
+{
+public:
+    AnnaTraceSpan(const char* c, const char* n) : cat(c), name(n), start(AnnaTrace::Begin()) {}
+    ~AnnaTraceSpan()                        { if (start) AnnaTrace::End(cat,name,start); }
+
+private:
+    const char* cat;
+    const char* name;
+    int64_t start;
+};